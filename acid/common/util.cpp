@@ -61,6 +61,12 @@ uint64_t GetCurrentUS(){
     return tm.tv_sec * 1000ul * 1000ul + tm.tv_usec;
 }
 
+uint64_t GetSteadyMS(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ul + ts.tv_nsec / 1000000;
+}
+
 CycleTimerTocken CycleTimer(unsigned interval_ms, std::function<void()> cb, co::Scheduler* worker, int times) {
     if (!worker) {
         auto sc = co::Processer::GetCurrentScheduler();
@@ -39,6 +39,8 @@ std::string BacktraceToString(int size, int skip = 2, const std::string& prefix
 //时间
 uint64_t GetCurrentMS();
 uint64_t GetCurrentUS();
+// 单调时钟，不受系统时间调整的影响，只能用来计算时间间隔
+uint64_t GetSteadyMS();
 
 
 //bit
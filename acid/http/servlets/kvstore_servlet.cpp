@@ -31,6 +31,73 @@ struct Params {
     std::optional<std::string> key;
     std::optional<std::string> value;
 };
+
+bool ParseOps(const nlohmann::json& json, const char* name, std::vector<kvraft::CommandRequest>& ops) {
+    auto it = json.find(name);
+    if (it == json.end()) {
+        return true;
+    }
+    if (!it->is_array()) {
+        return false;
+    }
+    static const std::map<std::string, kvraft::Operation> operations = {
+            {"get", kvraft::GET}, {"put", kvraft::PUT}, {"append", kvraft::APPEND}, {"delete", kvraft::DELETE}};
+    for (auto& item: *it) {
+        auto command = item.find("command");
+        auto key = item.find("key");
+        if (command == item.end() || key == item.end() || !command->is_string() || !key->is_string()) {
+            return false;
+        }
+        auto op = operations.find(command->get<std::string>());
+        if (op == operations.end()) {
+            return false;
+        }
+        kvraft::CommandRequest request{.operation = op->second, .key = key->get<std::string>()};
+        auto value = item.find("value");
+        if (value != item.end() && value->is_string()) {
+            request.value = value->get<std::string>();
+        }
+        ops.push_back(std::move(request));
+    }
+    return true;
+}
+
+bool ParseTxn(const nlohmann::json& json, kvraft::TxnRequest& txn) {
+    static const std::map<std::string, kvraft::Compare::Result> results = {
+            {"==", kvraft::Compare::EQUAL}, {"!=", kvraft::Compare::NOT_EQUAL},
+            {">", kvraft::Compare::GREATER}, {"<", kvraft::Compare::LESS}};
+    auto it = json.find("compare");
+    if (it != json.end()) {
+        if (!it->is_array()) {
+            return false;
+        }
+        for (auto& item: *it) {
+            auto key = item.find("key");
+            auto result = item.find("result");
+            if (key == item.end() || result == item.end() || !key->is_string() || !result->is_string()) {
+                return false;
+            }
+            auto cmp_result = results.find(result->get<std::string>());
+            if (cmp_result == results.end()) {
+                return false;
+            }
+            kvraft::Compare cmp{.key = key->get<std::string>(), .result = cmp_result->second};
+            // "version" 比较版本号，否则比较 "value"
+            auto version = item.find("version");
+            auto value = item.find("value");
+            if (version != item.end() && version->is_number_integer()) {
+                cmp.target = kvraft::Compare::VERSION;
+                cmp.version = version->get<int64_t>();
+            } else if (value != item.end() && value->is_string()) {
+                cmp.value = value->get<std::string>();
+            } else {
+                return false;
+            }
+            txn.compares.push_back(std::move(cmp));
+        }
+    }
+    return ParseOps(json, "success", txn.success) && ParseOps(json, "failure", txn.failure);
+}
 }
 KVStoreServlet::KVStoreServlet(std::shared_ptr<acid::kvraft::KVServer> store)
     : Servlet("KVStoreServlet"), m_store(std::move(store)) {
@@ -70,6 +137,156 @@ int32_t KVStoreServlet::handle(HttpRequest::ptr request, HttpResponse::ptr respo
         kvraft::CommandResponse commandResponse = m_store->Clear();
         resp["msg"] = kvraft::toString(commandResponse.error);
         return 0;
+    } else if (command == "scan" || command == "prefix_scan") {
+        auto str = [&req](const char* name) {
+            auto it = req.find(name);
+            return it != req.end() && it->is_string() ? it->get<std::string>() : std::string{};
+        };
+        auto it = req.find("limit");
+        int64_t limit = it != req.end() && it->is_number_integer() ? it->get<int64_t>() : 0;
+        kvraft::ScanResponse scanResponse;
+        if (command == "scan") {
+            scanResponse = m_store->Scan(str("start"), str("end"), limit, str("token"));
+        } else {
+            scanResponse = m_store->PrefixScan(str("prefix"), limit, str("token"));
+        }
+        // 数组保持 key 的顺序
+        nlohmann::json data = nlohmann::json::array();
+        for (auto& [key, value]: scanResponse.kvs) {
+            data.push_back({{"key", key}, {"value", value}});
+        }
+        resp["msg"] = kvraft::toString(scanResponse.error);
+        resp["data"] = std::move(data);
+        resp["next"] = scanResponse.next;
+        return 0;
+    } else if (command == "multi_get" || command == "multi_delete") {
+        auto it = req.find("keys");
+        if (it == req.end() || !it->is_array()) {
+            resp["msg"] = "The request is missing keys";
+            return 0;
+        }
+        std::vector<std::string> keys;
+        for (auto& key: *it) {
+            if (!key.is_string()) {
+                resp["msg"] = "The keys must be strings";
+                return 0;
+            }
+            keys.push_back(key.get<std::string>());
+        }
+        kvraft::CommandResponse commandResponse = command == "multi_get" ? m_store->MultiGet(keys) : m_store->MultiDelete(keys);
+        auto results = kvraft::Unpack<std::vector<kvraft::KeyResult>>(commandResponse.value);
+        // 按请求中 key 的顺序返回每个 key 的结果
+        nlohmann::json data = nlohmann::json::array();
+        for (size_t i = 0; i < keys.size() && i < results.size(); ++i) {
+            nlohmann::json item = {{"key", keys[i]}, {"msg", kvraft::toString(results[i].error)}};
+            if (command == "multi_get") {
+                item["value"] = results[i].value;
+                item["version"] = results[i].version;
+            }
+            data.push_back(std::move(item));
+        }
+        resp["msg"] = kvraft::toString(commandResponse.error);
+        resp["data"] = std::move(data);
+        return 0;
+    } else if (command == "multi_put") {
+        auto it = req.find("kvs");
+        if (it == req.end() || !it->is_array()) {
+            resp["msg"] = "The request is missing kvs";
+            return 0;
+        }
+        std::vector<std::pair<std::string, std::string>> kvs;
+        for (auto& kv: *it) {
+            auto key = kv.find("key");
+            auto value = kv.find("value");
+            if (key == kv.end() || value == kv.end() || !key->is_string() || !value->is_string()) {
+                resp["msg"] = "Each kv must have a string key and value";
+                return 0;
+            }
+            kvs.emplace_back(key->get<std::string>(), value->get<std::string>());
+        }
+        kvraft::CommandResponse commandResponse = m_store->MultiPut(kvs);
+        resp["msg"] = kvraft::toString(commandResponse.error);
+        return 0;
+    } else if (command == "txn") {
+        kvraft::TxnRequest txn;
+        if (!ParseTxn(req, txn)) {
+            resp["msg"] = "The request has an invalid txn";
+            return 0;
+        }
+        kvraft::CommandResponse commandResponse = m_store->Txn(txn);
+        auto result = kvraft::Unpack<kvraft::TxnResponse>(commandResponse.value);
+        auto& ops = result.succeeded ? txn.success : txn.failure;
+        nlohmann::json data = nlohmann::json::array();
+        for (size_t i = 0; i < ops.size() && i < result.results.size(); ++i) {
+            data.push_back({{"key", ops[i].key},
+                            {"msg", kvraft::toString(result.results[i].error)},
+                            {"value", result.results[i].value},
+                            {"version", result.results[i].version}});
+        }
+        resp["msg"] = kvraft::toString(commandResponse.error);
+        resp["succeeded"] = result.succeeded;
+        resp["data"] = std::move(data);
+        return 0;
+    } else if (command == "lease_grant") {
+        auto it = req.find("ttl");
+        if (it == req.end() || !it->is_number_integer()) {
+            resp["msg"] = "The request is missing a ttl";
+            return 0;
+        }
+        kvraft::CommandResponse commandResponse = m_store->LeaseGrant(it->get<int64_t>());
+        auto lease = kvraft::Unpack<kvraft::Lease>(commandResponse.value);
+        resp["msg"] = kvraft::toString(commandResponse.error);
+        resp["lease"] = lease.id;
+        resp["ttl"] = lease.ttl;
+        return 0;
+    } else if (command == "lease_revoke" || command == "lease_keepalive") {
+        auto it = req.find("lease");
+        if (it == req.end() || !it->is_number_integer()) {
+            resp["msg"] = "The request is missing a lease";
+            return 0;
+        }
+        kvraft::CommandResponse commandResponse;
+        if (command == "lease_revoke") {
+            commandResponse = m_store->LeaseRevoke(it->get<int64_t>());
+        } else {
+            commandResponse = m_store->LeaseKeepAlive(it->get<int64_t>());
+            resp["ttl"] = kvraft::Unpack<kvraft::Lease>(commandResponse.value).ttl;
+        }
+        resp["msg"] = kvraft::toString(commandResponse.error);
+        return 0;
+    } else if (command == "transfer") {
+        auto it = req.find("target");
+        if (it == req.end() || !it->is_number_integer()) {
+            resp["msg"] = "The request is missing a target";
+            return 0;
+        }
+        kvraft::CommandResponse commandResponse = m_store->TransferLeadership(it->get<int64_t>());
+        resp["msg"] = kvraft::toString(commandResponse.error);
+        resp["leader"] = commandResponse.leaderId;
+        return 0;
+    } else if (command == "add_learner" || command == "promote" || command == "remove") {
+        auto it = req.find("target");
+        if (it == req.end() || !it->is_number_integer()) {
+            resp["msg"] = "The request is missing a target";
+            return 0;
+        }
+        int64_t target = it->get<int64_t>();
+        kvraft::CommandResponse commandResponse;
+        if (command == "add_learner") {
+            auto address = req.find("address");
+            if (address == req.end() || !address->is_string()) {
+                resp["msg"] = "The request is missing an address";
+                return 0;
+            }
+            commandResponse = m_store->AddLearner(target, address->get<std::string>());
+        } else if (command == "promote") {
+            commandResponse = m_store->PromoteLearner(target);
+        } else {
+            commandResponse = m_store->RemoveMember(target);
+        }
+        resp["msg"] = kvraft::toString(commandResponse.error);
+        resp["leader"] = commandResponse.leaderId;
+        return 0;
     }
 
     if (!params.key) {
@@ -91,7 +308,13 @@ int32_t KVStoreServlet::handle(HttpRequest::ptr request, HttpResponse::ptr respo
             return 0;
         }
         const std::string& value = *params.value;
-        commandResponse = m_store->Put(key, value);
+        // 带 "lease" 时绑定到租约上
+        auto lease = req.find("lease");
+        if (lease != req.end() && lease->is_number_integer()) {
+            commandResponse = m_store->Put(key, value, lease->get<int64_t>());
+        } else {
+            commandResponse = m_store->Put(key, value);
+        }
         resp["msg"] = kvraft::toString(commandResponse.error);
     } else if (command == "append") {
         if (!params.value) {
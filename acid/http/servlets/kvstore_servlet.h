@@ -33,6 +33,62 @@ public:
      *          ...
      *      }
      *  }
+     * command 为 scan、prefix_scan 时按 key 的顺序分页查询，"limit" 可选，"token" 为上一页返回的 "next"，
+     * response 的 "data" 为 [{"key": "", "value": ""}, ...]，"next" 为空表示没有更多数据
+     *  {
+     *      "command": "scan",
+     *      "start": "a",
+     *      "end": "b",
+     *      "limit": 100,
+     *      "token": ""
+     *  }
+     *  {
+     *      "command": "prefix_scan",
+     *      "prefix": "user:",
+     *      "limit": 100
+     *  }
+     * command 为 multi_get、multi_delete 时一次处理 "keys" 中的多个 key，multi_put 一次原子地写入 "kvs"，
+     * response 的 "data" 按 key 的顺序返回每个 key 的结果 [{"key": "", "msg": "", "value": ""}, ...]
+     *  {
+     *      "command": "multi_get",
+     *      "keys": ["key1", "key2"]
+     *  }
+     *  {
+     *      "command": "multi_put",
+     *      "kvs": [{"key": "key1", "value": "value1"}, ...]
+     *  }
+     * command 为 txn 时执行条件事务，"compare" 全部成立时执行 "success"，否则执行 "failure"，
+     * "result" 为 ==、!=、>、<，有 "version" 时比较版本号（0 表示不存在），否则比较 "value"，
+     * response 的 "succeeded" 为比较结果，"data" 为执行的每个操作的结果
+     *  {
+     *      "command": "txn",
+     *      "compare": [{"key": "lock", "result": "==", "version": 0}],
+     *      "success": [{"command": "put", "key": "lock", "value": "owner"}],
+     *      "failure": [{"command": "get", "key": "lock"}]
+     *  }
+     * command 为 lease_grant 时创建 "ttl" 毫秒的租约，response 的 "lease" 为租约 id，
+     * put 带上 "lease" 时 key 绑定到租约上，lease_keepalive 续约，lease_revoke 撤销租约并删除绑定的 key
+     *  {
+     *      "command": "lease_grant",
+     *      "ttl": 10000
+     *  }
+     *  {
+     *      "command": "put",
+     *      "key": "session:1",
+     *      "value": "user",
+     *      "lease": 1
+     *  }
+     * command 为 transfer 时把领导权转移给 "target" 指定的节点，response 的 "leader" 为当前已知的 leader
+     *  {
+     *      "command": "transfer",
+     *      "target": 2
+     *  }
+     * command 为 add_learner、promote、remove 时变更集群成员，add_learner 需要 "address" 指定 raft 地址
+     *  {
+     *      "command": "add_learner",
+     *      "target": 4,
+     *      "address": "localhost:7004"
+     *  }
      */
     int32_t handle(HttpRequest::ptr request, HttpResponse::ptr response, HttpSession::ptr session) override;
 private:
@@ -14,6 +14,7 @@ namespace acid::kvraft {
 using namespace acid::rpc;
 
 inline const std::string COMMAND = "KVServer::handleCommand";
+inline const std::string SCAN = "KVServer::handleScan";
 
 inline const std::string KEYEVENTS_PUT = "put";
 inline const std::string KEYEVENTS_DEL = "del";
@@ -35,6 +36,10 @@ enum Error {
     WRONG_LEADER,
     TIMEOUT,
     CLOSED,
+    BAD_REQUEST,
+    NO_LEASE,
+    CONF_PENDING,   // 上一个成员变更还没有完成
+    NOT_CAUGHT_UP,  // learner 的日志还没有追上
 };
 
 inline std::string toString(Error err) {
@@ -45,6 +50,10 @@ inline std::string toString(Error err) {
         case WRONG_LEADER: str = "Wrong Leader"; break;
         case TIMEOUT: str = "Timeout"; break;
         case CLOSED: str = "Closed"; break;
+        case BAD_REQUEST: str = "Bad Request"; break;
+        case NO_LEASE: str = "No Lease"; break;
+        case CONF_PENDING: str = "Conf Change Pending"; break;
+        case NOT_CAUGHT_UP: str = "Not Caught Up"; break;
         default: str = "Unexpect Error";
     }
     return str;
@@ -56,6 +65,16 @@ enum Operation {
     APPEND,
     DELETE,
     CLEAR,
+    BATCH,      // 服务端合并的一批命令，只出现在日志中
+    MULTI_GET,      // value 为打包的 key 列表
+    MULTI_PUT,      // value 为打包的键值对列表
+    MULTI_DELETE,   // value 为打包的 key 列表
+    TXN,            // value 为打包的 TxnRequest
+    LEASE_GRANT,        // value 为打包的 Lease，只需要 ttl
+    LEASE_REVOKE,       // value 为打包的 Lease，只需要 id
+    LEASE_KEEPALIVE,    // value 为打包的 Lease，只需要 id，由 Leader 处理，不进入日志
+    LEASE_PUT,          // value 为打包的 (lease id, value)
+    LEASE_EXPIRE,       // value 为打包的过期租约 id 列表，只由 Leader 提交
 };
 
 inline std::string toString(Operation op) {
@@ -66,6 +85,16 @@ inline std::string toString(Operation op) {
         case APPEND: str = "APPEND"; break;
         case DELETE: str = "DELETE"; break;
         case CLEAR: str = "CLEAR"; break;
+        case BATCH: str = "BATCH"; break;
+        case MULTI_GET: str = "MULTI_GET"; break;
+        case MULTI_PUT: str = "MULTI_PUT"; break;
+        case MULTI_DELETE: str = "MULTI_DELETE"; break;
+        case TXN: str = "TXN"; break;
+        case LEASE_GRANT: str = "LEASE_GRANT"; break;
+        case LEASE_REVOKE: str = "LEASE_REVOKE"; break;
+        case LEASE_KEEPALIVE: str = "LEASE_KEEPALIVE"; break;
+        case LEASE_PUT: str = "LEASE_PUT"; break;
+        case LEASE_EXPIRE: str = "LEASE_EXPIRE"; break;
         default: str = "Unexpect Operation";
     }
     return str;
@@ -94,5 +123,131 @@ struct CommandResponse {
     }
 };
 
+/**
+ * @brief 多 key 操作中每个 key 的结果，按请求中 key 的顺序打包在 CommandResponse 的 value 中
+ */
+struct KeyResult {
+    Error error = OK;
+    std::string value;
+    // 操作之后 key 的版本号，不存在为 0
+    int64_t version = 0;
+};
+
+/**
+ * @brief 事务的比较条件
+ * @details 比较 key 当前的 value 或版本号，不存在的 key 版本号为 0，
+ * 所以 {key, VERSION, GREATER, 0} 表示 key 存在，{key, VERSION, EQUAL, 0} 表示 key 不存在。
+ * 不存在的 key 的 value 比较总是不成立。
+ */
+struct Compare {
+    enum Target {
+        VALUE,
+        VERSION,
+    };
+    enum Result {
+        EQUAL,
+        NOT_EQUAL,
+        GREATER,
+        LESS,
+    };
+    std::string key;
+    Target target = VALUE;
+    Result result = EQUAL;
+    std::string value;
+    int64_t version = 0;
+};
+
+/**
+ * @brief 条件事务，所有比较条件都成立时执行 success，否则执行 failure，
+ * 比较和执行在一条日志中原子地完成。分支中只能使用 GET、PUT、APPEND、DELETE，后面的操作能看到前面操作的结果。
+ */
+struct TxnRequest {
+    std::vector<Compare> compares;
+    std::vector<CommandRequest> success;
+    std::vector<CommandRequest> failure;
+};
+
+/**
+ * @brief 条件事务的结果，打包在 CommandResponse 的 value 中
+ */
+struct TxnResponse {
+    // 比较条件是否全部成立
+    bool succeeded = false;
+    // 执行的分支中每个操作的结果
+    std::vector<KeyResult> results;
+};
+
+/**
+ * @brief 租约，绑定在租约上的 key 在租约过期或者被撤销时一起删除
+ */
+struct Lease {
+    int64_t id = 0;
+    // 存活时间（ms）
+    int64_t ttl = 0;
+};
+
+/**
+ * @brief 把多 key 操作的参数和结果打包进 CommandRequest 和 CommandResponse 的 value，
+ * 这两个结构会被持久化在日志和快照中，不能增加字段
+ */
+template<typename T>
+std::string Pack(const T& t) {
+    Serializer s;
+    s << t;
+    s.reset();
+    return s.toString();
+}
+
+template<typename T>
+T Unpack(const std::string& str) {
+    T t{};
+    if (str.empty()) {
+        return t;
+    }
+    Serializer s(str);
+    s >> t;
+    return t;
+}
+
+/**
+ * @brief 范围查询，按 key 的顺序返回 [start, end) 内的键值对
+ */
+struct ScanRequest {
+    std::string start;  // 起始 key（包含）
+    std::string end;    // 结束 key（不包含），为空表示没有上界
+    int64_t limit;      // 最多返回的数量，不大于 0 或者超过服务端上限时使用服务端的上限
+    std::string token;  // 续传 token，上一次查询返回的 next，不为空时从这里继续
+    std::string toString() const {
+        std::string str = fmt::format("start: {}, end: {}, limit: {}, token: {}", start, end, limit, token);
+        return "{" + str + "}";
+    }
+};
+
+struct ScanResponse {
+    Error error = OK;
+    std::vector<std::pair<std::string, std::string>> kvs;
+    std::string next;   // 续传 token，为空表示范围内已经没有更多数据
+    int64_t leaderId = -1;
+    std::string toString() const {
+        std::string str = fmt::format("error: {}, kvs: {}, next: {}, leaderId: {}", kvraft::toString(error), kvs.size(), next, leaderId);
+        return "{" + str + "}";
+    }
+};
+
+/**
+ * @brief 前缀的上界，所有以 prefix 开头的 key 都小于它，为空表示没有上界
+ */
+inline std::string PrefixEnd(std::string prefix) {
+    while (!prefix.empty()) {
+        auto c = (unsigned char)prefix.back();
+        if (c != 0xff) {
+            prefix.back() = (char)(c + 1);
+            return prefix;
+        }
+        prefix.pop_back();
+    }
+    return prefix;
+}
+
 }
 #endif //ACID_COMMOM_H
@@ -0,0 +1,174 @@
+//
+// Created by zavier on 2023/2/18.
+//
+
+#include "kv_store.h"
+
+namespace acid::kvraft {
+
+const std::string* KVStore::get(const std::string& key) const {
+    if (m_frozen) {
+        auto it = m_delta.find(key);
+        if (it != m_delta.end()) {
+            return it->second ? &it->second->value : nullptr;
+        }
+        if (m_cleared) {
+            return nullptr;
+        }
+    }
+    auto it = m_base->find(key);
+    return it == m_base->end() ? nullptr : &it->second;
+}
+
+int64_t KVStore::version(const std::string& key) const {
+    if (m_frozen) {
+        auto it = m_delta.find(key);
+        if (it != m_delta.end()) {
+            return it->second ? it->second->version : 0;
+        }
+        if (m_cleared) {
+            return 0;
+        }
+    }
+    auto it = m_versions->find(key);
+    return it == m_versions->end() ? 0 : it->second;
+}
+
+void KVStore::put(const std::string& key, const std::string& value) {
+    if (!m_frozen) {
+        (*m_base)[key] = value;
+        ++(*m_versions)[key];
+        return;
+    }
+    m_delta[key] = Item{.value = value, .version = version(key) + 1};
+}
+
+void KVStore::append(const std::string& key, const std::string& value) {
+    if (!m_frozen) {
+        (*m_base)[key] += value;
+        ++(*m_versions)[key];
+        return;
+    }
+    const std::string* old = get(key);
+    m_delta[key] = Item{.value = old ? *old + value : value, .version = version(key) + 1};
+}
+
+bool KVStore::erase(const std::string& key) {
+    if (!m_frozen) {
+        m_versions->erase(key);
+        return m_base->erase(key);
+    }
+    if (!get(key)) {
+        return false;
+    }
+    m_delta[key] = std::nullopt;
+    return true;
+}
+
+void KVStore::clear() {
+    if (!m_frozen) {
+        m_base->clear();
+        m_versions->clear();
+        return;
+    }
+    m_delta.clear();
+    m_cleared = true;
+}
+
+std::vector<std::pair<std::string, std::string>> KVStore::scan(const std::string& start, const std::string& end, size_t limit) const {
+    std::vector<std::pair<std::string, std::string>> kvs;
+    auto in_range = [&end](const std::string& key) { return end.empty() || key < end;};
+    auto base = m_base->lower_bound(start);
+    if (m_frozen && m_cleared) {
+        base = m_base->end();
+    }
+    // 没有冻结时增量层为空
+    auto delta = m_delta.lower_bound(start);
+    // 合并基础数据和增量层，同一个 key 以增量层为准
+    while (kvs.size() < limit) {
+        bool has_base = base != m_base->end() && in_range(base->first);
+        bool has_delta = delta != m_delta.end() && in_range(delta->first);
+        if (!has_base && !has_delta) {
+            break;
+        }
+        if (has_delta && (!has_base || delta->first <= base->first)) {
+            if (has_base && base->first == delta->first) {
+                ++base;
+            }
+            if (delta->second) {
+                kvs.emplace_back(delta->first, delta->second->value);
+            }
+            ++delta;
+        } else {
+            kvs.emplace_back(base->first, base->second);
+            ++base;
+        }
+    }
+    return kvs;
+}
+
+KVStore::View KVStore::freeze() {
+    if (m_frozen) {
+        return {};
+    }
+    m_frozen = true;
+    return {.data = m_base, .versions = m_versions};
+}
+
+void KVStore::thaw() {
+    if (!m_frozen) {
+        return;
+    }
+    m_frozen = false;
+    if (m_cleared) {
+        m_base = std::make_shared<KVMap>();
+        m_versions = std::make_shared<VersionMap>();
+        m_cleared = false;
+    } else {
+        // 视图还没有被释放，不能原地修改
+        if (m_base.use_count() > 1) {
+            m_base = std::make_shared<KVMap>(*m_base);
+        }
+        if (m_versions.use_count() > 1) {
+            m_versions = std::make_shared<VersionMap>(*m_versions);
+        }
+    }
+    for (auto& [key, item] : m_delta) {
+        if (item) {
+            (*m_base)[key] = std::move(item->value);
+            (*m_versions)[key] = item->version;
+        } else {
+            m_base->erase(key);
+            m_versions->erase(key);
+        }
+    }
+    m_delta.clear();
+}
+
+void KVStore::restore(KVMap data, VersionMap versions) {
+    m_base = std::make_shared<KVMap>(std::move(data));
+    m_versions = std::make_shared<VersionMap>(std::move(versions));
+    m_delta.clear();
+    m_cleared = false;
+    m_frozen = false;
+}
+
+KVStore::KVMap KVStore::dump() const {
+    if (!m_frozen) {
+        return *m_base;
+    }
+    KVMap data;
+    if (!m_cleared) {
+        data = *m_base;
+    }
+    for (auto& [key, item] : m_delta) {
+        if (item) {
+            data[key] = item->value;
+        } else {
+            data.erase(key);
+        }
+    }
+    return data;
+}
+
+}
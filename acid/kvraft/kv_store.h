@@ -0,0 +1,98 @@
+//
+// Created by zavier on 2023/2/18.
+//
+
+#ifndef ACID_KV_STORE_H
+#define ACID_KV_STORE_H
+
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace acid::kvraft {
+/**
+ * @brief 支持写时复制快照的键值存储
+ * @details
+ * freeze() 冻结当前的数据作为一个时间点的只读视图，之后的修改写入增量层，不影响视图，
+ * 所以快照的序列化和落盘可以在后台进行。视图用完之后调用 thaw() 把增量合并回基础数据。
+ * 冻结和合并的开销只和冻结期间修改的 key 数量有关，和数据总量无关。
+ * 每个 key 记录一个版本号，创建时为 1，每次修改加 1，删除后重新从 1 开始，不存在的 key 版本号为 0。
+ */
+class KVStore {
+public:
+    using KVMap = std::map<std::string, std::string>;
+    using VersionMap = std::map<std::string, int64_t>;
+    /**
+     * @brief 冻结时的只读视图
+     */
+    struct View {
+        std::shared_ptr<const KVMap> data;
+        std::shared_ptr<const VersionMap> versions;
+    };
+
+    KVStore() : m_base(std::make_shared<KVMap>()), m_versions(std::make_shared<VersionMap>()) {}
+    /**
+     * @brief 读取一个 key
+     * @return 不存在返回 nullptr
+     */
+    const std::string* get(const std::string& key) const;
+    /**
+     * @brief key 的版本号，不存在返回 0
+     */
+    int64_t version(const std::string& key) const;
+
+    void put(const std::string& key, const std::string& value);
+
+    void append(const std::string& key, const std::string& value);
+    /**
+     * @brief 删除一个 key
+     * @return key 是否存在
+     */
+    bool erase(const std::string& key);
+
+    void clear();
+    /**
+     * @brief 按 key 的顺序读取 [start, end) 内的前 limit 个键值对
+     * @param end 为空表示没有上界
+     */
+    std::vector<std::pair<std::string, std::string>> scan(const std::string& start, const std::string& end, size_t limit) const;
+    /**
+     * @brief 冻结当前数据
+     * @return 只读视图，已经处于冻结状态则返回空的视图
+     */
+    View freeze();
+    /**
+     * @brief 结束冻结，把增量合并回基础数据，调用前应该释放 freeze() 返回的视图
+     */
+    void thaw();
+    /**
+     * @brief 用快照中的数据替换全部数据，同时结束冻结
+     * @param versions 和 data 的 key 相同
+     */
+    void restore(KVMap data, VersionMap versions);
+    /**
+     * @brief 导出当前的全部数据
+     */
+    KVMap dump() const;
+
+    bool frozen() const { return m_frozen;}
+private:
+    struct Item {
+        std::string value;
+        int64_t version;
+    };
+    // 基础数据，冻结期间只读
+    std::shared_ptr<KVMap> m_base;
+    // 基础数据的版本号，和基础数据一起冻结
+    std::shared_ptr<VersionMap> m_versions;
+    // 冻结期间的修改，值为空表示删除
+    std::map<std::string, std::optional<Item>> m_delta;
+    // 冻结期间是否清空过数据，清空后基础数据全部失效
+    bool m_cleared = false;
+    bool m_frozen = false;
+};
+
+}
+#endif //ACID_KV_STORE_H
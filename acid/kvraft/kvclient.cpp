@@ -87,22 +87,69 @@ kvraft::Error KVClient::Delete(const std::string& key) {
     return Command(request).error;
 }
 
+kvraft::Error KVClient::MultiGet(const std::vector<std::string>& keys, std::vector<KeyResult>& results) {
+    CommandRequest request{.operation = MULTI_GET, .value = Pack(keys)};
+    CommandResponse response = Command(request);
+    results = Unpack<std::vector<KeyResult>>(response.value);
+    return response.error;
+}
+
+kvraft::Error KVClient::MultiPut(const std::vector<std::pair<std::string, std::string>>& kvs) {
+    CommandRequest request{.operation = MULTI_PUT, .value = Pack(kvs)};
+    return Command(request).error;
+}
+
+kvraft::Error KVClient::MultiDelete(const std::vector<std::string>& keys, std::vector<KeyResult>& results) {
+    CommandRequest request{.operation = MULTI_DELETE, .value = Pack(keys)};
+    CommandResponse response = Command(request);
+    results = Unpack<std::vector<KeyResult>>(response.value);
+    return response.error;
+}
+
+kvraft::Error KVClient::Txn(const TxnRequest& txn, TxnResponse& result) {
+    CommandRequest request{.operation = TXN, .value = Pack(txn)};
+    CommandResponse response = Command(request);
+    result = Unpack<TxnResponse>(response.value);
+    return response.error;
+}
+
+kvraft::Error KVClient::Put(const std::string& key, const std::string& value, int64_t lease) {
+    CommandRequest request{.operation = LEASE_PUT, .key = key, .value = Pack(std::make_pair(lease, value))};
+    return Command(request).error;
+}
+
+kvraft::Error KVClient::LeaseGrant(int64_t ttl, int64_t& id) {
+    CommandRequest request{.operation = LEASE_GRANT, .value = Pack(Lease{.ttl = ttl})};
+    CommandResponse response = Command(request);
+    id = Unpack<Lease>(response.value).id;
+    return response.error;
+}
+
+kvraft::Error KVClient::LeaseRevoke(int64_t id) {
+    CommandRequest request{.operation = LEASE_REVOKE, .value = Pack(Lease{.id = id})};
+    return Command(request).error;
+}
+
+kvraft::Error KVClient::LeaseKeepAlive(int64_t id) {
+    CommandRequest request{.operation = LEASE_KEEPALIVE, .value = Pack(Lease{.id = id})};
+    return Command(request).error;
+}
+
 kvraft::Error KVClient::Clear() {
     CommandRequest request{.operation = CLEAR};
     return Command(request).error;
 }
 
-CommandResponse KVClient::Command(CommandRequest& request) {
-    request.clientId = m_clientId;
-    request.commandId = m_commandId;
+template<typename Response, typename Request>
+Response KVClient::Invoke(const std::string& method, const Request& request) {
     while (!m_stop) {
-        CommandResponse response;
+        Response response;
         if (!connect()) {
             m_leaderId = nextLeaderId();
             co_sleep(s_connect_delay);
             continue;
         }
-        Result<CommandResponse> result = call<CommandResponse>(COMMAND, request);
+        Result<Response> result = call<Response>(method, request);
         if (result.getCode() == RpcState::RPC_SUCCESS) {
             response = result.getVal();
         }
@@ -118,12 +165,35 @@ CommandResponse KVClient::Command(CommandRequest& request) {
             RpcClient::close();
             continue;
         }
-        ++m_commandId;
         return response;
     }
     return {.error = Error::CLOSED};
 }
 
+kvraft::Error KVClient::Scan(const std::string& start, const std::string& end, int64_t limit,
+                             std::vector<std::pair<std::string, std::string>>& kvs, std::string& token) {
+    ScanRequest request{.start = start, .end = end, .limit = limit, .token = token};
+    ScanResponse response = Invoke<ScanResponse>(SCAN, request);
+    kvs = std::move(response.kvs);
+    token = std::move(response.next);
+    return response.error;
+}
+
+kvraft::Error KVClient::PrefixScan(const std::string& prefix, int64_t limit,
+                                   std::vector<std::pair<std::string, std::string>>& kvs, std::string& token) {
+    return Scan(prefix, PrefixEnd(prefix), limit, kvs, token);
+}
+
+CommandResponse KVClient::Command(CommandRequest& request) {
+    request.clientId = m_clientId;
+    request.commandId = m_commandId;
+    CommandResponse response = Invoke<CommandResponse>(COMMAND, request);
+    if (response.error != Error::CLOSED) {
+        ++m_commandId;
+    }
+    return response;
+}
+
 bool KVClient::connect() {
     if (!isClose()) {
         return true;
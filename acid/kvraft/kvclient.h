@@ -21,7 +21,58 @@ public:
     kvraft::Error Put(const std::string& key, const std::string& value);
     kvraft::Error Append(const std::string& key, const std::string& value);
     kvraft::Error Delete(const std::string& key);
+    /**
+     * @brief 一次读取多个 key
+     * @param[out] results 按 keys 的顺序返回每个 key 的结果，不存在的 key 为 NO_KEY
+     */
+    kvraft::Error MultiGet(const std::vector<std::string>& keys, std::vector<KeyResult>& results);
+    /**
+     * @brief 原子地写入多个键值对
+     */
+    kvraft::Error MultiPut(const std::vector<std::pair<std::string, std::string>>& kvs);
+    /**
+     * @brief 原子地删除多个 key
+     * @param[out] results 按 keys 的顺序返回每个 key 的结果，不存在的 key 为 NO_KEY
+     */
+    kvraft::Error MultiDelete(const std::vector<std::string>& keys, std::vector<KeyResult>& results);
+    /**
+     * @brief 条件事务，一次往返完成比较并交换、计数器、锁等读-改-写操作
+     * @param[out] result 比较条件是否成立以及执行的分支中每个操作的结果
+     */
+    kvraft::Error Txn(const TxnRequest& txn, TxnResponse& result);
+    /**
+     * @brief 写入一个绑定在租约上的 key，租约过期或者被撤销时自动删除
+     */
+    kvraft::Error Put(const std::string& key, const std::string& value, int64_t lease);
+    /**
+     * @brief 创建租约
+     * @param[in] ttl 存活时间（ms）
+     * @param[out] id 分配的租约 id
+     */
+    kvraft::Error LeaseGrant(int64_t ttl, int64_t& id);
+    /**
+     * @brief 撤销租约，删除绑定在上面的所有 key
+     */
+    kvraft::Error LeaseRevoke(int64_t id);
+    /**
+     * @brief 续约，需要在 ttl 内周期性地调用，租约已经过期返回 NO_LEASE
+     */
+    kvraft::Error LeaseKeepAlive(int64_t id);
     kvraft::Error Clear();
+    /**
+     * @brief 按 key 的顺序查询 [start, end) 内的键值对
+     * @param[in] end 为空表示没有上界
+     * @param[in] limit 最多返回的数量，不大于 0 时使用服务端的上限
+     * @param[in,out] token 续传 token，第一次查询传空，返回后为空表示已经没有更多数据
+     */
+    kvraft::Error Scan(const std::string& start, const std::string& end, int64_t limit,
+                       std::vector<std::pair<std::string, std::string>>& kvs, std::string& token);
+    /**
+     * @brief 按 key 的顺序查询以 prefix 开头的键值对
+     * @param[in,out] token 续传 token，第一次查询传空，返回后为空表示已经没有更多数据
+     */
+    kvraft::Error PrefixScan(const std::string& prefix, int64_t limit,
+                             std::vector<std::pair<std::string, std::string>>& kvs, std::string& token);
 
     /**
      * 订阅频道，会阻塞 \n
@@ -72,6 +123,11 @@ public:
     void patternUnsubscribe(const std::string& pattern);
 private:
     CommandResponse Command(CommandRequest& request);
+    /**
+     * @brief 调用 leader，连接失败或者不是 leader 时换一个节点重试
+     */
+    template<typename Response, typename Request>
+    Response Invoke(const std::string& method, const Request& request);
     bool connect();
     int64_t nextLeaderId();
     static int64_t GetRandom();
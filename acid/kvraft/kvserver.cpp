@@ -8,6 +8,56 @@
 namespace acid::kvraft {
 using namespace acid;
 static auto g_logger = GetLogInstance();
+// 状态机分区数量，创建 KVServer 时读取，快照格式和分区数量无关
+static ConfigVar<uint32_t>::ptr g_apply_workers =
+        Config::Lookup<uint32_t>("kvraft.apply.workers", 1, "kvserver state machine partitions applied in parallel");
+// 合并写命令时等待更多命令到达的时间，0 表示只合并已经在排队的命令
+static ConfigVar<uint64_t>::ptr g_batch_linger =
+        Config::Lookup<uint64_t>("kvraft.batch.linger", 0, "kvserver command batch linger(ms)");
+// 一次范围查询最多返回的数量
+static ConfigVar<uint64_t>::ptr g_scan_max_limit =
+        Config::Lookup<uint64_t>("kvraft.scan.max_limit", 1000, "kvserver max key-value pairs returned by one scan");
+// 一条日志最多合并的命令数
+static ConfigVar<uint64_t>::ptr g_batch_max_commands =
+        Config::Lookup<uint64_t>("kvraft.batch.max_commands", 256, "kvserver max commands in one raft entry");
+// Leader 检查租约过期的间隔
+static ConfigVar<uint64_t>::ptr g_lease_check_interval =
+        Config::Lookup<uint64_t>("kvraft.lease.check_interval", 500, "kvserver lease expiration check interval(ms)");
+// 一条日志最多删除的过期租约数
+static ConfigVar<uint64_t>::ptr g_lease_max_expire =
+        Config::Lookup<uint64_t>("kvraft.lease.max_expire", 1000, "kvserver max leases expired in one raft entry");
+
+/**
+ * @brief 解析一条日志中的命令，合并的日志以 BATCH 开头，之前版本的日志只有一个命令
+ */
+static std::vector<CommandRequest> DecodeCommands(const ApplyMsg& msg) {
+    Serializer s(msg.data);
+    Operation op;
+    s >> op;
+    std::vector<CommandRequest> requests;
+    if (op == BATCH) {
+        s >> requests;
+    } else {
+        s.reset();
+        requests.emplace_back();
+        s >> requests.back();
+    }
+    return requests;
+}
+
+/**
+ * @brief 参数能否解码
+ */
+template<typename T>
+static bool CanUnpack(const std::string& str) {
+    try {
+        Unpack<T>(str);
+    } catch (...) {
+        return false;
+    }
+    return true;
+}
+
 static int64_t GetRandom() {
     static std::default_random_engine engine(acid::GetCurrentMS());
     static std::uniform_int_distribution<int64_t> dist(0, INT64_MAX);
@@ -16,8 +66,10 @@ static int64_t GetRandom() {
 
 KVServer::KVServer(std::map<int64_t, std::string>& servers, int64_t id, Persister::ptr persister, int64_t maxRaftState)
     : m_id(id)
+    , m_data(std::max<uint32_t>(1, g_apply_workers->getValue()))
     , m_persister(persister)
     , m_maxRaftState(maxRaftState) {
+    m_leaseBindings.resize(m_data.size());
     Address::ptr addr = Address::LookupAny(servers[id]);
     m_raft = std::make_unique<RaftNode>(servers, id, persister, m_applychan);
     while (!m_raft->bind(addr)) {
@@ -27,6 +79,9 @@ KVServer::KVServer(std::map<int64_t, std::string>& servers, int64_t id, Persiste
     m_raft->registerMethod(COMMAND, [this](CommandRequest request) {
         return handleCommand(std::move(request));
     });
+    m_raft->registerMethod(SCAN, [this](ScanRequest request) {
+        return handleScan(std::move(request));
+    });
 }
 
 KVServer::~KVServer() {
@@ -38,11 +93,19 @@ void KVServer::start() {
     go [this] {
         applier();
     };
+    go [this] {
+        batcher();
+    };
+    m_leaseTimer = CycleTimer(g_lease_check_interval->getValue(), [this] {
+        expireLeases();
+    });
     m_raft->start();
 }
 
 void KVServer::stop() {
     std::unique_lock<MutexType> lock(m_mutex);
+    m_leaseTimer.stop();
+    m_commandChan.close();
     m_raft->stop();
 }
 
@@ -66,56 +129,180 @@ CommandResponse KVServer::Delete(const std::string& key) {
     return handleCommand(request);
 }
 
+CommandResponse KVServer::MultiGet(const std::vector<std::string>& keys) {
+    CommandRequest request{.operation = MULTI_GET, .value = Pack(keys), .commandId = GetRandom()};
+    return handleCommand(request);
+}
+
+CommandResponse KVServer::MultiPut(const std::vector<std::pair<std::string, std::string>>& kvs) {
+    CommandRequest request{.operation = MULTI_PUT, .value = Pack(kvs), .commandId = GetRandom()};
+    return handleCommand(request);
+}
+
+CommandResponse KVServer::MultiDelete(const std::vector<std::string>& keys) {
+    CommandRequest request{.operation = MULTI_DELETE, .value = Pack(keys), .commandId = GetRandom()};
+    return handleCommand(request);
+}
+
+CommandResponse KVServer::Txn(const TxnRequest& txn) {
+    CommandRequest request{.operation = TXN, .value = Pack(txn), .commandId = GetRandom()};
+    return handleCommand(request);
+}
+
+CommandResponse KVServer::Put(const std::string& key, const std::string& value, int64_t lease) {
+    CommandRequest request{.operation = LEASE_PUT, .key = key, .value = Pack(std::make_pair(lease, value)), .commandId = GetRandom()};
+    return handleCommand(request);
+}
+
+CommandResponse KVServer::LeaseGrant(int64_t ttl) {
+    CommandRequest request{.operation = LEASE_GRANT, .value = Pack(Lease{.ttl = ttl}), .commandId = GetRandom()};
+    return handleCommand(request);
+}
+
+CommandResponse KVServer::LeaseRevoke(int64_t id) {
+    CommandRequest request{.operation = LEASE_REVOKE, .value = Pack(Lease{.id = id}), .commandId = GetRandom()};
+    return handleCommand(request);
+}
+
+CommandResponse KVServer::LeaseKeepAlive(int64_t id) {
+    CommandRequest request{.operation = LEASE_KEEPALIVE, .value = Pack(Lease{.id = id}), .commandId = GetRandom()};
+    return handleCommand(request);
+}
+
 CommandResponse KVServer::Clear() {
     CommandRequest request{.operation = CLEAR, .commandId = GetRandom()};
     return handleCommand(request);
 }
 
+CommandResponse KVServer::TransferLeadership(int64_t target) {
+    CommandResponse response;
+    if (!m_raft->transferLeadership(target)) {
+        response.error = m_raft->isLeader() ? TIMEOUT : WRONG_LEADER;
+    }
+    response.leaderId = m_raft->getLeaderId();
+    return response;
+}
+
+/**
+ * @brief 成员变更的结果对应的错误，只有不是 Leader 时客户端需要重定向
+ */
+static Error ToError(ConfChangeResult result) {
+    switch (result) {
+        case ConfChangeResult::Ok: return OK;
+        case ConfChangeResult::NotLeader: return WRONG_LEADER;
+        case ConfChangeResult::Pending: return CONF_PENDING;
+        case ConfChangeResult::Invalid: return BAD_REQUEST;
+        case ConfChangeResult::NotCaughtUp: return NOT_CAUGHT_UP;
+    }
+    return BAD_REQUEST;
+}
+
+CommandResponse KVServer::AddLearner(int64_t id, const std::string& address) {
+    CommandResponse response;
+    response.error = ToError(m_raft->addLearner(id, address));
+    response.leaderId = m_raft->getLeaderId();
+    return response;
+}
+
+CommandResponse KVServer::PromoteLearner(int64_t id) {
+    CommandResponse response;
+    response.error = ToError(m_raft->promoteLearner(id));
+    response.leaderId = m_raft->getLeaderId();
+    return response;
+}
+
+CommandResponse KVServer::RemoveMember(int64_t id) {
+    CommandResponse response;
+    response.error = ToError(m_raft->removeMember(id));
+    response.leaderId = m_raft->getLeaderId();
+    return response;
+}
+
 CommandResponse KVServer::handleCommand(CommandRequest request) {
     CommandResponse response;
     co_defer_scope {
         SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] processes CommandRequest {} with CommandResponse {}",
                             m_id, request.toString(), response.toString());
     };
-    std::unique_lock<MutexType> lock(m_mutex);
-    if (request.operation != GET && isDuplicateRequest(request.clientId, request.commandId)) {
-        response = m_lastOperation[request.clientId].second;
+    if (!isValidRequest(request)) {
+        response.error = BAD_REQUEST;
         return response;
     }
-    lock.unlock();
-    auto entry = m_raft->propose(request);
-    if (!entry) {
-        response.error = WRONG_LEADER;
-        response.leaderId = m_raft->getLeaderId();
+    if (isReadOnly(request)) {
+        response = handleRead(request);
         return response;
     }
-    lock.lock();
-    auto chan = m_nofiyChans[entry->index];
-    lock.unlock();
+    if (request.operation == LEASE_KEEPALIVE) {
+        response = handleKeepAlive(request);
+        return response;
+    }
+    response = submitCommand(request);
+    return response;
+}
 
+CommandResponse KVServer::submitCommand(const CommandRequest& request) {
+    CommandResponse response;
+    std::unique_lock<MutexType> lock(m_mutex);
+    if (isDuplicateRequest(request.clientId, request.commandId)) {
+        response = m_lastOperation[request.clientId].second;
+        return response;
+    }
+    lock.unlock();
+    // 交给 batcher 和其他并发的写命令合并成一条日志
+    co::co_chan<CommandResponse> chan(1);
+    m_commandChan << PendingCommand{.request = request, .chan = chan};
     if (!chan.TimedPop(response, std::chrono::milliseconds(acid::Config::Lookup<uint64_t>("raft.rpc.timeout")->getValue()))) {
         response.error = TIMEOUT;
     }
-    lock.lock();
-    m_nofiyChans.erase(entry->index);
     if (response.error == Error::OK) {
         switch (request.operation) {
             case PUT:
-                go [key = request.key, this] {
-                    m_raft->publish(TOPIC_KEYEVENTS_PUT, key);
-                    m_raft->publish(TOPIC_KEYSPACE + key, KEYEVENTS_PUT);
+            case APPEND:
+            case DELETE:
+                go [operation = request.operation, key = request.key, this] {
+                    publishKeyEvent(operation, key);
                 };
                 break;
-            case APPEND:
-                go [key = request.key, this] {
-                    m_raft->publish(TOPIC_KEYEVENTS_APPEND, key);
-                    m_raft->publish(TOPIC_KEYSPACE + key, KEYEVENTS_APPEND);
+            case MULTI_PUT:
+                go [kvs = Unpack<std::vector<std::pair<std::string, std::string>>>(request.value), this] {
+                    for (auto& [key, _]: kvs) {
+                        publishKeyEvent(PUT, key);
+                    }
                 };
                 break;
-            case DELETE:
+            case MULTI_DELETE:
+                go [keys = Unpack<std::vector<std::string>>(request.value),
+                    results = Unpack<std::vector<KeyResult>>(response.value), this] {
+                    // 不存在的 key 没有被删除，不发布事件
+                    for (size_t i = 0; i < keys.size() && i < results.size(); ++i) {
+                        if (results[i].error == OK) {
+                            publishKeyEvent(DELETE, keys[i]);
+                        }
+                    }
+                };
+                break;
+            case LEASE_PUT:
                 go [key = request.key, this] {
-                    m_raft->publish(TOPIC_KEYEVENTS_DEL, key);
-                    m_raft->publish(TOPIC_KEYSPACE + key, KEYEVENTS_DEL);
+                    publishKeyEvent(PUT, key);
+                };
+                break;
+            case LEASE_REVOKE:
+            case LEASE_EXPIRE:
+                // 随租约一起删除的 key
+                go [keys = Unpack<std::vector<std::string>>(response.value), this] {
+                    for (auto& key: keys) {
+                        publishKeyEvent(DELETE, key);
+                    }
+                };
+                break;
+            case TXN:
+                go [txn = Unpack<TxnRequest>(request.value), result = Unpack<TxnResponse>(response.value), this] {
+                    auto& ops = result.succeeded ? txn.success : txn.failure;
+                    for (size_t i = 0; i < ops.size() && i < result.results.size(); ++i) {
+                        if (result.results[i].error == OK) {
+                            publishKeyEvent(ops[i].operation, ops[i].key);
+                        }
+                    }
                 };
                 break;
             default:
@@ -125,63 +312,563 @@ CommandResponse KVServer::handleCommand(CommandRequest request) {
     return response;
 }
 
+void KVServer::publishKeyEvent(Operation operation, const std::string& key) {
+    const std::string* event;
+    switch (operation) {
+        case PUT: event = &KEYEVENTS_PUT; break;
+        case APPEND: event = &KEYEVENTS_APPEND; break;
+        case DELETE: event = &KEYEVENTS_DEL; break;
+        default: return;
+    }
+    m_raft->publish(TOPIC_KEYEVENT + *event, key);
+    m_raft->publish(TOPIC_KEYSPACE + key, *event);
+}
+
+CommandResponse KVServer::handleKeepAlive(const CommandRequest& request) {
+    auto lease = Unpack<Lease>(request.value);
+    std::unique_lock<MutexType> lock(m_mutex, std::defer_lock);
+    // 确认自己还是 Leader，并且已经应用了创建租约的日志
+    Error error = waitReadable(lock);
+    if (error != OK) {
+        return {.error = error, .leaderId = m_raft->getLeaderId()};
+    }
+    auto it = m_leases.find(lease.id);
+    // 没有定时的租约已经过期，正在等待删除
+    if (it == m_leases.end() || !m_leaseDeadlines.contains(lease.id)) {
+        return {.error = NO_LEASE, .leaderId = m_raft->getLeaderId()};
+    }
+    setLeaseDeadline(lease.id, GetSteadyMS() + it->second);
+    return {.value = Pack(Lease{.id = lease.id, .ttl = it->second}), .leaderId = m_raft->getLeaderId()};
+}
+
+void KVServer::expireLeases() {
+    std::unique_lock<MutexType> lock(m_mutex);
+    auto [term, leader] = m_raft->getState();
+    if (!leader) {
+        m_leaseTerm = 0;
+        return;
+    }
+    uint64_t now = GetSteadyMS();
+    if (m_leaseTerm != term) {
+        // 刚成为 Leader，不知道之前的 Leader 续约到了什么时候，所有租约重新计时
+        m_leaseTerm = term;
+        for (auto& [id, ttl]: m_leases) {
+            setLeaseDeadline(id, now + ttl);
+        }
+        return;
+    }
+    std::vector<int64_t> expired;
+    while (!m_leaseTimers.empty() && m_leaseTimers.begin()->first <= now
+           && expired.size() < g_lease_max_expire->getValue()) {
+        int64_t id = m_leaseTimers.begin()->second;
+        clearLeaseDeadline(id);
+        expired.push_back(id);
+    }
+    if (expired.empty()) {
+        return;
+    }
+    lock.unlock();
+    SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] expires {} leases", m_id, expired.size());
+    CommandRequest request{.operation = LEASE_EXPIRE, .value = Pack(expired), .commandId = GetRandom()};
+    CommandResponse response = submitCommand(request);
+    if (response.error != OK) {
+        // 没有提交成功，还是 Leader 的话下次检查时重试
+        lock.lock();
+        for (auto id: expired) {
+            if (m_leases.contains(id) && !m_leaseDeadlines.contains(id)) {
+                setLeaseDeadline(id, now);
+            }
+        }
+    }
+}
+
+void KVServer::bindLease(const std::string& key, int64_t lease) {
+    auto& bindings = m_leaseBindings[partitionOf(key)];
+    auto it = bindings.leaseOf.find(key);
+    if (it != bindings.leaseOf.end()) {
+        if (it->second == lease) {
+            return;
+        }
+        auto keys = bindings.keysOf.find(it->second);
+        keys->second.erase(key);
+        if (keys->second.empty()) {
+            bindings.keysOf.erase(keys);
+        }
+        if (!lease) {
+            bindings.leaseOf.erase(it);
+            return;
+        }
+        it->second = lease;
+    } else {
+        if (!lease) {
+            return;
+        }
+        bindings.leaseOf.emplace(key, lease);
+    }
+    bindings.keysOf[lease].insert(key);
+}
+
+bool KVServer::revokeLease(int64_t id, std::vector<std::string>& keys) {
+    if (!m_leases.erase(id)) {
+        return false;
+    }
+    clearLeaseDeadline(id);
+    for (size_t i = 0; i < m_data.size(); ++i) {
+        auto& bindings = m_leaseBindings[i];
+        auto it = bindings.keysOf.find(id);
+        if (it == bindings.keysOf.end()) {
+            continue;
+        }
+        for (auto& key: it->second) {
+            m_data[i].erase(key);
+            bindings.leaseOf.erase(key);
+            keys.push_back(key);
+        }
+        bindings.keysOf.erase(it);
+    }
+    return true;
+}
+
+void KVServer::setLeaseDeadline(int64_t id, uint64_t deadline) {
+    clearLeaseDeadline(id);
+    m_leaseDeadlines[id] = deadline;
+    m_leaseTimers.emplace(deadline, id);
+}
+
+void KVServer::clearLeaseDeadline(int64_t id) {
+    auto it = m_leaseDeadlines.find(id);
+    if (it == m_leaseDeadlines.end()) {
+        return;
+    }
+    m_leaseTimers.erase({it->second, id});
+    m_leaseDeadlines.erase(it);
+}
+
+CommandResponse KVServer::handleRead(const CommandRequest& request) {
+    std::unique_lock<MutexType> lock(m_mutex, std::defer_lock);
+    Error error = waitReadable(lock);
+    if (error != OK) {
+        return {.error = error, .leaderId = m_raft->getLeaderId()};
+    }
+    return applyLogToStateMachine(request);
+}
+
+Error KVServer::waitReadable(std::unique_lock<MutexType>& lock) {
+    auto index = m_raft->readIndex();
+    if (!index) {
+        return m_raft->isLeader() ? TIMEOUT : WRONG_LEADER;
+    }
+    lock.lock();
+    if (m_lastApplied < *index) {
+        // 等待状态机应用到 read index
+        co::co_chan<bool> chan(1);
+        m_readWaiters.emplace(*index, chan);
+        lock.unlock();
+        bool applied;
+        if (!chan.TimedPop(applied, std::chrono::milliseconds(acid::Config::Lookup<uint64_t>("raft.rpc.timeout")->getValue()))) {
+            return TIMEOUT;
+        }
+        lock.lock();
+    }
+    return OK;
+}
+
+ScanResponse KVServer::Scan(const std::string& start, const std::string& end, int64_t limit, const std::string& token) {
+    return handleScan({.start = start, .end = end, .limit = limit, .token = token});
+}
+
+ScanResponse KVServer::PrefixScan(const std::string& prefix, int64_t limit, const std::string& token) {
+    return handleScan({.start = prefix, .end = PrefixEnd(prefix), .limit = limit, .token = token});
+}
+
+ScanResponse KVServer::handleScan(ScanRequest request) {
+    ScanResponse response;
+    co_defer_scope {
+        SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] processes ScanRequest {} with ScanResponse {}",
+                            m_id, request.toString(), response.toString());
+    };
+    std::unique_lock<MutexType> lock(m_mutex, std::defer_lock);
+    response.error = waitReadable(lock);
+    if (response.error != OK) {
+        response.leaderId = m_raft->getLeaderId();
+        return response;
+    }
+    // 续传 token 是下一个没有返回的 key
+    const std::string& start = std::max(request.start, request.token);
+    auto max_limit = (int64_t)g_scan_max_limit->getValue();
+    size_t limit = request.limit <= 0 || request.limit > max_limit ? max_limit : request.limit;
+    // 每个分区多取一个，用来确定续传的位置
+    for (auto& part: m_data) {
+        auto kvs = part.scan(start, request.end, limit + 1);
+        response.kvs.insert(response.kvs.end(), std::make_move_iterator(kvs.begin()), std::make_move_iterator(kvs.end()));
+    }
+    lock.unlock();
+    if (m_data.size() > 1) {
+        std::sort(response.kvs.begin(), response.kvs.end());
+    }
+    if (response.kvs.size() > limit) {
+        response.next = response.kvs[limit].first;
+        response.kvs.resize(limit);
+    }
+    return response;
+}
+
+void KVServer::batcher() {
+    PendingCommand command;
+    while (m_commandChan.pop(command)) {
+        std::vector<PendingCommand> batch;
+        batch.push_back(std::move(command));
+        uint64_t linger = g_batch_linger->getValue();
+        uint64_t max_commands = std::max<uint64_t>(1, g_batch_max_commands->getValue());
+        if (linger && batch.size() < max_commands) {
+            co_sleep(linger);
+        }
+        while (batch.size() < max_commands && m_commandChan.TryPop(command)) {
+            batch.push_back(std::move(command));
+        }
+        proposeBatch(batch);
+    }
+}
+
+void KVServer::proposeBatch(std::vector<PendingCommand>& batch) {
+    std::vector<CommandRequest> requests;
+    requests.reserve(batch.size());
+    for (auto& command: batch) {
+        requests.push_back(command.request);
+    }
+    Serializer s;
+    s << BATCH << requests;
+    s.reset();
+    // 持有锁提交，applier 应用这条日志时一定能找到等待的 channel
+    std::unique_lock<MutexType> lock(m_mutex);
+    auto entry = m_raft->propose(s.toString());
+    if (!entry) {
+        CommandResponse response{.error = WRONG_LEADER, .leaderId = m_raft->getLeaderId()};
+        for (auto& command: batch) {
+            command.chan.TryPush(response);
+        }
+        return;
+    }
+    auto& chans = m_nofiyChans[entry->index];
+    for (auto& command: batch) {
+        chans.push_back(command.chan);
+    }
+    SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] proposes {} commands in entry[index: {}, term: {}]", m_id, batch.size(), entry->index, entry->term);
+}
+
+void KVServer::notifyReaders() {
+    while (!m_readWaiters.empty() && m_readWaiters.begin()->first <= m_lastApplied) {
+        m_readWaiters.begin()->second.TryPush(true);
+        m_readWaiters.erase(m_readWaiters.begin());
+    }
+}
+
 void KVServer::applier() {
-    ApplyMsg msg{};
-    while (m_applychan.pop(msg)) {
+    ApplyBatch batch;
+    while (m_applychan.pop(batch)) {
+        // 整批消息在一次加锁内应用，应用完之后再统一通知等待的请求
+        std::vector<std::pair<co::co_chan<CommandResponse>, CommandResponse>> notifies;
         std::unique_lock<MutexType> lock(m_mutex);
-        SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] tries to apply message {}", m_id, msg.toString());
-        if (msg.type == ApplyMsg::SNAPSHOT) {
-            auto snap = std::make_shared<Snapshot>();
-            snap->metadata.index = msg.index;
-            snap->metadata.term = msg.term;
-            snap->data = std::move(msg.data);
-            m_raft->persistSnapshot(snap);
-            readSnapshot(snap);
-            m_lastApplied = msg.index;
-            continue;
-        } else if (msg.type == ApplyMsg::ENTRY) {
-            // Leader 选出后提交的空日志
-            if (msg.data.empty()) {
-                continue;
+        auto [term, isLeader] = m_raft->getState();
+        bool applied = false;
+        // 还没有应用的一段命令，以及这段命令之后的 apply 位置
+        std::vector<ApplyItem> segment;
+        int64_t pending_index = m_lastApplied;
+        // 所有分区都应用完这段命令之后才推进 lastApplied
+        auto flush = [&] {
+            if (!segment.empty()) {
+                applyCommands(segment);
+                applied = true;
+                for (auto& item: segment) {
+                    if (!isLeader || item.term != term) {
+                        continue;
+                    }
+                    auto it = m_nofiyChans.find(item.index);
+                    if (it != m_nofiyChans.end() && item.position < (int64_t)it->second.size()) {
+                        notifies.emplace_back(it->second[item.position], std::move(item.response));
+                    }
+                }
+                segment.clear();
+            }
+            m_lastApplied = std::max(m_lastApplied, pending_index);
+        };
+        for (auto& msg: batch) {
+            SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] tries to apply message {}", m_id, msg.toString());
+            if (msg.type == ApplyMsg::SNAPSHOT) {
+                flush();
+                auto snap = std::make_shared<Snapshot>();
+                snap->metadata.index = msg.index;
+                snap->metadata.term = msg.term;
+                snap->data = msg.data.str();
+                m_raft->persistSnapshot(snap);
+                readSnapshot(snap);
+                m_lastApplied = pending_index = msg.index;
+            } else if (msg.type == ApplyMsg::CONF_CHANGE) {
+                // 成员变更由 raft 处理，只推进 apply 的位置
+                pending_index = std::max(pending_index, msg.index);
+            } else if (msg.type == ApplyMsg::ENTRY) {
+                int64_t msg_idx = msg.index;
+                if (msg_idx <= pending_index) {
+                    SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] discards outdated message {} because a newer snapshot which lastApplied is {} has been restored",
+                                        m_id, msg.toString(), pending_index);
+                    continue;
+                }
+                // Leader 选出后提交的空日志，read index 可能正好指向它
+                if (msg.data.empty()) {
+                    pending_index = msg_idx;
+                    continue;
+                }
+                auto requests = DecodeCommands(msg);
+                for (int64_t i = 0; i < (int64_t)requests.size(); ++i) {
+                    // 屏障命令等前面的命令全部完成后单独执行
+                    bool barrier = isBarrier(requests[i]);
+                    if (barrier) {
+                        flush();
+                    }
+                    segment.push_back(ApplyItem{.index = msg.index, .term = msg.term, .position = i, .request = std::move(requests[i])});
+                    if (barrier) {
+                        flush();
+                    }
+                }
+                // 整条日志的命令都应用之后才推进 apply 的位置
+                pending_index = msg_idx;
+            } else {
+                SPDLOG_LOGGER_CRITICAL(g_logger, "unexpected ApplyMsg type: {}, index: {}, term: {}, data: {}", (int)msg.type, msg.index, msg.term, msg.data);
+                exit(EXIT_FAILURE);
             }
-            int64_t msg_idx = msg.index;
-            if (msg_idx <= m_lastApplied) {
-                SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] discards outdated message {} because a newer snapshot which lastApplied is {} has been restored",
-                                    m_id, msg.toString(), m_lastApplied);
+        }
+        flush();
+        for (auto& msg: batch) {
+            m_nofiyChans.erase(msg.index);
+        }
+        notifyReaders();
+        if (applied && needSnapshot()) {
+            saveSnapshot(m_lastApplied);
+        }
+        lock.unlock();
+        for (auto& [chan, response]: notifies) {
+            chan.TryPush(response);
+        }
+    }
+}
+
+void KVServer::applyCommands(std::vector<ApplyItem>& items) {
+    // 按日志顺序去重，同一个客户端的命令可能落在不同的分区
+    std::map<int64_t, std::pair<int64_t, int64_t>> latest;
+    std::vector<std::vector<ApplyItem*>> parts(m_data.size());
+    for (int64_t i = 0; i < (int64_t)items.size(); ++i) {
+        auto& item = items[i];
+        auto& request = item.request;
+        if (!isReadOnly(request)) {
+            auto it = latest.find(request.clientId);
+            if (it != latest.end() && it->second.first == request.commandId) {
+                item.duplicateOf = it->second.second;
                 continue;
             }
-            m_lastApplied = msg_idx;
-            auto request = msg.as<CommandRequest>();
-            CommandResponse response;
-            if (request.operation != GET && isDuplicateRequest(request.clientId, request.commandId)) {
+            if (it == latest.end() && isDuplicateRequest(request.clientId, request.commandId)) {
                 SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] doesn't apply duplicated message {} to stateMachine because maxAppliedCommandId is {} for client {}",
                                     m_id, request.toString(), m_lastOperation[request.clientId].second.toString(), request.clientId);
-                response = m_lastOperation[request.clientId].second;
-            } else {
-                response = applyLogToStateMachine(request);
-                if (request.operation != GET) {
-                    m_lastOperation[request.clientId] = {request.commandId, response};
-                }
-            }
-            auto [term, isLeader] = m_raft->getState();
-            if (isLeader && msg.term == term) {
-                m_nofiyChans[msg.index] << response;
+                item.response = m_lastOperation[request.clientId].second;
+                item.duplicate = true;
+                continue;
             }
-            if (needSnapshot()) {
-                saveSnapshot(msg.index);
+            latest[request.clientId] = {request.commandId, i};
+        }
+        parts[partitionOf(request.key)].push_back(&item);
+    }
+
+    auto apply = [this](const std::vector<ApplyItem*>& part) {
+        for (auto item: part) {
+            item->response = applyLogToStateMachine(item->request);
+        }
+    };
+    size_t busy = std::count_if(parts.begin(), parts.end(), [](auto& part) { return !part.empty();});
+    if (busy <= 1) {
+        // 只涉及一个分区时不需要切换协程
+        for (auto& part: parts) {
+            apply(part);
+        }
+    } else {
+        // 每个分区一个协程，分区之间没有共享的数据，同一分区内保持日志顺序
+        co::co_chan<bool> done(busy);
+        for (auto& part: parts) {
+            if (part.empty()) {
+                continue;
             }
-        } else {
-            SPDLOG_LOGGER_CRITICAL(g_logger, "unexpected ApplyMsg type: {}, index: {}, term: {}, data: {}", (int)msg.type, msg.index, msg.term, msg.data);
-            exit(EXIT_FAILURE);
+            go [&part, &apply, done] {
+                apply(part);
+                done << true;
+            };
+        }
+        bool ok;
+        for (size_t i = 0; i < busy; ++i) {
+            done >> ok;
+        }
+    }
+
+    for (auto& item: items) {
+        if (item.duplicateOf >= 0) {
+            item.response = items[item.duplicateOf].response;
+        } else if (!item.duplicate && !isReadOnly(item.request)) {
+            m_lastOperation[item.request.clientId] = {item.request.commandId, item.response};
+        }
+    }
+}
+
+bool KVServer::isBarrier(const CommandRequest& request) {
+    // 多 key 命令跨越多个分区，单独执行保证整体原子地生效
+    return request.operation == CLEAR || request.operation == MULTI_PUT || request.operation == MULTI_DELETE
+           || request.operation == TXN || request.operation == LEASE_GRANT || request.operation == LEASE_REVOKE
+           || request.operation == LEASE_EXPIRE;
+}
+
+bool KVServer::isReadOnly(const CommandRequest& request) {
+    return request.operation == GET || request.operation == MULTI_GET;
+}
+
+bool KVServer::isValidRequest(const CommandRequest& request) {
+    switch (request.operation) {
+        case MULTI_GET:
+        case MULTI_DELETE:
+            return CanUnpack<std::vector<std::string>>(request.value);
+        case MULTI_PUT:
+            return CanUnpack<std::vector<std::pair<std::string, std::string>>>(request.value);
+        case LEASE_PUT:
+            return CanUnpack<std::pair<int64_t, std::string>>(request.value);
+        case LEASE_GRANT:
+        case LEASE_REVOKE:
+        case LEASE_KEEPALIVE:
+            return CanUnpack<Lease>(request.value);
+        case LEASE_EXPIRE:
+            // 过期只由 Leader 决定并在内部提交，不接受客户端的请求
+            return false;
+        case TXN:
+            break;
+        case GET:
+        case PUT:
+        case APPEND:
+        case DELETE:
+        case CLEAR:
+            return true;
+        default:
+            // BATCH 只由 batcher 在日志中使用，未知的操作应用时无法执行
+            return false;
+    }
+    TxnRequest txn;
+    try {
+        txn = Unpack<TxnRequest>(request.value);
+    } catch (...) {
+        return false;
+    }
+    auto valid = [](const std::vector<CommandRequest>& ops) {
+        return std::all_of(ops.begin(), ops.end(), [](const CommandRequest& op) {
+            return op.operation == GET || op.operation == PUT || op.operation == APPEND || op.operation == DELETE;
+        });
+    };
+    return valid(txn.success) && valid(txn.failure);
+}
+
+bool KVServer::compare(const Compare& cmp) {
+    auto& part = partition(cmp.key);
+    int result;
+    if (cmp.target == Compare::VERSION) {
+        int64_t version = part.version(cmp.key);
+        result = version < cmp.version ? -1 : version > cmp.version;
+    } else {
+        const std::string* value = part.get(cmp.key);
+        if (!value) {
+            return false;
         }
+        result = value->compare(cmp.value);
     }
+    switch (cmp.result) {
+        case Compare::EQUAL: return result == 0;
+        case Compare::NOT_EQUAL: return result != 0;
+        case Compare::GREATER: return result > 0;
+        case Compare::LESS: return result < 0;
+        default: return false;
+    }
+}
+
+size_t KVServer::partitionOf(const std::string& key) const {
+    return std::hash<std::string>{}(key) % m_data.size();
+}
+
+KVStore& KVServer::partition(const std::string& key) {
+    return m_data[partitionOf(key)];
+}
+
+KVServer::KVMap KVServer::getData() {
+    std::unique_lock<MutexType> lock(m_mutex);
+    KVMap data;
+    for (auto& part: m_data) {
+        auto dump = part.dump();
+        data.merge(dump);
+    }
+    return data;
 }
 
 void KVServer::saveSnapshot(int64_t index) {
-    Serializer s;
-    s << m_data << m_lastOperation;
-    s.reset();
-    m_raft->persistStateAndSnapshot(index, s.toString());
+    if (m_data.front().frozen()) {
+        return;
+    }
+    std::vector<KVStore::View> views;
+    for (auto& part: m_data) {
+        views.push_back(part.freeze());
+    }
+    m_snapshotting = true;
+    // 去重表只和客户端数量有关，租约的绑定只和带租约的 key 数量有关，直接复制
+    std::vector<std::unordered_map<std::string, int64_t>> leaseOf;
+    for (auto& bindings: m_leaseBindings) {
+        leaseOf.push_back(bindings.leaseOf);
+    }
+    go [index, views = std::move(views), lastOperation = m_lastOperation,
+        lastLeaseId = m_lastLeaseId, leases = m_leases, leaseOf = std::move(leaseOf), this] () mutable {
+        // 各个分区的 key 互不相交，按一个 map 的格式依次写入，和分区数量无关
+        size_t size = 0;
+        for (auto& view: views) {
+            size += view.data->size();
+        }
+        Serializer s;
+        s.write(size);
+        for (auto& view: views) {
+            for (auto& kv: *view.data) {
+                s << kv;
+            }
+        }
+        s << lastOperation;
+        // 版本号和租约依次写在最后，兼容没有这些数据的旧快照
+        size = 0;
+        for (auto& view: views) {
+            size += view.versions->size();
+        }
+        s.write(size);
+        for (auto& view: views) {
+            for (auto& kv: *view.versions) {
+                s << kv;
+            }
+        }
+        s << lastLeaseId << leases;
+        size = 0;
+        for (auto& part: leaseOf) {
+            size += part.size();
+        }
+        s.write(size);
+        for (auto& part: leaseOf) {
+            for (auto& kv: part) {
+                s << kv;
+            }
+        }
+        s.reset();
+        views.clear();
+        // 如果期间安装了更新的快照，这个快照会被丢弃
+        m_raft->persistStateAndSnapshot(index, s.toString());
+        std::unique_lock<MutexType> lock(m_mutex);
+        for (auto& part: m_data) {
+            part.thaw();
+        }
+        m_snapshotting = false;
+    };
 }
 
 void KVServer::readSnapshot(Snapshot::ptr snap) {
@@ -190,9 +877,48 @@ void KVServer::readSnapshot(Snapshot::ptr snap) {
     }
     Serializer s(snap->data);
     try {
-        m_data.clear();
+        KVMap data;
+        KVStore::VersionMap versions;
+        std::map<std::string, int64_t> leaseOf;
         m_lastOperation.clear();
-        s >> m_data >> m_lastOperation;
+        m_leases.clear();
+        m_lastLeaseId = 0;
+        s >> data >> m_lastOperation;
+        if (s.getByteArray()->getReadSize()) {
+            s >> versions;
+            if (s.getByteArray()->getReadSize()) {
+                s >> m_lastLeaseId >> m_leases >> leaseOf;
+            }
+        } else {
+            for (auto& [key, _]: data) {
+                versions.emplace_hint(versions.end(), key, 1);
+            }
+        }
+        // 按 key 重新分区，不需要复制数据
+        std::vector<KVMap> parts(m_data.size());
+        std::vector<KVStore::VersionMap> partVersions(m_data.size());
+        while (!data.empty()) {
+            auto node = data.extract(data.begin());
+            parts[partitionOf(node.key())].insert(std::move(node));
+        }
+        while (!versions.empty()) {
+            auto node = versions.extract(versions.begin());
+            partVersions[partitionOf(node.key())].insert(std::move(node));
+        }
+        for (size_t i = 0; i < m_data.size(); ++i) {
+            m_data[i].restore(std::move(parts[i]), std::move(partVersions[i]));
+            m_leaseBindings[i] = {};
+        }
+        for (auto& [key, lease]: leaseOf) {
+            bindLease(key, lease);
+        }
+        // 过期时间不在快照中，所有租约重新计时
+        m_leaseDeadlines.clear();
+        m_leaseTimers.clear();
+        uint64_t now = GetSteadyMS();
+        for (auto& [id, ttl]: m_leases) {
+            setLeaseDeadline(id, now + ttl);
+        }
     } catch (...) {
         SPDLOG_LOGGER_CRITICAL(g_logger, "KVServer[{}] read snapshot fail", m_id);
     }
@@ -207,7 +933,7 @@ bool KVServer::isDuplicateRequest(int64_t client, int64_t command) {
 }
 
 bool KVServer::needSnapshot() {
-    if (m_maxRaftState == -1) {
+    if (m_maxRaftState == -1 || m_snapshotting) {
         return false;
     }
     return m_persister->getRaftStateSize() >= m_maxRaftState;
@@ -215,36 +941,150 @@ bool KVServer::needSnapshot() {
 
 CommandResponse KVServer::applyLogToStateMachine(const CommandRequest& request) {
     CommandResponse response;
-    KVMap::iterator it;
-    switch (request.operation) {
-        case GET:
-            it = m_data.find(request.key);
-            if (it == m_data.end()) {
-                response.error = NO_KEY;
-            } else {
-                response.value = it->second;
+    const std::string* value;
+    // 参数在提交之前已经检查过，解码失败只可能是旧版本写入的日志，每个节点都返回同样的错误，不能让 applier 退出
+    try {
+        switch (request.operation) {
+            case GET:
+                value = partition(request.key).get(request.key);
+                if (!value) {
+                    response.error = NO_KEY;
+                } else {
+                    response.value = *value;
+                }
+                break;
+            case PUT:
+                partition(request.key).put(request.key, request.value);
+                bindLease(request.key, 0);
+                break;
+            case APPEND:
+                partition(request.key).append(request.key, request.value);
+                break;
+            case DELETE:
+                if (!partition(request.key).erase(request.key)) {
+                    response.error = NO_KEY;
+                }
+                bindLease(request.key, 0);
+                break;
+            case CLEAR:
+                for (auto& part: m_data) {
+                    part.clear();
+                }
+                for (auto& bindings: m_leaseBindings) {
+                    bindings = {};
+                }
+                break;
+            case MULTI_GET: {
+                auto keys = Unpack<std::vector<std::string>>(request.value);
+                std::vector<KeyResult> results(keys.size());
+                for (size_t i = 0; i < keys.size(); ++i) {
+                    auto& part = partition(keys[i]);
+                    value = part.get(keys[i]);
+                    if (!value) {
+                        results[i].error = NO_KEY;
+                    } else {
+                        results[i].value = *value;
+                        results[i].version = part.version(keys[i]);
+                    }
+                }
+                response.value = Pack(results);
+                break;
             }
-            break;
-        case PUT:
-            m_data[request.key] = request.value;
-            break;
-        case APPEND:
-            m_data[request.key] += request.value;
-            break;
-        case DELETE:
-            it = m_data.find(request.key);
-            if (it == m_data.end()) {
-                response.error = NO_KEY;
-            } else {
-                m_data.erase(it);
+            case MULTI_PUT: {
+                auto kvs = Unpack<std::vector<std::pair<std::string, std::string>>>(request.value);
+                std::vector<KeyResult> results(kvs.size());
+                for (size_t i = 0; i < kvs.size(); ++i) {
+                    auto& part = partition(kvs[i].first);
+                    part.put(kvs[i].first, kvs[i].second);
+                    bindLease(kvs[i].first, 0);
+                    results[i].version = part.version(kvs[i].first);
+                }
+                response.value = Pack(results);
+                break;
             }
-            break;
-        case CLEAR:
-            m_data.clear();
-            break;
-        default:
-            SPDLOG_LOGGER_CRITICAL(g_logger, "unexpect operation {}", (int)request.operation);
-            exit(EXIT_FAILURE);
+            case MULTI_DELETE: {
+                auto keys = Unpack<std::vector<std::string>>(request.value);
+                std::vector<KeyResult> results(keys.size());
+                for (size_t i = 0; i < keys.size(); ++i) {
+                    if (!partition(keys[i]).erase(keys[i])) {
+                        results[i].error = NO_KEY;
+                    }
+                    bindLease(keys[i], 0);
+                }
+                response.value = Pack(results);
+                break;
+            }
+            case TXN: {
+                auto txn = Unpack<TxnRequest>(request.value);
+                TxnResponse result;
+                result.succeeded = std::all_of(txn.compares.begin(), txn.compares.end(),
+                                               [this](const Compare& cmp) { return compare(cmp);});
+                // 按顺序执行选中的分支，后面的操作能看到前面操作的结果
+                for (auto& op: result.succeeded ? txn.success : txn.failure) {
+                    KeyResult item;
+                    if (op.operation == GET || op.operation == PUT || op.operation == APPEND || op.operation == DELETE) {
+                        auto opResponse = applyLogToStateMachine(op);
+                        item.error = opResponse.error;
+                        item.value = std::move(opResponse.value);
+                        item.version = partition(op.key).version(op.key);
+                    } else {
+                        item.error = BAD_REQUEST;
+                    }
+                    result.results.push_back(std::move(item));
+                }
+                response.value = Pack(result);
+                break;
+            }
+            case LEASE_PUT: {
+                auto [lease, val] = Unpack<std::pair<int64_t, std::string>>(request.value);
+                // 只读取租约表，修改租约表的命令都是屏障，不会和分区并行执行
+                if (!m_leases.contains(lease)) {
+                    response.error = NO_LEASE;
+                    break;
+                }
+                partition(request.key).put(request.key, val);
+                bindLease(request.key, lease);
+                break;
+            }
+            case LEASE_GRANT: {
+                auto lease = Unpack<Lease>(request.value);
+                if (lease.ttl <= 0) {
+                    response.error = BAD_REQUEST;
+                    break;
+                }
+                lease.id = ++m_lastLeaseId;
+                m_leases[lease.id] = lease.ttl;
+                setLeaseDeadline(lease.id, GetSteadyMS() + lease.ttl);
+                response.value = Pack(lease);
+                break;
+            }
+            case LEASE_REVOKE: {
+                std::vector<std::string> keys;
+                if (!revokeLease(Unpack<Lease>(request.value).id, keys)) {
+                    response.error = NO_LEASE;
+                    break;
+                }
+                response.value = Pack(keys);
+                break;
+            }
+            case LEASE_EXPIRE: {
+                // 过期由 Leader 决定，所有节点按日志删除，不再比较各自的时间
+                std::vector<std::string> keys;
+                for (auto id: Unpack<std::vector<int64_t>>(request.value)) {
+                    revokeLease(id, keys);
+                }
+                response.value = Pack(keys);
+                break;
+            }
+            default:
+                // 提交之前已经拒绝，只可能是旧版本写入的日志，所有节点返回同样的错误
+                SPDLOG_LOGGER_ERROR(g_logger, "Node[{}] cannot apply unexpect operation {}", m_id, (int)request.operation);
+                response.error = BAD_REQUEST;
+                break;
+        }
+    } catch (...) {
+        SPDLOG_LOGGER_ERROR(g_logger, "Node[{}] cannot decode command {}", m_id, request.toString());
+        response = {.error = BAD_REQUEST};
     }
     return response;
 }
@@ -5,8 +5,12 @@
 #ifndef ACID_KVSERVER_H
 #define ACID_KVSERVER_H
 
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include "../raft/raft_node.h"
 #include "commom.h"
+#include "kv_store.h"
 
 namespace acid::kvraft {
 using namespace acid::raft;
@@ -14,7 +18,7 @@ class KVServer {
 public:
     using ptr = std::shared_ptr<KVServer>;
     using MutexType = co::co_mutex;
-    using KVMap = std::map<std::string, std::string>;
+    using KVMap = KVStore::KVMap;
 
     KVServer(std::map<int64_t, std::string>& servers, int64_t id, Persister::ptr persister, int64_t maxRaftState = 1000);
     ~KVServer();
@@ -25,29 +29,226 @@ public:
     CommandResponse Put(const std::string& key, const std::string& value);
     CommandResponse Append(const std::string& key, const std::string& value);
     CommandResponse Delete(const std::string& key);
+    /**
+     * @brief 一次线性一致读取多个 key，value 中按 key 的顺序打包了 std::vector<KeyResult>
+     */
+    CommandResponse MultiGet(const std::vector<std::string>& keys);
+    /**
+     * @brief 在一条日志中原子地写入多个键值对
+     */
+    CommandResponse MultiPut(const std::vector<std::pair<std::string, std::string>>& kvs);
+    /**
+     * @brief 在一条日志中原子地删除多个 key，不存在的 key 对应的结果为 NO_KEY
+     */
+    CommandResponse MultiDelete(const std::vector<std::string>& keys);
+    /**
+     * @brief 条件事务，比较和执行在一条日志中原子地完成，value 中打包了 TxnResponse
+     */
+    CommandResponse Txn(const TxnRequest& txn);
+    /**
+     * @brief 写入一个绑定在租约上的 key，租约过期或者被撤销时删除，之后不带租约的 Put 会解除绑定
+     */
+    CommandResponse Put(const std::string& key, const std::string& value, int64_t lease);
+    /**
+     * @brief 创建一个租约，value 中打包了分配的 Lease
+     * @param ttl 存活时间（ms）
+     */
+    CommandResponse LeaseGrant(int64_t ttl);
+    /**
+     * @brief 撤销租约，删除绑定在上面的所有 key
+     */
+    CommandResponse LeaseRevoke(int64_t id);
+    /**
+     * @brief 续约，租约重新计时，value 中打包了 Lease
+     */
+    CommandResponse LeaseKeepAlive(int64_t id);
     CommandResponse Clear();
+    /**
+     * @brief 线性一致的范围查询，按 key 的顺序返回 [start, end) 内的键值对
+     * @param token 上一次查询返回的 next，第一次查询为空
+     */
+    ScanResponse Scan(const std::string& start, const std::string& end, int64_t limit, const std::string& token = "");
+    /**
+     * @brief 按 key 的顺序返回以 prefix 开头的键值对
+     */
+    ScanResponse PrefixScan(const std::string& prefix, int64_t limit, const std::string& token = "");
+    ScanResponse handleScan(ScanRequest request);
+    /**
+     * @brief 把领导权转移给指定节点，下线维护前调用，避免等待一个选举超时
+     */
+    CommandResponse TransferLeadership(int64_t target);
+    /**
+     * @brief 添加一个只读副本，不参与投票
+     */
+    CommandResponse AddLearner(int64_t id, const std::string& address);
+    /**
+     * @brief 把追上日志的只读副本提升为有投票权的节点
+     */
+    CommandResponse PromoteLearner(int64_t id);
+    /**
+     * @brief 移除一个节点
+     */
+    CommandResponse RemoveMember(int64_t id);
+    /**
+     * @brief 导出状态机中的全部数据
+     */
     [[nodiscard]]
-    const KVMap& getData() const { return m_data;}
+    KVMap getData();
 private:
     void applier();
+    /**
+     * @brief 冻结状态机生成快照视图，在后台协程中序列化并持久化，不阻塞 applier
+     */
     void saveSnapshot(int64_t index);
     void readSnapshot(Snapshot::ptr snap);
     bool isDuplicateRequest(int64_t client, int64_t command);
     bool needSnapshot();
+    /**
+     * @brief 线性一致读，通过 ReadIndex 或者 Leader 租约确认后直接读取状态机，不经过日志
+     */
+    CommandResponse handleRead(const CommandRequest& request);
+    /**
+     * @brief 提交一条写命令并等待应用，已经检查过参数，内部提交的命令直接调用
+     */
+    CommandResponse submitCommand(const CommandRequest& request);
+    /**
+     * @brief 确认领导地位并等待状态机应用到 read index，返回 OK 时持有锁
+     */
+    Error waitReadable(std::unique_lock<MutexType>& lock);
+    /**
+     * @brief 唤醒等待状态机应用到指定位置的读请求
+     */
+    void notifyReaders();
     CommandResponse applyLogToStateMachine(const CommandRequest& request);
+private:
+    /**
+     * @brief 等待合并提交的写命令
+     */
+    struct PendingCommand {
+        CommandRequest request;
+        co::co_chan<CommandResponse> chan;
+    };
+    /**
+     * @brief 把并发到达的写命令合并成一条日志提交，在一个时间窗口内或者达到数量上限为止
+     */
+    void batcher();
+    /**
+     * @brief 提交一批命令，失败时直接通知所有等待的请求
+     */
+    void proposeBatch(std::vector<PendingCommand>& batch);
+    /**
+     * @brief 一条等待应用到状态机的命令
+     */
+    struct ApplyItem {
+        int64_t index;
+        int64_t term;
+        // 在一条日志中的位置
+        int64_t position;
+        CommandRequest request;
+        CommandResponse response{};
+        // 已经应用过的重复命令，直接使用去重表中的响应
+        bool duplicate = false;
+        // 同一段中重复的命令，使用第一次出现的命令的响应
+        int64_t duplicateOf = -1;
+    };
+    /**
+     * @brief 应用一段命令，不同分区的命令并行执行，同一分区内按日志顺序执行，去重表按日志顺序更新
+     */
+    void applyCommands(std::vector<ApplyItem>& items);
+    /**
+     * @brief 是否需要等前面的命令全部完成后单独执行，例如涉及所有分区的 CLEAR
+     */
+    static bool isBarrier(const CommandRequest& request);
+    /**
+     * @brief 只读命令走 read index，不进入日志
+     */
+    static bool isReadOnly(const CommandRequest& request);
+    /**
+     * @brief 提交之前检查客户端的请求，参数能否解码，事务的分支中是否只有单 key 的读写操作，
+     * 不能解码的请求进入日志后每个节点应用时都会失败，内部使用的操作不接受客户端的请求
+     */
+    static bool isValidRequest(const CommandRequest& request);
+    /**
+     * @brief 事务的比较条件是否成立
+     */
+    bool compare(const Compare& cmp);
+    /**
+     * @brief 发布 key 的修改事件
+     */
+    void publishKeyEvent(Operation operation, const std::string& key);
+    /**
+     * @brief 续约只在 Leader 的内存中重新计时，不进入日志
+     */
+    CommandResponse handleKeepAlive(const CommandRequest& request);
+    /**
+     * @brief 定时检查过期的租约，Leader 把过期的租约作为一条日志提交，所有节点应用时删除绑定的 key
+     */
+    void expireLeases();
+    /**
+     * @brief 把 key 绑定到租约上，lease 为 0 表示解除绑定，只修改 key 所在分区的绑定关系
+     */
+    void bindLease(const std::string& key, int64_t lease);
+    /**
+     * @brief 删除租约和绑定在上面的 key
+     * @param[out] keys 被删除的 key
+     * @return 租约是否存在
+     */
+    bool revokeLease(int64_t id, std::vector<std::string>& keys);
+    /**
+     * @brief 设置租约的过期时间，同时更新定时索引
+     */
+    void setLeaseDeadline(int64_t id, uint64_t deadline);
+    /**
+     * @brief 取消租约的定时
+     */
+    void clearLeaseDeadline(int64_t id);
+    /**
+     * @brief key 所在的分区
+     */
+    size_t partitionOf(const std::string& key) const;
+
+    KVStore& partition(const std::string& key);
 private:
     MutexType m_mutex;
     int64_t m_id;
-    co::co_chan<raft::ApplyMsg> m_applychan;
+    co::co_chan<raft::ApplyBatch> m_applychan;
 
-    KVMap m_data;
+    // 按 key 的哈希分区，不同分区的命令可以并行应用
+    std::vector<KVStore> m_data;
     Persister::ptr m_persister;
     std::unique_ptr<RaftNode> m_raft;
 
     std::map<int64_t, std::pair<int64_t, CommandResponse>> m_lastOperation;
-    std::map<int64_t, co::co_chan<CommandResponse>> m_nofiyChans;
+    // 日志索引到这条日志中每个命令的等待 channel
+    std::map<int64_t, std::vector<co::co_chan<CommandResponse>>> m_nofiyChans;
+    // 等待合并的写命令
+    co::co_chan<PendingCommand> m_commandChan{4096};
+    // 等待状态机应用到 read index 的读请求
+    std::multimap<int64_t, co::co_chan<bool>> m_readWaiters;
+
+    // 租约 id 到存活时间（ms）
+    std::map<int64_t, int64_t> m_leases;
+    // 最后分配的租约 id，按日志顺序分配，所有节点一致
+    int64_t m_lastLeaseId = 0;
+    /**
+     * @brief 一个分区中 key 和租约的绑定关系，只被分区所在的协程修改
+     */
+    struct LeaseBindings {
+        std::unordered_map<std::string, int64_t> leaseOf;
+        std::unordered_map<int64_t, std::unordered_set<std::string>> keysOf;
+    };
+    std::vector<LeaseBindings> m_leaseBindings;
+    // 租约的过期时间（ms，单调时钟，不受系统时间调整的影响），只存在内存中，新的 Leader 上任时全部重新计时
+    std::unordered_map<int64_t, uint64_t> m_leaseDeadlines;
+    // 按过期时间排序的定时索引，检查过期时不需要遍历所有租约和 key
+    std::set<std::pair<uint64_t, int64_t>> m_leaseTimers;
+    // 上一次检查租约时作为 Leader 的任期，不是 Leader 为 0
+    int64_t m_leaseTerm = 0;
+    CycleTimerTocken m_leaseTimer;
 
     int64_t m_lastApplied = 0;
+    // 是否有快照正在后台持久化
+    bool m_snapshotting = false;
     int64_t m_maxRaftState = -1;
 };
 }
@@ -9,10 +9,45 @@
 
 namespace acid::raft {
 
+/**
+ * @brief 不可变的、引用计数的日志内容
+ * @details 日志、缓存、rpc 消息、持久化和状态机共享同一份内存，复制只增加引用计数，不会复制内容
+ */
+class Payload {
+public:
+    Payload() = default;
+
+    Payload(std::string data) : m_data(std::make_shared<const std::string>(std::move(data))) {}
+
+    Payload(const char* data) : Payload(std::string(data)) {}
+
+    const std::string& str() const { return m_data ? *m_data : Empty();}
+
+    operator const std::string&() const { return str();}
+
+    size_t size() const { return m_data ? m_data->size() : 0;}
+
+    bool empty() const { return size() == 0;}
+private:
+    static const std::string& Empty() {
+        static const std::string empty;
+        return empty;
+    }
+private:
+    std::shared_ptr<const std::string> m_data;
+};
+
 /**
  * @brief 日志条目，一条日志
  */
 struct Entry {
+    /**
+     * @brief 日志类型
+     */
+    enum Type : uint8_t {
+        NORMAL,         // 使用者提交的日志
+        CONF_CHANGE,    // 成员变更，内容为序列化后的新 ConfState
+    };
     // 日志索引
     int64_t index = 0;
     // 日志任期
@@ -20,19 +55,33 @@ struct Entry {
     // 日志内容data是一个二进制类型，
     // 使用者负责把业务序列化成二进制数，
     // 在apply日志的时候再反序列化执行相应业务操作
-    std::string data{};
+    Payload data{};
+    Type type = NORMAL;
     std::string toString() const {
-        std::string str = fmt::format("Index: {}, Term: {}, Data: {}", index, term, data);
+        std::string str = fmt::format("Index: {}, Term: {}, Type: {}, Data: {}", index, term, (int)type, data.str());
         return "{" + str + "}";
     }
     friend rpc::Serializer &operator<<(rpc::Serializer &s, const Entry &entry) {
-        s << entry.index << entry.term <<  entry.data;
+        s << entry.index << entry.term << entry.type << entry.data.str();
         return s;
     }
     friend rpc::Serializer &operator>>(rpc::Serializer &s, Entry &entry) {
-        s >> entry.index >> entry.term >>  entry.data;
+        std::string data;
+        s >> entry.index >> entry.term >> entry.type >> data;
+        entry.data = std::move(data);
         return s;
     }
 };
 }
+
+/**
+ * @brief 日志内容按字符串格式化
+ */
+template<>
+struct fmt::formatter<acid::raft::Payload> : fmt::formatter<std::string_view> {
+    template<typename FormatContext>
+    auto format(const acid::raft::Payload& payload, FormatContext& ctx) const {
+        return fmt::formatter<std::string_view>::format(payload.str(), ctx);
+    }
+};
 #endif //ACID_ENTRY_H
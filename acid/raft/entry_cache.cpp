@@ -0,0 +1,105 @@
+//
+// Created by zavier on 2023/2/19.
+//
+
+#include "entry_cache.h"
+
+namespace acid::raft {
+
+const Payload* EntryCache::get(int64_t index) {
+    auto it = m_items.find(index);
+    if (it != m_items.end()) {
+        m_lru.splice(m_lru.begin(), m_lru, it->second);
+        return &it->second->data;
+    }
+    auto unstable = m_unstable.find(index);
+    if (unstable == m_unstable.end()) {
+        return nullptr;
+    }
+    return &unstable->second;
+}
+
+void EntryCache::put(int64_t index, Payload data) {
+    if (index > m_stabled) {
+        auto [it, inserted] = m_unstable.try_emplace(index);
+        if (!inserted) {
+            m_bytes -= it->second.size();
+        }
+        m_bytes += data.size();
+        it->second = std::move(data);
+        return;
+    }
+    auto it = m_items.find(index);
+    if (it != m_items.end()) {
+        m_bytes -= it->second->data.size();
+        m_bytes += data.size();
+        it->second->data = std::move(data);
+        m_lru.splice(m_lru.begin(), m_lru, it->second);
+    } else {
+        m_bytes += data.size();
+        m_lru.push_front({.index = index, .data = std::move(data)});
+        m_items[index] = m_lru.begin();
+    }
+    evict();
+}
+
+void EntryCache::erase(int64_t lo, int64_t hi) {
+    for (int64_t index = lo; index < hi; ++index) {
+        auto it = m_items.find(index);
+        if (it == m_items.end()) {
+            continue;
+        }
+        m_bytes -= it->second->data.size();
+        m_lru.erase(it->second);
+        m_items.erase(it);
+    }
+    auto first = m_unstable.lower_bound(lo);
+    auto last = m_unstable.lower_bound(hi);
+    for (auto it = first; it != last; ++it) {
+        m_bytes -= it->second.size();
+    }
+    m_unstable.erase(first, last);
+}
+
+void EntryCache::stableTo(int64_t index) {
+    if (index < m_stabled) {
+        // 被覆盖的日志需要重新持久化，只在日志冲突时发生
+        for (auto it = m_lru.begin(); it != m_lru.end();) {
+            if (it->index <= index) {
+                ++it;
+                continue;
+            }
+            m_unstable[it->index] = std::move(it->data);
+            m_items.erase(it->index);
+            it = m_lru.erase(it);
+        }
+    }
+    m_stabled = index;
+    // 刚持久化的日志放到最近使用的位置
+    auto last = m_unstable.upper_bound(index);
+    for (auto it = m_unstable.begin(); it != last; ++it) {
+        m_lru.push_front({.index = it->first, .data = std::move(it->second)});
+        m_items[it->first] = m_lru.begin();
+    }
+    m_unstable.erase(m_unstable.begin(), last);
+    evict();
+}
+
+void EntryCache::clear() {
+    m_lru.clear();
+    m_items.clear();
+    m_unstable.clear();
+    m_bytes = 0;
+}
+
+void EntryCache::evict() {
+    // LRU 中只有已经持久化的日志，从尾部依次淘汰
+    while (m_bytes > m_capacity && !m_lru.empty()) {
+        auto& item = m_lru.back();
+        m_bytes -= item.data.size();
+        m_items.erase(item.index);
+        m_lru.pop_back();
+    }
+}
+
+}
@@ -0,0 +1,67 @@
+//
+// Created by zavier on 2023/2/19.
+//
+
+#ifndef ACID_ENTRY_CACHE_H
+#define ACID_ENTRY_CACHE_H
+
+#include <list>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include "entry.h"
+
+namespace acid::raft {
+/**
+ * @brief 日志内容的 LRU 缓存，按字节数限制容量
+ * @details 没有持久化的日志只存在于缓存中，不能被淘汰，所以实际占用可能暂时超过容量。
+ * 这些日志单独存放，持久化之后才进入 LRU，淘汰时只需要从 LRU 的尾部删除，每条日志最多被淘汰一次。
+ */
+class EntryCache {
+public:
+    /**
+     * @param capacity 缓存容量（字节）
+     */
+    explicit EntryCache(uint64_t capacity) : m_capacity(capacity) {}
+    /**
+     * @brief 查找日志内容，命中后移到最近使用的位置
+     * @return 不存在返回 nullptr
+     */
+    const Payload* get(int64_t index);
+    /**
+     * @brief 缓存日志内容，超过容量时淘汰最久未使用的日志
+     */
+    void put(int64_t index, Payload data);
+    /**
+     * @brief 删除 [lo, hi) 的日志
+     */
+    void erase(int64_t lo, int64_t hi);
+    /**
+     * @brief 更新已经持久化的日志索引，之后的日志不能被淘汰，减小时之后的日志移出 LRU
+     */
+    void stableTo(int64_t index);
+
+    void clear();
+
+    [[nodiscard]]
+    uint64_t bytes() const { return m_bytes;}
+private:
+    void evict();
+private:
+    struct Item {
+        int64_t index;
+        Payload data;
+    };
+    // 已经持久化的日志，最近使用的在前
+    std::list<Item> m_lru;
+    std::unordered_map<int64_t, std::list<Item>::iterator> m_items;
+    // 还没有持久化的日志，不参与淘汰
+    std::map<int64_t, Payload> m_unstable;
+    uint64_t m_capacity;
+    uint64_t m_bytes = 0;
+    // 已经持久化的日志索引
+    int64_t m_stabled = 0;
+};
+
+}
+#endif //ACID_ENTRY_CACHE_H
@@ -0,0 +1,80 @@
+//
+// Created by zavier on 2023/2/20.
+//
+
+#include <algorithm>
+#include <vector>
+#include "membership.h"
+
+namespace acid::raft {
+namespace {
+bool MajorityGranted(const std::map<int64_t, std::string>& ids, const std::function<bool(int64_t)>& granted) {
+    // 空配置不做限制，联合共识之外的 outgoing 为空
+    if (ids.empty()) {
+        return true;
+    }
+    size_t count = 0;
+    for (auto& [id, _]: ids) {
+        if (granted(id)) {
+            ++count;
+        }
+    }
+    return count > ids.size() / 2;
+}
+
+int64_t MajorityValue(const std::map<int64_t, std::string>& ids, const std::function<int64_t(int64_t)>& value) {
+    if (ids.empty()) {
+        return INT64_MAX;
+    }
+    std::vector<int64_t> values;
+    values.reserve(ids.size());
+    for (auto& [id, _]: ids) {
+        values.push_back(value(id));
+    }
+    // 第 n/2 大的值被大多数节点达到
+    std::sort(values.begin(), values.end(), std::greater<>());
+    return values[values.size() / 2];
+}
+
+std::string Join(const std::map<int64_t, std::string>& ids) {
+    std::string str;
+    for (auto& [id, _]: ids) {
+        if (!str.empty()) {
+            str.push_back(',');
+        }
+        str += std::to_string(id);
+    }
+    return "[" + str + "]";
+}
+}
+
+std::map<int64_t, std::string> ConfState::members() const {
+    std::map<int64_t, std::string> all = learners;
+    all.insert(outgoing.begin(), outgoing.end());
+    for (auto& [id, address]: voters) {
+        all[id] = address;
+    }
+    return all;
+}
+
+bool ConfState::hasQuorum(const std::function<bool(int64_t)>& granted) const {
+    return MajorityGranted(voters, granted) && MajorityGranted(outgoing, granted);
+}
+
+int64_t ConfState::quorumValue(const std::function<int64_t(int64_t)>& value) const {
+    return std::min(MajorityValue(voters, value), MajorityValue(outgoing, value));
+}
+
+ConfState ConfState::leaveJoint() const {
+    ConfState conf;
+    conf.voters = voters;
+    conf.learners = learners;
+    return conf;
+}
+
+std::string ConfState::toString() const {
+    std::string str = fmt::format("Voters: {}, Outgoing: {}, Learners: {}", Join(voters), Join(outgoing), Join(learners));
+    return "{" + str + "}";
+}
+
+}
@@ -0,0 +1,74 @@
+//
+// Created by zavier on 2023/2/20.
+//
+
+#ifndef ACID_MEMBERSHIP_H
+#define ACID_MEMBERSHIP_H
+
+#include <functional>
+#include <map>
+#include <string>
+#include "../rpc/serializer.h"
+
+namespace acid::raft {
+/**
+ * @brief 集群成员配置，节点 id 到地址的映射
+ * @details
+ * 1. voters 有投票权的节点，参与选举和 commit 的大多数计算
+ * 2. outgoing 联合共识阶段旧配置中有投票权的节点，不为空时选举和 commit 需要同时得到新旧两个配置各自的大多数
+ * 3. learners 只接收日志和快照，不参与投票，追上日志后可以提升为 voter
+ * 成员变更以日志的形式复制，节点追加配置日志后立即使用新配置，不需要等到提交。
+ * 改变 voter 的变更先进入联合共识 C(old,new)，提交后 Leader 再追加只包含新配置的 C(new)，
+ * 任何时刻都不会出现新旧配置各自选出 Leader 的情况。
+ */
+struct ConfState {
+    std::map<int64_t, std::string> voters;
+    std::map<int64_t, std::string> outgoing;
+    std::map<int64_t, std::string> learners;
+
+    bool empty() const { return voters.empty();}
+    /**
+     * @brief 是否处于联合共识阶段
+     */
+    bool joint() const { return !outgoing.empty();}
+    /**
+     * @brief 是否有投票权，联合共识阶段新旧配置中的 voter 都有投票权
+     */
+    bool isVoter(int64_t id) const { return voters.contains(id) || outgoing.contains(id);}
+
+    bool isLearner(int64_t id) const { return learners.contains(id);}
+
+    bool contains(int64_t id) const { return isVoter(id) || isLearner(id);}
+    /**
+     * @brief 所有成员
+     */
+    std::map<int64_t, std::string> members() const;
+    /**
+     * @brief 是否得到了大多数节点的同意，联合共识阶段需要新旧两个配置各自的大多数
+     * @param granted 节点是否同意
+     */
+    bool hasQuorum(const std::function<bool(int64_t)>& granted) const;
+    /**
+     * @brief 被大多数节点达到的值，例如大多数节点已经复制的日志索引，联合共识阶段取两个配置中较小的一个
+     * @param value 节点的值
+     */
+    int64_t quorumValue(const std::function<int64_t(int64_t)>& value) const;
+    /**
+     * @brief 离开联合共识，只保留新配置
+     */
+    ConfState leaveJoint() const;
+
+    std::string toString() const;
+
+    friend rpc::Serializer& operator<<(rpc::Serializer& s, const ConfState& conf) {
+        s << conf.voters << conf.outgoing << conf.learners;
+        return s;
+    }
+    friend rpc::Serializer& operator>>(rpc::Serializer& s, ConfState& conf) {
+        s >> conf.voters >> conf.outgoing >> conf.learners;
+        return s;
+    }
+};
+
+}
+#endif //ACID_MEMBERSHIP_H
@@ -4,95 +4,263 @@
 
 #include <fstream>
 #include "persister.h"
+#include "../common/config.h"
 
 namespace acid::raft {
 static auto g_logger = GetLogInstance();
 
-Persister::Persister(const std::filesystem::path& path) : m_path(path), m_shotter(path / "snapshot") {
+namespace {
+// 旧版本的日志格式，没有日志类型
+struct LegacyEntry {
+    int64_t index = 0;
+    int64_t term = 0;
+    std::string data;
+    friend rpc::Serializer& operator>>(rpc::Serializer& s, LegacyEntry& entry) {
+        s >> entry.index >> entry.term >> entry.data;
+        return s;
+    }
+};
+}
+
+static ConfigVar<uint64_t>::ptr g_wal_segment_size =
+        Config::Lookup<uint64_t>("raft.wal.segment_size", 64 * 1024 * 1024, "raft wal segment size(byte)");
+
+static ConfigVar<std::string>::ptr g_wal_sync_policy =
+        Config::Lookup<std::string>("raft.wal.sync_policy", "always", "raft wal sync policy, always, batch or none");
+
+static ConfigVar<uint32_t>::ptr g_wal_sync_interval =
+        Config::Lookup<uint32_t>("raft.wal.sync_interval", 10, "raft wal sync interval(ms) for batch policy");
+
+Persister::Persister(const std::filesystem::path& path)
+        : m_path(path)
+        , m_shotter(path / "snapshot")
+        , m_wal(path / "wal", g_wal_segment_size->getValue()) {
     if (m_path.empty()) {
         SPDLOG_LOGGER_WARN(g_logger, "Persist path is empty");
-    } else if (!std::filesystem::exists(m_path)) {
-        SPDLOG_LOGGER_WARN(g_logger, "Persist path: {} is not exists, create directory", m_path.string());
-        std::filesystem::create_directories(path);
     } else if (!std::filesystem::is_directory(m_path)) {
         SPDLOG_LOGGER_WARN(g_logger, "Persist path: {} is not a directory", m_path.string());
     } else {
         SPDLOG_LOGGER_INFO(g_logger, "Persist path : {}", getFullPathName());
     }
-}
 
-std::optional<HardState> Persister::loadHardState() {
+    std::string policy = g_wal_sync_policy->getValue();
+    if (policy == "batch") {
+        m_policy = BATCH;
+        m_syncTimer = CycleTimer(g_wal_sync_interval->getValue(), [this] {
+            std::unique_lock<MutexType> lock(m_ioMutex);
+            m_wal.sync();
+        });
+    } else if (policy == "none") {
+        m_policy = NONE;
+        m_shotter.setSync(false);
+    } else if (policy != "always") {
+        SPDLOG_LOGGER_WARN(g_logger, "unknown raft.wal.sync_policy {}, use always", policy);
+    }
+
+    // 迁移旧版本全量存储的 raft 状态
     std::ifstream in(m_path / m_name, std::ios_base::in);
     if (!in.is_open()) {
-        return std::nullopt;
+        return;
     }
     std::string str((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
-    rpc::Serializer s(str);
+    in.close();
+    if (!m_wal.exist()) {
+        rpc::Serializer s(str);
+        HardState hs{};
+        std::vector<Entry> ents;
+        try {
+            std::vector<LegacyEntry> legacy;
+            s >> hs >> legacy;
+            for (auto& ent: legacy) {
+                ents.push_back({.index = ent.index, .term = ent.term, .data = std::move(ent.data)});
+            }
+        } catch (...) {
+            SPDLOG_LOGGER_ERROR(g_logger, "read legacy raft state fail");
+            return;
+        }
+        if (ents.empty()) {
+            ents.emplace_back();
+        }
+        SnapshotMetadata snap{.index = ents.front().index, .term = ents.front().term};
+        if (!m_wal.saveSnapshot(snap) || !m_wal.save(&hs, {ents.begin() + 1, ents.end()})) {
+            SPDLOG_LOGGER_ERROR(g_logger, "migrate legacy raft state to wal fail");
+            return;
+        }
+        SPDLOG_LOGGER_INFO(g_logger, "migrate legacy raft state to wal, {} entries", ents.size() - 1);
+    }
+    std::filesystem::remove(m_path / m_name);
+}
+
+Persister::~Persister() {
+    m_syncTimer.stop();
+}
+
+std::optional<HardState> Persister::loadHardState() {
+    std::unique_lock<MutexType> lock(m_ioMutex);
     HardState hs{};
-    try {
-        s >> hs;
-    } catch (...) {
+    std::vector<Entry> ents;
+    if (!m_wal.readMeta(hs, ents)) {
         return std::nullopt;
     }
     return hs;
 }
 
 std::optional<std::vector<Entry>> Persister::loadEntries() {
-    std::unique_lock<co::co_mutex> lock(m_mutex);
-    std::ifstream in(m_path / m_name, std::ios_base::in);
-    if (!in.is_open()) {
+    std::unique_lock<MutexType> lock(m_ioMutex);
+    HardState hs{};
+    std::vector<Entry> ents;
+    if (!m_wal.readAll(hs, ents)) {
         return std::nullopt;
     }
-    std::string str((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
-    rpc::Serializer s(str);
+    return ents;
+}
+
+std::optional<std::vector<Entry>> Persister::loadEntryMetas() {
+    std::unique_lock<MutexType> lock(m_ioMutex);
+    HardState hs{};
     std::vector<Entry> ents;
-    try {
-        HardState hs{};
-        s >> hs >> ents;
-    } catch (...) {
+    if (!m_wal.readMeta(hs, ents)) {
         return std::nullopt;
     }
     return ents;
 }
 
+std::optional<ConfState> Persister::loadConfState() {
+    std::unique_lock<MutexType> lock(m_ioMutex);
+    const ConfState& conf = m_wal.snapshot().conf;
+    if (conf.empty()) {
+        return std::nullopt;
+    }
+    return conf;
+}
+
+bool Persister::readEntries(int64_t lo, int64_t hi, std::vector<Entry>& ents) {
+    std::unique_lock<MutexType> lock(m_ioMutex);
+    return m_wal.read(lo, hi, ents);
+}
+
 Snapshot::ptr Persister::loadSnapshot() {
-    std::unique_lock<co::co_mutex> lock(m_mutex);
+    std::unique_lock<MutexType> lock(m_ioMutex);
     return m_shotter.loadSnap();
 }
 
+std::optional<SnapshotMetadata> Persister::loadSnapshotMetadata() {
+    std::unique_lock<MutexType> lock(m_ioMutex);
+    return m_shotter.latestMetadata();
+}
+
+bool Persister::readSnapshotChunk(const SnapshotMetadata& metadata, int64_t offset, int64_t size, std::string& data, bool& done) {
+    std::unique_lock<MutexType> lock(m_ioMutex);
+    return m_shotter.readChunk(metadata, offset, size, data, done);
+}
+
+int64_t Persister::receiveSnapshotChunk(const SnapshotMetadata& metadata, int64_t offset, const std::string& data) {
+    std::unique_lock<MutexType> lock(m_ioMutex);
+    return m_shotter.receiveChunk(metadata, offset, data);
+}
+
+Snapshot::ptr Persister::finishSnapshot(const SnapshotMetadata& metadata) {
+    std::unique_lock<MutexType> lock(m_ioMutex);
+    return m_shotter.finishReceive(metadata);
+}
+
 int64_t Persister::getRaftStateSize() {
-    std::unique_lock<co::co_mutex> lock(m_mutex);
-    std::ifstream in(m_path / m_name, std::ios_base::in);
-    if (!in.is_open()) {
+    std::unique_lock<MutexType> lock(m_ioMutex);
+    if (!m_wal.exist()) {
         return -1;
     }
-    in.seekg(0, in.end);
-    auto fos = in.tellg();
-    return fos;
+    return m_wal.size();
 }
 
 bool Persister::persist(const HardState &hs, const std::vector <Entry> &ents, const Snapshot::ptr snapshot) {
-    std::unique_lock<co::co_mutex> lock(m_mutex);
-    int fd = open((m_path / m_name).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
-    if (fd < 0) {
+    std::unique_lock<MutexType> lock(m_mutex);
+    if (m_failed) {
         return false;
     }
-
-    rpc::Serializer s;
-    s << hs << ents;
-    s.reset();
-
-    std::string data = s.toString();
-    if (write(fd, data.c_str(), data.size()) < 0) {
+    m_batch.add(&hs, ents);
+    if (!commit(lock, ++m_appended)) {
         return false;
     }
-    // 持久化，必须马上刷新磁盘
-    fsync(fd);
-    close(fd);
     if (snapshot) {
-        return m_shotter.saveSnap(snapshot);
+        // 快照落盘之后才能丢弃之前的日志，分块接收的快照已经在磁盘上了
+        {
+            std::unique_lock<MutexType> io(m_ioMutex);
+            if (!m_shotter.exists(snapshot->metadata) && !m_shotter.saveSnap(snapshot)) {
+                return false;
+            }
+        }
+        m_batch.add(snapshot->metadata);
+        return commit(lock, ++m_appended);
     }
     return true;
 }
 
-}
\ No newline at end of file
+bool Persister::saveSnapshot(const Snapshot::ptr& snapshot) {
+    std::unique_lock<MutexType> lock(m_mutex);
+    if (m_failed) {
+        return false;
+    }
+    // 快照之前的日志先落盘，之后才能记录快照丢弃它们
+    if (!commit(lock, m_appended)) {
+        return false;
+    }
+    {
+        std::unique_lock<MutexType> io(m_ioMutex);
+        if (snapshot->metadata.index <= m_wal.snapshot().index) {
+            return true;
+        }
+        // 分块接收的快照已经在磁盘上了
+        if (!m_shotter.exists(snapshot->metadata) && !m_shotter.saveSnap(snapshot)) {
+            return false;
+        }
+    }
+    m_batch.add(snapshot->metadata);
+    return commit(lock, ++m_appended);
+}
+
+uint64_t Persister::append(const HardState &hs, const std::vector <Entry> &ents) {
+    std::unique_lock<MutexType> lock(m_mutex);
+    m_batch.add(&hs, ents);
+    return ++m_appended;
+}
+
+bool Persister::wait(uint64_t seq) {
+    std::unique_lock<MutexType> lock(m_mutex);
+    return commit(lock, seq);
+}
+
+bool Persister::commit(std::unique_lock<MutexType>& lock, uint64_t seq) {
+    while (m_committed < seq) {
+        if (m_failed) {
+            return false;
+        }
+        if (m_writing) {
+            // 其他协程正在写入，等待它完成后检查自己的记录是否已经一起写入
+            m_cond.wait(lock);
+            continue;
+        }
+        // 由自己把目前攒下的记录一次性写入
+        m_writing = true;
+        WAL::Batch batch;
+        std::swap(batch, m_batch);
+        uint64_t target = m_appended;
+        lock.unlock();
+        bool ok;
+        {
+            std::unique_lock<MutexType> io(m_ioMutex);
+            ok = m_wal.write(batch, m_policy == ALWAYS);
+        }
+        lock.lock();
+        m_writing = false;
+        if (ok) {
+            m_committed = target;
+        } else {
+            SPDLOG_LOGGER_CRITICAL(g_logger, "write wal fail, persister is no longer writable");
+            m_failed = true;
+        }
+        m_cond.notify_all();
+    }
+    return true;
+}
+
+}
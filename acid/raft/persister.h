@@ -7,39 +7,38 @@
 
 #include <optional>
 #include <libgo/sync/co_mutex.h>
+#include "../common/util.h"
 #include "../rpc/serializer.h"
 #include "entry.h"
 #include "snapshot.h"
+#include "wal.h"
 
 namespace acid::raft {
-// raft节点状态的持久化数据
-struct HardState {
-    // 当前任期
-    int64_t term;
-    // 任期内给谁投过票
-    int64_t vote;
-    // 已经commit的最大index
-    int64_t commit;
-    friend rpc::Serializer& operator<<(rpc::Serializer& s, const HardState& hs) {
-        s << hs.term << hs.vote << hs.commit;
-        return s;
-    }
-    friend rpc::Serializer& operator>>(rpc::Serializer& s, HardState& hs) {
-        s >> hs.term >> hs.vote >> hs.commit;
-        return s;
-    }
-};
 /**
  * @brief 持久化存储
+ * @details raft 状态和日志以追加的方式写入 WAL，快照由 Snapshotter 单独存储。
+ * 写入采用组提交：并发调用 persist 的记录先在内存中攒成一批，由其中一个调用者写入并刷新一次磁盘，
+ * 然后唤醒所有记录已经写入的调用者。刷盘策略由配置 raft.wal.sync_policy 决定：
+ * 1. always 每一批记录都刷新磁盘后才返回，不会丢失数据
+ * 2. batch 写入后立即返回，由定时器每隔 raft.wal.sync_interval 毫秒刷新一次磁盘，掉电时最多丢失这段时间的数据
+ * 3. none 从不主动刷新磁盘，仅用于压测
  */
 class Persister {
 public:
     using ptr = std::shared_ptr<Persister>;
     using MutexType = co::co_mutex;
+    /**
+     * @brief 刷盘策略
+     */
+    enum SyncPolicy {
+        ALWAYS,     // 每次写入都刷盘
+        BATCH,      // 定时刷盘
+        NONE,       // 不刷盘
+    };
 
     explicit Persister(const std::filesystem::path& persist_path = ".");
 
-    ~Persister() = default;
+    ~Persister();
 
     /**
      * @brief 获取持久化的 raft 状态
@@ -49,18 +48,70 @@ public:
      * @brief 获取持久化的 log
      */
     std::optional <std::vector<Entry>> loadEntries();
+    /**
+     * @brief 获取持久化日志的索引和任期，不读取日志内容
+     */
+    std::optional <std::vector<Entry>> loadEntryMetas();
+    /**
+     * @brief 获取最后一次快照位置的成员配置，不读取快照内容
+     * @return 没有快照或者快照中没有记录配置返回 std::nullopt
+     */
+    std::optional<ConfState> loadConfState();
+    /**
+     * @brief 从磁盘读取 [lo, hi) 的日志
+     */
+    bool readEntries(int64_t lo, int64_t hi, std::vector<Entry>& ents);
     /**
      * @brief 获取快照
      */
     Snapshot::ptr loadSnapshot();
     /**
-     * @brief 获取 raft state 的长度
+     * @brief 获取最新快照的元数据，不读取快照内容
+     */
+    std::optional<SnapshotMetadata> loadSnapshotMetadata();
+    /**
+     * @brief 从快照文件中读取一个分块，用于分块发送快照
+     * @see Snapshotter::readChunk
+     */
+    bool readSnapshotChunk(const SnapshotMetadata& metadata, int64_t offset, int64_t size, std::string& data, bool& done);
+    /**
+     * @brief 接收一个快照分块
+     * @see Snapshotter::receiveChunk
+     */
+    int64_t receiveSnapshotChunk(const SnapshotMetadata& metadata, int64_t offset, const std::string& data);
+    /**
+     * @brief 快照接收完成
+     * @see Snapshotter::finishReceive
+     */
+    Snapshot::ptr finishSnapshot(const SnapshotMetadata& metadata);
+    /**
+     * @brief 获取 raft state 的长度，即快照之后的日志大小
      */
     int64_t getRaftStateSize();
     /**
      * @brief 持久化
+     * @param hs raft 状态
+     * @param ents 新增的日志，如果和已持久化的日志重叠，则覆盖重叠部分及之后的日志
+     * @param snapshot 快照，快照之前的日志会被丢弃
      */
     bool persist(const HardState &hs, const std::vector <Entry> &ents, const Snapshot::ptr snapshot = nullptr);
+    /**
+     * @brief 保存快照并在 WAL 中记录，之前加入批次的记录先写入
+     * @details 调用者在自己的锁内用 append 提交快照之前的状态和日志，然后释放锁调用，磁盘 IO 期间不阻塞调用者。
+     * 不比 WAL 中已经记录的快照新的快照直接忽略，并发保存快照时旧的快照不会覆盖新的快照。
+     */
+    bool saveSnapshot(const Snapshot::ptr& snapshot);
+    /**
+     * @brief 把记录加入待写入的批次，不等待写入，不涉及磁盘 IO
+     * @details 记录按照调用的顺序写入，调用者持有自己的锁调用可以保证和其他写入之间的顺序
+     * @return 批次序号，用于 wait
+     */
+    uint64_t append(const HardState &hs, const std::vector <Entry> &ents);
+    /**
+     * @brief 等待序号 seq 及之前的记录全部落盘
+     * @return 是否写入成功
+     */
+    bool wait(uint64_t seq);
     /**
      * @brief 获取快照路径
      */
@@ -68,9 +119,35 @@ public:
         return canonical(m_path);
     }
 private:
+    /**
+     * @brief 等待序号 seq 之前的记录全部写入，如果没有其他协程在写入则由自己写入当前这一批记录
+     * @param lock 已经加锁的 m_mutex
+     * @return 是否写入成功
+     */
+    bool commit(std::unique_lock<MutexType>& lock, uint64_t seq);
+private:
+    // 保护待写入的记录和组提交的状态
     MutexType m_mutex;
+    // 保护 WAL 和快照文件，同一时间只有一个协程进行磁盘 IO
+    MutexType m_ioMutex;
+    co::co_condition_variable m_cond;
     const std::filesystem::path m_path;
     Snapshotter m_shotter;
+    WAL m_wal;
+    SyncPolicy m_policy = ALWAYS;
+    // 还未写入的记录
+    WAL::Batch m_batch;
+    // 已经加入的记录批次序号
+    uint64_t m_appended = 0;
+    // 已经写入的记录批次序号
+    uint64_t m_committed = 0;
+    // 是否有协程正在写入
+    bool m_writing = false;
+    // 写入失败后 WAL 的状态不可信，之后的写入全部失败
+    bool m_failed = false;
+    // batch 策略下定时刷盘
+    CycleTimerTocken m_syncTimer;
+    // 旧版本全量存储的 raft 状态文件，启动时迁移到 WAL
     const std::string m_name = "raft-state";
 };
 }
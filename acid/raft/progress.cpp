@@ -0,0 +1,125 @@
+//
+// Created by zavier on 2023/2/14.
+//
+
+#include "progress.h"
+
+namespace acid::raft {
+static auto g_logger = GetLogInstance();
+
+void Inflights::add(int64_t index) {
+    if (full()) {
+        SPDLOG_LOGGER_ERROR(g_logger, "cannot add into a full inflights");
+        return;
+    }
+    m_buffer.push_back(index);
+}
+
+void Inflights::freeLE(int64_t index) {
+    while (!m_buffer.empty() && m_buffer.front() <= index) {
+        m_buffer.pop_front();
+    }
+}
+
+void Inflights::freeFirstOne() {
+    if (!m_buffer.empty()) {
+        m_buffer.pop_front();
+    }
+}
+
+Progress::Progress(int64_t next, size_t maxInflight)
+        : m_next(next)
+        , m_inflights(maxInflight) {
+}
+
+void Progress::resetState(State state) {
+    m_probeSent = false;
+    m_pendingSnapshot = 0;
+    m_state = state;
+    m_inflights.reset();
+}
+
+void Progress::becomeProbe() {
+    // 如果是从快照状态转换过来，快照发送成功后 Follower 至少有快照之前的日志
+    if (m_state == Snapshot) {
+        int64_t pending = m_pendingSnapshot;
+        resetState(Probe);
+        m_next = std::max(m_match + 1, pending + 1);
+    } else {
+        resetState(Probe);
+        m_next = m_match + 1;
+    }
+}
+
+void Progress::becomeReplicate() {
+    resetState(Replicate);
+    m_next = m_match + 1;
+}
+
+void Progress::becomeSnapshot(int64_t snapshotIndex) {
+    resetState(Snapshot);
+    m_pendingSnapshot = snapshotIndex;
+}
+
+bool Progress::maybeUpdate(int64_t index) {
+    bool updated = false;
+    if (m_match < index) {
+        m_match = index;
+        updated = true;
+        m_probeSent = false;
+    }
+    m_next = std::max(m_next, index + 1);
+    return updated;
+}
+
+bool Progress::maybeDecrTo(int64_t rejected, int64_t hint) {
+    if (m_state == Replicate) {
+        // 过期的拒绝，已经确认匹配的位置不可能被拒绝
+        if (rejected <= m_match) {
+            return false;
+        }
+        // 直接回退到已经匹配的位置
+        m_next = m_match + 1;
+        return true;
+    }
+    // 探测状态下只有最近一次探测的拒绝才有效
+    if (m_next - 1 != rejected) {
+        return false;
+    }
+    m_next = hint > 0 ? std::min(rejected, hint) : rejected;
+    m_next = std::max(m_next, m_match + 1);
+    m_probeSent = false;
+    return true;
+}
+
+bool Progress::isPaused() const {
+    switch (m_state) {
+        case Probe:
+            return m_probeSent;
+        case Replicate:
+            return m_inflights.full();
+        case Snapshot:
+            return true;
+    }
+    return false;
+}
+
+void Progress::onHeartbeat() {
+    if (m_state == Probe) {
+        m_probeSent = false;
+    } else if (m_state == Replicate && m_inflights.full()) {
+        m_inflights.freeFirstOne();
+    }
+}
+
+std::string Progress::toString() const {
+    static const char* states[] = {"Probe", "Replicate", "Snapshot"};
+    std::string str = fmt::format("State: {}, Match: {}, Next: {}, Inflights: {}",
+                                  states[m_state], m_match, m_next, m_inflights.count());
+    if (m_state == Snapshot) {
+        str += fmt::format(", PendingSnapshot: {}", m_pendingSnapshot);
+    }
+    return "{" + str + "}";
+}
+
+}
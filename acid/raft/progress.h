@@ -0,0 +1,154 @@
+//
+// Created by zavier on 2023/2/14.
+//
+
+#ifndef ACID_PROGRESS_H
+#define ACID_PROGRESS_H
+
+#include <deque>
+#include <string>
+#include "../common/util.h"
+
+namespace acid::raft {
+/**
+ * @brief 已经发出但还没有收到响应的 AppendEntries 消息窗口
+ * @details 记录每条消息中最后一条日志的索引，收到响应后释放不大于响应索引的消息
+ */
+class Inflights {
+public:
+    explicit Inflights(size_t size) : m_size(size) {}
+    /**
+     * @brief 记录一条发出的消息
+     * @param index 消息中最后一条日志的索引
+     */
+    void add(int64_t index);
+    /**
+     * @brief 释放所有最后一条日志索引不大于 index 的消息
+     */
+    void freeLE(int64_t index);
+    /**
+     * @brief 释放最早发出的一条消息
+     */
+    void freeFirstOne();
+    /**
+     * @brief 窗口是否已满
+     */
+    bool full() const { return m_buffer.size() >= m_size;}
+
+    size_t count() const { return m_buffer.size();}
+
+    void reset() { m_buffer.clear();}
+private:
+    // 窗口大小
+    size_t m_size;
+    // 单调递增的日志索引
+    std::deque<int64_t> m_buffer;
+};
+
+/**
+ * @brief Leader 视角下的一个 Follower 的复制进度
+ * @details
+ * 1. Probe 探测状态，不知道 Follower 的日志在哪里和自己匹配，每次只发送一条消息，等响应后再决定下一条
+ * 2. Replicate 复制状态，已经确认匹配位置，发送消息后乐观地推进 next，在窗口内流水线地发送多条消息
+ * 3. Snapshot 快照状态，Follower 需要的日志已经被压缩，正在发送快照，暂停发送日志
+ */
+class Progress {
+public:
+    enum State {
+        Probe,
+        Replicate,
+        Snapshot,
+    };
+    /**
+     * @param next 下一条要发送的日志索引
+     * @param maxInflight 复制状态下最多同时发出的消息数量
+     */
+    Progress(int64_t next, size_t maxInflight);
+    /**
+     * @brief 转换为探测状态，从 match 之后开始探测
+     */
+    void becomeProbe();
+    /**
+     * @brief 转换为复制状态
+     */
+    void becomeReplicate();
+    /**
+     * @brief 转换为快照状态
+     * @param snapshotIndex 发送的快照索引
+     */
+    void becomeSnapshot(int64_t snapshotIndex);
+    /**
+     * @brief 快照发送失败，之后转换为探测状态时从 match 之后开始探测
+     */
+    void snapshotFailure() { m_pendingSnapshot = 0;}
+    /**
+     * @brief 收到成功的响应后更新进度
+     * @param index Follower 确认和自己匹配的最后一条日志索引
+     * @return 如果 match 前进了返回 true，过期的响应返回 false
+     */
+    bool maybeUpdate(int64_t index);
+    /**
+     * @brief 复制状态下发出消息后乐观地推进 next
+     * @param index 消息中最后一条日志的索引
+     */
+    void optimisticUpdate(int64_t index) { m_next = index + 1;}
+    /**
+     * @brief 收到拒绝的响应后回退 next
+     * @param rejected 被拒绝的消息的 prevLogIndex
+     * @param hint Follower 建议的下一条日志索引，0 表示没有建议
+     * @return 如果回退了返回 true，过期的拒绝返回 false
+     */
+    bool maybeDecrTo(int64_t rejected, int64_t hint);
+    /**
+     * @brief 是否暂停发送日志
+     */
+    bool isPaused() const;
+    /**
+     * @brief 探测状态下发出一条消息后暂停，直到收到响应或者下一次心跳
+     */
+    void pause() { m_probeSent = true;}
+    /**
+     * @brief 心跳时调用，用来从丢失的消息中恢复
+     * @details 探测状态下允许再发送一条探测，复制状态下窗口满了则释放最早的一条消息
+     */
+    void onHeartbeat();
+    /**
+     * @brief 记录该节点在当前任期内响应过的消息的发送时间，用于计算 Leader 租约
+     * @param sentMs 消息的发送时间（单调时钟）
+     */
+    void ack(uint64_t sentMs) { m_lastAck = std::max(m_lastAck, sentMs);}
+
+    [[nodiscard]]
+    int64_t match() const { return m_match;}
+    [[nodiscard]]
+    int64_t next() const { return m_next;}
+    [[nodiscard]]
+    State state() const { return m_state;}
+    [[nodiscard]]
+    int64_t pendingSnapshot() const { return m_pendingSnapshot;}
+    [[nodiscard]]
+    uint64_t lastAck() const { return m_lastAck;}
+
+    Inflights& inflights() { return m_inflights;}
+
+    std::string toString() const;
+private:
+    void resetState(State state);
+private:
+    // 已经复制到该节点的最高日志索引
+    int64_t m_match = 0;
+    // 下一条要发送的日志索引
+    int64_t m_next;
+    State m_state = Probe;
+    // 正在发送的快照索引
+    int64_t m_pendingSnapshot = 0;
+    // 探测状态下是否已经发出了探测
+    bool m_probeSent = false;
+    // 复制状态下发出但还未确认的消息
+    Inflights m_inflights;
+    // 最近一次被响应的消息的发送时间
+    uint64_t m_lastAck = 0;
+};
+
+}
+#endif //ACID_PROGRESS_H
@@ -0,0 +1,169 @@
+//
+// Created by zavier on 2023/2/21.
+//
+
+#include "acid/raft/raft_host.h"
+
+namespace acid::raft {
+static auto g_logger = GetLogInstance();
+
+template<typename Reply, typename Args>
+void RaftHost::registerGroupMethod(const std::string& name, Reply (RaftNode::*handler)(Args)) {
+    registerMethod(name, [this, name, handler](uint64_t group, Args args) {
+        RaftNode::ptr node = getGroup(group);
+        if (!node) {
+            SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] receives {} for unknown group {}", m_id, name, group);
+            return Reply{};
+        }
+        return ((*node).*handler)(std::move(args));
+    });
+}
+
+RaftHost::RaftHost(int64_t id) : m_id(id) {
+    rpc::RpcServer::setName("Raft-Host[" + std::to_string(id) + "]");
+    // 启动前一次性注册所有服务，之后增删 Raft 组不需要修改 rpc 服务
+    registerGroupMethod(REQUEST_VOTE, &RaftNode::handleRequestVote);
+    registerGroupMethod(APPEND_ENTRIES, &RaftNode::handleAppendEntries);
+    registerGroupMethod(INSTALL_SNAPSHOT, &RaftNode::handleInstallSnapshot);
+    registerGroupMethod(TIMEOUT_NOW, &RaftNode::handleTimeoutNow);
+    registerMethod(HEARTBEAT, [this](int64_t from, std::vector<HeartbeatArgs> args) {
+        return handleHeartbeat(from, std::move(args));
+    });
+}
+
+RaftHost::~RaftHost() {
+    stop();
+}
+
+void RaftHost::start() {
+    m_heartbeatTimer.stop();
+    m_heartbeatTimer = CycleTimer(RaftNode::GetStableHeartbeatTimeout(), [this] {
+        tick();
+    });
+    RpcServer::start();
+}
+
+void RaftHost::stop() {
+    std::map<uint64_t, RaftNode::ptr> groups;
+    {
+        std::unique_lock<MutexType> lock(m_mutex);
+        groups.swap(m_groups);
+    }
+    m_heartbeatTimer.stop();
+    // 不持有锁关闭 Raft 组，处理中的请求可能还在获取 Raft 组
+    for (auto& [_, node]: groups) {
+        node->stop();
+    }
+    RpcServer::stop();
+}
+
+RaftNode::ptr RaftHost::addGroup(uint64_t group, std::map<int64_t, std::string>& servers, Persister::ptr persister, co::co_chan<ApplyBatch> applyChan) {
+    // 创建节点时会获取连接，不能持有锁
+    auto node = std::make_shared<RaftNode>(this, group, servers, m_id, std::move(persister), std::move(applyChan));
+    std::unique_lock<MutexType> lock(m_mutex);
+    if (!m_groups.emplace(group, node).second) {
+        SPDLOG_LOGGER_WARN(g_logger, "Node[{}] group {} already exists", m_id, group);
+        return nullptr;
+    }
+    SPDLOG_LOGGER_INFO(g_logger, "Node[{}] add group {}", m_id, group);
+    return node;
+}
+
+RaftNode::ptr RaftHost::getGroup(uint64_t group) {
+    std::unique_lock<MutexType> lock(m_mutex);
+    auto it = m_groups.find(group);
+    if (it == m_groups.end()) {
+        return nullptr;
+    }
+    return it->second;
+}
+
+void RaftHost::removeGroup(uint64_t group) {
+    RaftNode::ptr node;
+    {
+        std::unique_lock<MutexType> lock(m_mutex);
+        auto it = m_groups.find(group);
+        if (it == m_groups.end()) {
+            return;
+        }
+        node = std::move(it->second);
+        m_groups.erase(it);
+    }
+    node->stop();
+    SPDLOG_LOGGER_INFO(g_logger, "Node[{}] remove group {}", m_id, group);
+}
+
+RaftConnection::ptr RaftHost::getConnection(int64_t id, Address::ptr address) {
+    std::unique_lock<MutexType> lock(m_mutex);
+    auto it = m_connections.find(id);
+    if (it != m_connections.end() && it->second->getAddress()->toString() == address->toString()) {
+        return it->second;
+    }
+    auto connection = std::make_shared<RaftConnection>(id, std::move(address));
+    m_connections[id] = connection;
+    return connection;
+}
+
+uint64_t RaftHost::lastContact(int64_t id) {
+    std::unique_lock<MutexType> lock(m_mutex);
+    auto it = m_lastContact.find(id);
+    return it == m_lastContact.end() ? 0 : it->second;
+}
+
+void RaftHost::updateContact(int64_t id) {
+    std::unique_lock<MutexType> lock(m_mutex);
+    m_lastContact[id] = GetSteadyMS();
+}
+
+std::vector<HeartbeatReply> RaftHost::handleHeartbeat(int64_t from, std::vector<HeartbeatArgs> args) {
+    updateContact(from);
+    std::vector<HeartbeatReply> replies;
+    replies.reserve(args.size());
+    for (auto& arg: args) {
+        RaftNode::ptr node = getGroup(arg.group);
+        if (!node) {
+            replies.push_back(HeartbeatReply{.group = arg.group, .term = 0, .leaderId = -1, .success = false});
+            continue;
+        }
+        replies.push_back(node->handleHeartbeat(arg));
+    }
+    return replies;
+}
+
+void RaftHost::tick() {
+    std::vector<RaftNode::ptr> groups;
+    std::map<int64_t, RaftConnection::ptr> connections;
+    {
+        std::unique_lock<MutexType> lock(m_mutex);
+        for (auto& [_, node]: m_groups) {
+            groups.push_back(node);
+        }
+        connections = m_connections;
+    }
+    std::map<int64_t, std::vector<HeartbeatArgs>> heartbeats;
+    for (auto& node: groups) {
+        node->tick(heartbeats);
+    }
+    // 所有 Raft 组都静默时也发送空的心跳，让对方知道自己还活着
+    for (auto& [id, connection]: connections) {
+        go [id, connection, args = std::move(heartbeats[id]), sent = GetSteadyMS(), this] {
+            auto replies = connection->heartbeat(m_id, args);
+            if (replies) {
+                updateContact(id);
+            }
+            for (size_t i = 0; i < args.size(); ++i) {
+                RaftNode::ptr node = getGroup(args[i].group);
+                if (!node) {
+                    continue;
+                }
+                std::optional<HeartbeatReply> reply;
+                if (replies) {
+                    reply = (*replies)[i];
+                }
+                node->handleHeartbeatReply(id, args[i], reply, sent);
+            }
+        };
+    }
+}
+
+}
@@ -0,0 +1,101 @@
+//
+// Created by zavier on 2023/2/21.
+//
+
+#ifndef ACID_RAFT_HOST_H
+#define ACID_RAFT_HOST_H
+
+#include <map>
+#include "../rpc/rpc_server.h"
+#include "raft_node.h"
+
+namespace acid::raft {
+/**
+ * @brief Multi-Raft，一个进程内托管多个 Raft 组
+ * @details
+ * 1. 所有 Raft 组共用一个 rpc 服务，请求带上组 id，由 RaftHost 分发到对应的 RaftNode
+ * 2. 到同一个远端节点的所有 Raft 组共享一个连接，连接数只和节点数有关，和组的数量无关
+ * 3. 各个 Raft 组有自己的日志、持久化和成员配置，组内的节点 id 和地址就是各个 RaftHost 的 id 和地址
+ * 4. 每个心跳周期给每个远端节点只发送一条合并心跳，包含所有 Raft 组的心跳，同时作为节点存活的依据，
+ *    空闲的 Raft 组进入静默后不再产生心跳，Leader 所在的节点失联后 Follower 才恢复选举计时
+ */
+class RaftHost : public acid::rpc::RpcServer {
+public:
+    using ptr = std::shared_ptr<RaftHost>;
+    using MutexType = co::co_mutex;
+
+    /**
+     * @param id 当前节点的唯一标识，所有 Raft 组中都使用这个 id
+     */
+    explicit RaftHost(int64_t id);
+
+    ~RaftHost();
+    /**
+     * @brief 启动 rpc 服务，Raft 组需要单独调用 RaftNode::start
+     */
+    void start() override;
+    /**
+     * @brief 关闭所有 Raft 组和 rpc 服务
+     */
+    void stop() override;
+    /**
+     * @brief 创建一个 Raft 组
+     * @param group 组 id
+     * @param servers 组内其他节点的地址
+     * @param persister 该组的持久化，不同的组不能共用
+     * @param applyChan 该组达成共识的日志的 channel
+     * @return 组 id 已经存在返回 nullptr
+     */
+    RaftNode::ptr addGroup(uint64_t group, std::map<int64_t, std::string>& servers, Persister::ptr persister, co::co_chan<ApplyBatch> applyChan);
+    /**
+     * @brief 获取 Raft 组
+     * @return 不存在返回 nullptr
+     */
+    RaftNode::ptr getGroup(uint64_t group);
+    /**
+     * @brief 关闭并移除 Raft 组，之后该组的请求都会被拒绝
+     */
+    void removeGroup(uint64_t group);
+    /**
+     * @brief 获取到远端节点的连接，不存在或者地址改变时创建新的连接
+     */
+    RaftConnection::ptr getConnection(int64_t id, Address::ptr address);
+
+    /**
+     * @brief 最近一次和远端节点通信的时间（单调时钟），没有通信过返回 0
+     */
+    uint64_t lastContact(int64_t id);
+
+    int64_t getId() const { return m_id;}
+private:
+    /**
+     * @brief 处理远端节点的合并心跳，按顺序返回每个 Raft 组的响应
+     */
+    std::vector<HeartbeatReply> handleHeartbeat(int64_t from, std::vector<HeartbeatArgs> args);
+    /**
+     * @brief 一个心跳周期，收集所有 Raft 组的心跳，按节点合并发送
+     */
+    void tick();
+
+    void updateContact(int64_t id);
+
+    /**
+     * @brief 注册按组 id 分发的 rpc 服务，组不存在时返回默认构造的回复，任期为 0，不会被当作有效的回复
+     */
+    template<typename Reply, typename Args>
+    void registerGroupMethod(const std::string& name, Reply (RaftNode::*handler)(Args));
+private:
+    MutexType m_mutex;
+    int64_t m_id;
+    // 组 id 到 Raft 组的映射
+    std::map<uint64_t, RaftNode::ptr> m_groups;
+    // 远端节点 id 到连接的映射
+    std::map<int64_t, RaftConnection::ptr> m_connections;
+    // 远端节点 id 到最近一次通信时间的映射
+    std::map<int64_t, uint64_t> m_lastContact;
+    // 心跳定时器
+    CycleTimerTocken m_heartbeatTimer;
+};
+
+}
+#endif //ACID_RAFT_HOST_H
@@ -3,27 +3,38 @@
 //
 
 #include "raft_log.h"
+#include "../common/config.h"
 
 namespace acid::raft {
 static auto g_logger = GetLogInstance();
 
-RaftLog::RaftLog(Persister::ptr persister, int64_t maxNextEntsSize /* = NO_LIMIT*/ ) {
+static ConfigVar<uint64_t>::ptr g_log_cache_size =
+        Config::Lookup<uint64_t>("raft.log.cache_size", 64 * 1024 * 1024, "raft log entry cache size(byte)");
+
+RaftLog::RaftLog(Persister::ptr persister, int64_t maxNextEntsSize /* = NO_LIMIT*/ )
+        : m_persister(persister)
+        , m_cache(g_log_cache_size->getValue()) {
     if (!persister) {
         SPDLOG_LOGGER_CRITICAL(g_logger, "persister must not be nil");
         return;
     }
 
-    auto opt = persister->loadEntries();
+    // 只加载日志的索引和任期，内容在需要的时候从 WAL 读取
+    auto opt = persister->loadEntryMetas();
     if (opt) {
-        m_entries = std::move(*opt);
-        m_committed = persister->loadHardState()->commit;
+        m_entries.assign(std::make_move_iterator(opt->begin()), std::make_move_iterator(opt->end()));
         m_applied = firstIndex() - 1;
+        // commit index 不是每次变化都持久化，至少已经提交到快照的位置
+        m_committed = std::max(persister->loadHardState()->commit, m_applied);
     } else {
         // 第一个为虚拟entry
         m_entries.emplace_back();
         m_committed = 0;
         m_applied = 0;
     }
+    m_stabled = lastIndex();
+    m_persisted = m_stabled;
+    m_cache.stableTo(m_persisted);
 
     // 初始化为最后一次日志压缩的commit和apply
     m_maxNextEntriesSize = maxNextEntsSize;
@@ -65,25 +76,34 @@ int64_t RaftLog::append(const std::vector<Entry>& entries) {
         exit(EXIT_FAILURE);
         return lastIndex();
     }
+    // 被覆盖的日志需要重新持久化
+    m_stabled = std::min(m_stabled, after - 1);
+    m_persisted = std::min(m_persisted, after - 1);
+    m_cache.stableTo(m_persisted);
     if (after == lastIndex() + 1) {
         // after是entries最后的index，直接插入
-        m_entries.insert(m_entries.end(), entries.begin(), entries.end());
     } else if (after <= m_entries.front().index) {
         SPDLOG_LOGGER_INFO(g_logger, "replace the entries from index {}", after);
         // 这种情况存储可靠存储的日志还没有被提交，此时新的leader不再认可这些日志，所以替换追加
-        m_entries = entries;
+        m_cache.clear();
+        m_entries.clear();
     } else {
         SPDLOG_LOGGER_INFO(g_logger, "truncate the entries before index {}", after);
         // 有重叠的日志，那就用最新的日志覆盖老日志，覆盖追加
+        m_cache.erase(after, lastIndex() + 1);
         auto offset = after - m_entries.front().index;
-        m_entries.insert(m_entries.begin() + offset, entries.begin(), entries.end());
+        m_entries.erase(m_entries.begin() + offset, m_entries.end());
+    }
+    for (auto& ent: entries) {
+        append(ent);
     }
 
     return lastIndex();
 }
 
 void RaftLog::append(const Entry& ent) {
-    m_entries.push_back(ent);
+    m_entries.push_back({.index = ent.index, .term = ent.term, .type = ent.type});
+    m_cache.put(ent.index, ent.data);
 }
 
 int64_t RaftLog::findConflict(const std::vector<Entry>& entries) {
@@ -117,20 +137,26 @@ int64_t RaftLog::findConflict(int64_t prevLogIndex, int64_t prevLogTerm) {
 
 std::vector<Entry> RaftLog::nextEntries() {
     int64_t off = std::max(m_applied + 1, firstIndex());
-    if (m_committed + 1 > off) {
-        return slice(off, m_committed + 1, m_maxNextEntriesSize);
+    // 只应用已经在本地落盘的日志
+    int64_t hi = std::min(m_committed, m_persisted);
+    if (hi + 1 > off) {
+        return slice(off, hi + 1, m_maxNextEntriesSize);
     }
     return {};
 }
 
 bool RaftLog::hasNextEntries() {
     int64_t off = std::max(m_applied + 1, firstIndex());
-    return m_committed + 1 > off;
+    return std::min(m_committed, m_persisted) + 1 > off;
 }
 
 void RaftLog::clearEntries(int64_t lastSnapshotIndex, int64_t lastSnapshotTerm) {
     m_entries.clear();
     m_entries.push_back({.index = lastSnapshotIndex, .term = lastSnapshotTerm});
+    m_cache.clear();
+    m_stabled = lastSnapshotIndex;
+    m_persisted = lastSnapshotIndex;
+    m_cache.stableTo(m_persisted);
 }
 
 int64_t RaftLog::firstIndex() {
@@ -191,6 +217,16 @@ int64_t RaftLog::term(int64_t index) {
     return m_entries[index - offset].term;
 }
 
+int64_t RaftLog::lastConfIndex(int64_t index) {
+    int64_t offset = m_entries.front().index;
+    for (int64_t i = std::min(index, lastIndex()); i > offset; --i) {
+        if (m_entries[i - offset].type == Entry::CONF_CHANGE) {
+            return i;
+        }
+    }
+    return 0;
+}
+
 std::vector<Entry> RaftLog::entries(int64_t index) {
     // 发送心跳
     if (index > lastIndex()) {
@@ -201,7 +237,39 @@ std::vector<Entry> RaftLog::entries(int64_t index) {
 }
 
 std::vector<Entry> RaftLog::allEntries() {
-    return m_entries;
+    std::vector<Entry> ents{m_entries.front()};
+    if (lastIndex() >= firstIndex()) {
+        auto rest = slice(firstIndex(), lastIndex() + 1, NO_LIMIT);
+        ents.insert(ents.end(), std::make_move_iterator(rest.begin()), std::make_move_iterator(rest.end()));
+    }
+    return ents;
+}
+
+std::vector<Entry> RaftLog::unstableEntries() {
+    if (m_stabled >= lastIndex()) {
+        return {};
+    }
+    return slice(m_stabled + 1, lastIndex() + 1, NO_LIMIT);
+}
+
+void RaftLog::stableTo(int64_t index) {
+    if (index < m_stabled || index > lastIndex()) {
+        SPDLOG_LOGGER_ERROR(g_logger, "stableTo({}) is out of range [stabled({}), lastIndex({})]", index, m_stabled, lastIndex());
+        return;
+    }
+    m_stabled = index;
+}
+
+void RaftLog::persistedTo(int64_t index) {
+    if (index <= m_persisted) {
+        return;
+    }
+    if (index > m_stabled) {
+        SPDLOG_LOGGER_ERROR(g_logger, "persistedTo({}) is out of range [persisted({}), stabled({})]", index, m_persisted, m_stabled);
+        return;
+    }
+    m_persisted = index;
+    m_cache.stableTo(m_persisted);
 }
 
 bool RaftLog::isUpToDate(int64_t index, int64_t term) {
@@ -231,11 +299,35 @@ std::vector<Entry> RaftLog::slice(int64_t low, int64_t high, int64_t maxSize) {
         high = std::min(high, low + maxSize);
     }
 
-    // 计算实际下标
-    low -= lastSnapshotIndex();
-    high -= lastSnapshotIndex();
-
-    return std::vector<Entry>{m_entries.begin() + low, m_entries.begin() + high};
+    std::vector<Entry> ents;
+    ents.reserve(high - low);
+    int64_t offset = lastSnapshotIndex();
+    for (int64_t index = low; index < high;) {
+        const Payload* data = m_cache.get(index);
+        if (data) {
+            ents.push_back(m_entries[index - offset]);
+            ents.back().data = *data;
+            ++index;
+            continue;
+        }
+        // 缓存未命中，连续未命中的日志从 WAL 中一次读出
+        int64_t end = index + 1;
+        while (end < high && !m_cache.get(end)) {
+            ++end;
+        }
+        std::vector<Entry> loaded;
+        // 范围内的日志一定在 WAL 中，读不出来说明日志已经损坏，返回残缺的日志会导致复制或应用出错
+        if (!m_persister->readEntries(index, end, loaded) || (int64_t)loaded.size() != end - index) {
+            SPDLOG_LOGGER_CRITICAL(g_logger, "load entries [{}, {}) from wal fail", index, end);
+            exit(EXIT_FAILURE);
+        }
+        for (auto& ent: loaded) {
+            m_cache.put(ent.index, ent.data);
+            ents.push_back(std::move(ent));
+        }
+        index = end;
+    }
+    return ents;
 }
 
 void RaftLog::mustCheckOutOfBounds(int64_t low, int64_t high) {
@@ -281,8 +373,12 @@ bool RaftLog::compact(int64_t compactIndex) {
         return false;
     }
     int64_t index = compactIndex - offset;
+    m_cache.erase(offset, compactIndex + 1);
     m_entries.erase(m_entries.begin(), m_entries.begin() + index);
-    m_entries[0].data = "";
+    // 快照之前的日志无需再持久化
+    m_stabled = std::max(m_stabled, compactIndex);
+    m_persisted = std::max(m_persisted, compactIndex);
+    m_cache.stableTo(m_persisted);
     return true;
 }
 
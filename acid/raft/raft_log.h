@@ -6,15 +6,19 @@
 #define ACID_RAFT_LOG_H
 
 
+#include <deque>
 #include <string>
 #include "../rpc/serializer.h"
 #include "entry.h"
+#include "entry_cache.h"
 #include "snapshot.h"
 #include "persister.h"
 
 namespace acid::raft {
 /**
  * @brief raftLog记录着日志，封装了一些和日志有关的操作
+ * @details 内存中只保存所有日志的索引和任期，日志内容保存在按字节数限制大小的 LRU 缓存中，
+ * 缓存未命中时从 WAL 读取，内存占用不会随着日志长度无限增长。缓存大小由配置 raft.log.cache_size 决定。
  */
 class RaftLog {
 public:
@@ -91,6 +95,11 @@ public:
      * @brief 获取指定索引日志的term
      */
     int64_t term(int64_t index);
+    /**
+     * @brief 查找不大于 index 的最后一条成员变更日志
+     * @return 日志索引，快照之后没有成员变更日志返回 0
+     */
+    int64_t lastConfIndex(int64_t index);
     /**
      * @brief 获取[index，lastIndex()]的所有日志，但是日志总量限制在 m_maxNextEntriesSize
      */
@@ -99,6 +108,18 @@ public:
      * @brief 获取所有日志
      */
     std::vector<Entry> allEntries();
+    /**
+     * @brief 获取还未交给持久化层写入的日志
+     */
+    std::vector<Entry> unstableEntries();
+    /**
+     * @brief 更新已经交给持久化层写入的日志索引，之后的 unstableEntries 不再包含这些日志
+     */
+    void stableTo(int64_t index);
+    /**
+     * @brief 更新已经落盘的日志索引，落盘之后的日志才能从缓存中淘汰
+     */
+    void persistedTo(int64_t index);
     /**
      * @brief 判断给定日志的索引和任期是不是比自己新
      * @details Raft 通过比较两份日志中最后一条日志条目的索引值和任期号定义谁的日志比较新。
@@ -117,6 +138,7 @@ public:
     bool maybeCommit(int64_t maxIndex, int64_t term);
     /**
      * @brief 获取[low，high)的所有日志，但是总量限制在maxSize
+     * @note 缓存未命中的日志从 WAL 读取，读取失败直接退出
      */
     std::vector<Entry> slice(int64_t low, int64_t high, int64_t maxSize);
     /**
@@ -138,6 +160,10 @@ public:
     [[nodiscard]]
     int64_t applied() const { return m_applied;}
     [[nodiscard]]
+    int64_t stabled() const { return m_stabled;}
+    [[nodiscard]]
+    int64_t persisted() const { return m_persisted;}
+    [[nodiscard]]
     std::string toString() const {
         std::string str = fmt::format("committed: {}, applied: {}, offset: {}, length: {}",
                                       m_committed, m_applied, m_entries.front().index, m_entries.size());
@@ -145,8 +171,12 @@ public:
     }
 
 private:
-    // 日志
-    std::vector<Entry> m_entries;
+    Persister::ptr m_persister;
+    // 日志的索引、任期和类型，data 总是为空，第一条为快照位置的虚拟日志。
+    // 使用分块存储的 deque，压缩前缀和截断后缀只析构被删除的日志，不移动保留的日志，按索引访问仍然是 O(1)
+    std::deque<Entry> m_entries;
+    // 日志内容，没有持久化的日志一定在缓存中
+    EntryCache m_cache;
     // commit
     int64_t m_committed;
     // 已经被应用到状态机的最高的日志条目的索引（初始值为0，单调递增）
@@ -154,6 +184,10 @@ private:
     // 就要被使用者apply，apply就是把日志数据反序列化后在raft状态机上执行。applied 就是该节点已
     // 经被apply的最大索引。apply索引是节点状态(非集群状态)，这取决于每个节点的apply速度。
     int64_t m_applied;
+    // 已经交给持久化层的最高的日志条目的索引，之后的日志在下一次持久化时追加到 WAL
+    int64_t m_stabled;
+    // 已经落盘的最高的日志条目的索引，不大于 m_stabled
+    int64_t m_persisted;
     // raftLog有一个成员函数nextEntries(),用于获取 (applied,committed] 的所有日志，很容易看出来
     // 这个函数是apply日志时调用的，maxNextEntriesSize就是用来限制获取日志大小总量的，避免一次调用
     // 产生过大粒度的apply操作。
@@ -3,8 +3,10 @@
 //
 
 #include <random>
+#include <set>
 #include <utility>
 #include "acid/raft/raft_node.h"
+#include "acid/raft/raft_host.h"
 #include "acid/common/config.h"
 
 namespace acid::raft {
@@ -16,6 +18,22 @@ static ConfigVar<uint64_t>::ptr g_timer_election_top =
         Config::Lookup<size_t>("raft.timer.election.top",3000,"raft election timeout(ms) top");
 static ConfigVar<uint64_t>::ptr g_timer_heartbeat =
         Config::Lookup<size_t>("raft.timer.heartbeat",300,"raft heartbeat timeout(ms)");
+static ConfigVar<uint64_t>::ptr g_max_inflight =
+        Config::Lookup<size_t>("raft.replication.max_inflight",64,"raft max inflight append entries per peer");
+static ConfigVar<bool>::ptr g_lease_read =
+        Config::Lookup<bool>("raft.read.lease",false,"raft leader serves reads with lease instead of confirming leadership");
+static ConfigVar<uint64_t>::ptr g_lease_drift =
+        Config::Lookup<size_t>("raft.read.lease_drift",100,"raft lease clock drift bound(ms)");
+static ConfigVar<uint64_t>::ptr g_snapshot_chunk_size =
+        Config::Lookup<size_t>("raft.snapshot.chunk_size",1024 * 1024,"raft install snapshot chunk size(byte)");
+static ConfigVar<bool>::ptr g_pre_vote =
+        Config::Lookup<bool>("raft.election.pre_vote",true,"raft pre vote before increasing term");
+static ConfigVar<bool>::ptr g_check_quorum =
+        Config::Lookup<bool>("raft.election.check_quorum",true,"raft leader steps down without quorum in an election timeout");
+static ConfigVar<uint64_t>::ptr g_replication_linger =
+        Config::Lookup<size_t>("raft.replication.linger",0,"raft replication linger(ms) to batch entries, 0 to disable");
+static ConfigVar<bool>::ptr g_quiesce =
+        Config::Lookup<bool>("raft.quiesce",true,"idle raft groups hosted by RaftHost stop heartbeats");
 
 // 选举超时时间，从base~top的区间里随机选择
 static uint64_t s_timer_election_base_ms;
@@ -23,6 +41,21 @@ static uint64_t s_timer_election_top_ms;
 // 心跳超时时间
 // 注意，心跳超时必须小于选举超时时间
 static uint64_t s_timer_heartbeat_ms;
+// 复制状态下每个节点最多同时发出的 AppendEntries 数量
+static uint64_t s_max_inflight;
+// 是否开启租约读，租约为最小选举超时减去时钟漂移的上限
+static bool s_lease_read;
+static uint64_t s_lease_drift_ms;
+// 发送快照的分块大小
+static uint64_t s_snapshot_chunk_size;
+// 复制协程被唤醒后等待一小段时间，合并这段时间内追加的日志
+static uint64_t s_replication_linger_ms;
+// 是否开启预投票，避免被隔离的节点重新加入集群时增加任期打断 Leader
+static bool s_pre_vote;
+// Leader 在一个选举超时内没有收到大多数节点的响应则退位
+static bool s_check_quorum;
+// RaftHost 托管的 Raft 组空闲时进入静默，停止心跳和选举计时
+static bool s_quiesce;
 
 struct _RaftNodeIniter{
     _RaftNodeIniter(){
@@ -41,6 +74,46 @@ struct _RaftNodeIniter{
             SPDLOG_LOGGER_INFO(g_logger, "raft heartbeat timeout changed from {} to {}", old_val, new_val);
             s_timer_heartbeat_ms = new_val;
         });
+        s_max_inflight = g_max_inflight->getValue();
+        g_max_inflight->addListener([](const uint64_t& old_val, const uint64_t& new_val) {
+            SPDLOG_LOGGER_INFO(g_logger, "raft max inflight changed from {} to {}", old_val, new_val);
+            s_max_inflight = new_val;
+        });
+        s_lease_read = g_lease_read->getValue();
+        g_lease_read->addListener([](const bool& old_val, const bool& new_val) {
+            SPDLOG_LOGGER_INFO(g_logger, "raft lease read changed from {} to {}", old_val, new_val);
+            s_lease_read = new_val;
+        });
+        s_lease_drift_ms = g_lease_drift->getValue();
+        g_lease_drift->addListener([](const uint64_t& old_val, const uint64_t& new_val) {
+            SPDLOG_LOGGER_INFO(g_logger, "raft lease drift changed from {} to {}", old_val, new_val);
+            s_lease_drift_ms = new_val;
+        });
+        s_snapshot_chunk_size = g_snapshot_chunk_size->getValue();
+        g_snapshot_chunk_size->addListener([](const uint64_t& old_val, const uint64_t& new_val) {
+            SPDLOG_LOGGER_INFO(g_logger, "raft snapshot chunk size changed from {} to {}", old_val, new_val);
+            s_snapshot_chunk_size = new_val;
+        });
+        s_replication_linger_ms = g_replication_linger->getValue();
+        g_replication_linger->addListener([](const uint64_t& old_val, const uint64_t& new_val) {
+            SPDLOG_LOGGER_INFO(g_logger, "raft replication linger changed from {} to {}", old_val, new_val);
+            s_replication_linger_ms = new_val;
+        });
+        s_pre_vote = g_pre_vote->getValue();
+        g_pre_vote->addListener([](const bool& old_val, const bool& new_val) {
+            SPDLOG_LOGGER_INFO(g_logger, "raft pre vote changed from {} to {}", old_val, new_val);
+            s_pre_vote = new_val;
+        });
+        s_check_quorum = g_check_quorum->getValue();
+        g_check_quorum->addListener([](const bool& old_val, const bool& new_val) {
+            SPDLOG_LOGGER_INFO(g_logger, "raft check quorum changed from {} to {}", old_val, new_val);
+            s_check_quorum = new_val;
+        });
+        s_quiesce = g_quiesce->getValue();
+        g_quiesce->addListener([](const bool& old_val, const bool& new_val) {
+            SPDLOG_LOGGER_INFO(g_logger, "raft quiesce changed from {} to {}", old_val, new_val);
+            s_quiesce = new_val;
+        });
     }
 };
 
@@ -48,31 +121,42 @@ struct _RaftNodeIniter{
 [[maybe_unused]]
 static _RaftNodeIniter s_initer;
 
-RaftNode::RaftNode(std::map<int64_t, std::string>& servers, int64_t id, Persister::ptr persister, co::co_chan<ApplyMsg> applyChan)
-        : m_id(id)
+RaftNode::RaftNode(std::map<int64_t, std::string>& servers, int64_t id, Persister::ptr persister, co::co_chan<ApplyBatch> applyChan)
+        : RaftNode(nullptr, 0, servers, id, std::move(persister), std::move(applyChan)) {
+}
+
+RaftNode::RaftNode(RaftHost* host, uint64_t group, std::map<int64_t, std::string>& servers, int64_t id, Persister::ptr persister, co::co_chan<ApplyBatch> applyChan)
+        : m_host(host)
+        , m_group(group)
+        , m_id(id)
         , m_logs(persister, 1000)
         , m_persister(persister)
         , m_applyChan(std::move(applyChan)) {
-    rpc::RpcServer::setName("Raft-Node[" + std::to_string(id) + "]");
-    // 注册服务 RequestVote
-    registerMethod(REQUEST_VOTE,[this](RequestVoteArgs args) {
-        return handleRequestVote(std::move(args));
-    });
-    // 注册服务 AppendEntries
-    registerMethod(APPEND_ENTRIES, [this](AppendEntriesArgs args) {
-        return handleAppendEntries(std::move(args));
-    });
-    // 注册服务 InstallSnapshot
-    registerMethod(INSTALL_SNAPSHOT, [this](InstallSnapshotArgs args) {
-        return handleInstallSnapshot(std::move(args));
-    });
-    for (auto peer: servers) {
-        if (peer.first == id)
-            continue;
-        Address::ptr address = Address::LookupAny(peer.second);
-        // 添加节点
-        addPeer(peer.first, address);
+    rpc::RpcServer::setName("Raft-Node[" + std::to_string(id) + "]" + (host ? "-Group[" + std::to_string(group) + "]" : ""));
+    // 由 RaftHost 托管时 rpc 服务由 RaftHost 注册并按组 id 分发，独立运行时保持原来的 rpc 签名，不带组 id
+    if (!m_host) {
+        // 注册服务 RequestVote
+        registerMethod(REQUEST_VOTE,[this](RequestVoteArgs args) {
+            return handleRequestVote(std::move(args));
+        });
+        // 注册服务 AppendEntries
+        registerMethod(APPEND_ENTRIES, [this](AppendEntriesArgs args) {
+            return handleAppendEntries(std::move(args));
+        });
+        // 注册服务 InstallSnapshot
+        registerMethod(INSTALL_SNAPSHOT, [this](InstallSnapshotArgs args) {
+            return handleInstallSnapshot(std::move(args));
+        });
+        // 注册服务 TimeoutNow
+        registerMethod(TIMEOUT_NOW, [this](TimeoutNowArgs args) {
+            return handleTimeoutNow(std::move(args));
+        });
     }
+    // 初始配置中所有节点都是 voter，之后以日志和快照中的配置为准
+    for (auto& peer: servers) {
+        m_snapshotConf.voters[peer.first] = peer.second;
+    }
+    applyConfState(m_snapshotConf, 0);
 }
 
 RaftNode::~RaftNode() {
@@ -81,12 +165,21 @@ RaftNode::~RaftNode() {
 
 void RaftNode::stop() {
     std::unique_lock<MutexType> lock(m_mutex);
-    if (isStop()) {
+    if (!m_started) {
         return;
     }
+    m_started = false;
     m_applyChan.close();
+    for (auto& chan: m_replicateChans) {
+        chan.second.close();
+    }
     m_heartbeatTimer.stop();
     m_electionTimer.stop();
+    lock.unlock();
+    // 托管的节点共用 RaftHost 的 rpc 服务，由 RaftHost 关闭
+    if (!m_host) {
+        RpcServer::stop();
+    }
 }
 
 void RaftNode::start() {
@@ -95,37 +188,87 @@ void RaftNode::start() {
         // 恢复崩溃前的状态
         m_currentTerm = hs->term;
         m_votedFor = hs->vote;
+        m_hardState = *hs;
         SPDLOG_LOGGER_INFO(g_logger, "initialize from state persisted before a crash, term {}, vote {}, commit {}",
                            hs->term, hs->vote, hs->commit);
     } else {
         becomeFollower(0);
     }
+    // 恢复快照和日志中的成员配置
+    auto conf = m_persister->loadConfState();
+    if (conf) {
+        m_snapshotConf = *conf;
+    }
+    reloadConfState();
+    SPDLOG_LOGGER_INFO(g_logger, "Node[{}] starts with conf state {}", m_id, m_conf.toString());
 
     rescheduleElection();
 
+    m_started = true;
     go [this] {
         applier();
     };
 
-    RpcServer::start();
+    for (auto& peer: m_peers) {
+        go [id = peer.first, this] {
+            replicator(id);
+        };
+    }
+    // 托管的节点共用 RaftHost 的 rpc 服务
+    if (!m_host) {
+        RpcServer::start();
+    }
 }
 
-void RaftNode::startElection() {
+void RaftNode::startElection(bool preVote, bool leaderTransfer) {
     RequestVoteArgs request{};
-    request.term = m_currentTerm;
+    // 预投票使用下一个任期，但是自己的任期不变
+    request.term = preVote ? m_currentTerm + 1 : m_currentTerm;
     request.candidateId = m_id;
     request.lastLogIndex = m_logs.lastIndex();
     request.lastLogTerm = m_logs.lastTerm();
-
-    SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] starts election with RequestVoteArgs {}", m_id, request.toString());
-    m_votedFor = m_id;
-    persist();
+    request.preVote = preVote;
+    request.leaderTransfer = leaderTransfer;
+
+    SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] starts {} with RequestVoteArgs {}", m_id, preVote ? "pre vote" : "election", request.toString());
+    // 任期和投票落盘之后才能发出投票请求，在发送的协程中等待，不持有锁
+    PersistTicket ticket{};
+    if (!preVote) {
+        m_votedFor = m_id;
+        ticket = submitPersist();
+    }
     // 统计投票结果，自己开始有一票
-    std::shared_ptr<int64_t> grantedVotes = std::make_shared<int64_t>(1);
+    auto granted = std::make_shared<std::set<int64_t>>();
+    granted->insert(m_id);
+    const RaftState state = preVote ? PreCandidate : Candidate;
+    const int64_t term = m_currentTerm;
+
+    auto win = [preVote, this] {
+        if (preVote) {
+            SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] receives majority pre votes in term {}", m_id, m_currentTerm);
+            becomeCandidate();
+            startElection();
+        } else {
+            SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] receives majority votes in term {}", m_id, m_currentTerm);
+            becomeLeader();
+        }
+    };
+    // 单节点集群，自己一票就是大多数
+    if (m_conf.hasQuorum([granted](int64_t id) { return granted->contains(id);})) {
+        win();
+        return;
+    }
 
     for (auto& peer: m_peers) {
+        // learner 不参与投票
+        if (!m_conf.isVoter(peer.first)) {
+            continue;
+        }
         // 使用协程发起异步投票，不阻塞选举定时器，才能在选举超时后发起新的选举
-        go [grantedVotes, request, peer, this] {
+        go [granted, request, peer, state, term, win, ticket, this] {
+            if (ticket.seq && !m_persister->wait(ticket.seq)) {
+                return;
+            }
             auto reply = peer.second->requestVote(request);
             if (!reply)
                 return;
@@ -133,18 +276,17 @@ void RaftNode::startElection() {
             SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] receives RequestVoteReply {} from Node[{}] after sending RequestVoteArgs {} in term {}",
                 m_id, reply->toString(), peer.first, request.toString(), m_currentTerm);
             // 检查自己状态是否改变
-            if (m_currentTerm == request.term && m_state == RaftState::Candidate) {
+            if (m_currentTerm == term && m_state == state) {
                 if (reply->voteGranted) {
-                    ++(*grantedVotes);
-                    // 赢得选举
-                    if (*grantedVotes > ((int64_t)m_peers.size() + 1) / 2) {
-                        SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] receives majority votes in term {}", m_id, m_currentTerm);
-                        becomeLeader();
+                    granted->insert(peer.first);
+                    // 赢得选举，联合共识阶段需要新旧配置各自的大多数
+                    if (m_conf.hasQuorum([granted](int64_t id) { return granted->contains(id);})) {
+                        win();
                     }
                 } else if (reply->term > m_currentTerm) {
                     SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] finds a new leader Node[{}] with term {} and steps down in term {}",
                        m_id, peer.first, reply->term, m_currentTerm);
-                    becomeFollower(reply->term, reply->leaderId);
+                    stepDown(reply->term, reply->leaderId);
                     rescheduleElection();
                 }
             }
@@ -152,25 +294,51 @@ void RaftNode::startElection() {
     }
 }
 
+bool RaftNode::leaderAlive() {
+    if (m_state == Leader) {
+        return true;
+    }
+    // 静默期间 Leader 不发送心跳，由 RaftHost 的节点心跳确认 Leader 所在的节点存活
+    if (m_quiesced) {
+        return m_leaderId != -1 && GetSteadyMS() < m_host->lastContact(m_leaderId) + s_timer_election_base_ms;
+    }
+    return m_leaderId != -1 && GetSteadyMS() < m_lastLeaderContact + s_timer_election_base_ms;
+}
+
+bool RaftNode::checkQuorum() {
+    uint64_t now = GetSteadyMS();
+    if (now < m_leaderSince + s_timer_election_base_ms) {
+        return true;
+    }
+    return m_conf.hasQuorum([now, this](int64_t id) {
+        if (id == m_id) {
+            return true;
+        }
+        auto it = m_progress.find(id);
+        return it != m_progress.end() && it->second.lastAck() + s_timer_election_base_ms > now;
+    });
+}
+
 void RaftNode::applier() {
-    while (!isStop()) {
+    while (m_started) {
         std::unique_lock<MutexType> lock(m_mutex);
         // 如果没有需要apply的日志则等待
         while (!m_logs.hasNextEntries()) {
             m_applyCond.wait(lock);
         }
 
-        auto last_commit = m_logs.committed();
         auto ents = m_logs.nextEntries();
-        std::vector<ApplyMsg> msg;
+        // 只应用到本地已经落盘的日志，并且一次的数量有上限，不能直接用 commitIndex
+        auto last_commit = ents.back().index;
+        ApplyBatch batch;
+        batch.reserve(ents.size());
         for (auto& ent: ents) {
-            msg.emplace_back(ent);
+            batch.emplace_back(ent);
         }
 
         lock.unlock();
-        for (auto& m: msg) {
-            m_applyChan << m;
-        }
+        // 一批日志只发送一次，使用者可以在一次加锁内应用整批日志
+        m_applyChan << batch;
         lock.lock();
         SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] applies entries {}-{} in term {}", m_id, m_logs.applied(), last_commit, m_currentTerm);
         // 1. push applyCh 结束之后更新 lastApplied 的时候一定得用之前的 commitIndex ，因为很可能在 push channel 期间发生了改变。
@@ -184,141 +352,543 @@ void RaftNode::applier() {
 
 void RaftNode::broadcastHeartbeat() {
     for (auto& peer: m_peers) {
-        go [id = peer.first, this]{
-            replicateOneRound(id);
-        };
+        wakeReplicator(peer.first, true);
     }
 }
 
+void RaftNode::broadcastAppend() {
+    for (auto& peer: m_peers) {
+        wakeReplicator(peer.first);
+    }
+}
 
-void RaftNode::replicateOneRound(int64_t peer) {
-    // 发送 rpc的时候一定不要持锁，否则很可能产生死锁。
-    std::unique_lock<MutexType> lock(m_mutex);
-    if (m_state != RaftState::Leader) {
+void RaftNode::wakeReplicator(int64_t peer, bool heartbeat) {
+    auto it = m_replicateChans.find(peer);
+    if (it == m_replicateChans.end()) {
         return;
     }
+    if (heartbeat) {
+        m_heartbeatPending[peer] = true;
+    }
+    // 已经有信号没被处理时直接丢弃，复制协程醒来后会发送目前所有的新日志
+    it->second.TryPush(true);
+}
 
-    int64_t prev_index = m_nextIndex[peer] - 1;
-    // 该节点的进度远远落后，直接发送快照同步
-    if (prev_index < m_logs.lastSnapshotIndex()) {
-        InstallSnapshotArgs request{};
-        Snapshot::ptr snapshot = m_persister->loadSnapshot();
-        if (!snapshot || snapshot->empty()) {
-            SPDLOG_LOGGER_ERROR(g_logger, "need non-empty snapshot");
-            return;
+void RaftNode::replicator(int64_t peer) {
+    co::co_chan<bool> chan;
+    {
+        std::unique_lock<MutexType> lock(m_mutex);
+        chan = m_replicateChans[peer];
+    }
+    bool signal;
+    while (chan.pop(signal)) {
+        if (s_replication_linger_ms) {
+            co_sleep(s_replication_linger_ms);
         }
+        std::unique_lock<MutexType> lock(m_mutex);
+        bool heartbeat = std::exchange(m_heartbeatPending[peer], false);
+        sendAppend(peer, heartbeat);
+    }
+}
 
-        SPDLOG_LOGGER_TRACE(g_logger, "Node[{}] [firstIndex: {}, commit: {}] sent snapshot[index: {}, term: {}] to Node[{}]",
-                            m_id, m_logs.firstIndex(), m_logs.committed(), snapshot->metadata.index, snapshot->metadata.index, peer);
+void RaftNode::sendAppend(int64_t peer, bool heartbeat) {
+    // 调用时持有锁，rpc 在协程中异步发送，发送的时候一定不要持锁，否则很可能产生死锁。
+    // 节点可能已经被移除
+    if (m_state != RaftState::Leader || !m_progress.contains(peer)) {
+        return;
+    }
+    auto& pr = m_progress.at(peer);
+    if (heartbeat) {
+        pr.onHeartbeat();
+    }
+    bool sent = false;
+    while (!pr.isPaused()) {
+        int64_t prev_index = pr.next() - 1;
+        // 该节点的进度远远落后，直接发送快照同步
+        if (prev_index < m_logs.lastSnapshotIndex()) {
+            sendSnapshot(peer);
+            break;
+        }
+        auto ents = m_logs.entries(pr.next());
+        // 没有新日志时只有探测状态的心跳需要发送，作为一次探测
+        if (ents.empty() && (sent || !heartbeat || pr.state() != Progress::Probe)) {
+            break;
+        }
+        AppendEntriesArgs request{};
+        request.term = m_currentTerm;
+        request.leaderId = m_id;
+        request.leaderCommit = m_logs.committed();
+        request.prevLogIndex = prev_index;
+        request.prevLogTerm = m_logs.term(prev_index);
+        request.entries = std::move(ents);
+        if (pr.state() == Progress::Replicate) {
+            if (!request.entries.empty()) {
+                // 乐观地推进 next，不等响应就发送下一批
+                pr.optimisticUpdate(request.entries.back().index);
+                pr.inflights().add(request.entries.back().index);
+            }
+        } else {
+            // 探测状态每次只发送一条
+            pr.pause();
+        }
+        sent = true;
+        go [peer, client = m_peers[peer], request = std::move(request), sent = GetSteadyMS(), this] {
+            auto reply = client->appendEntries(request);
+            std::unique_lock<MutexType> lock(m_mutex);
+            handleAppendEntriesReply(peer, request, reply, sent);
+        };
+    }
 
-        request.snapshot = std::move(*snapshot);
+    if (heartbeat && !sent) {
+        // 没有新日志、窗口已满或者正在发送快照，依然要发送心跳维持领导地位，
+        // 从已经确认匹配的位置发送，不会被拒绝，也不携带超过匹配位置的 commit
+        int64_t prev_index = std::max(pr.match(), m_logs.lastSnapshotIndex());
+        AppendEntriesArgs request{};
         request.term = m_currentTerm;
         request.leaderId = m_id;
+        request.leaderCommit = std::min(m_logs.committed(), pr.match());
+        request.prevLogIndex = prev_index;
+        request.prevLogTerm = m_logs.term(prev_index);
+        go [peer, client = m_peers[peer], request = std::move(request), sent = GetSteadyMS(), this] {
+            auto reply = client->appendEntries(request);
+            std::unique_lock<MutexType> lock(m_mutex);
+            handleAppendEntriesReply(peer, request, reply, sent);
+        };
+    }
+}
 
-        lock.unlock();
+void RaftNode::sendSnapshot(int64_t peer) {
+    auto& pr = m_progress.at(peer);
+    auto metadata = m_persister->loadSnapshotMetadata();
+    if (!metadata) {
+        SPDLOG_LOGGER_ERROR(g_logger, "need non-empty snapshot");
+        return;
+    }
 
-        auto reply = m_peers[peer]->installSnapshot(request);
-        if (!reply)
-            return;
+    SPDLOG_LOGGER_TRACE(g_logger, "Node[{}] [firstIndex: {}, commit: {}] sent snapshot[index: {}, term: {}] to Node[{}] [{}]",
+                        m_id, m_logs.firstIndex(), m_logs.committed(), metadata->index, metadata->term, peer, pr.toString());
 
-        lock.lock();
+    pr.becomeSnapshot(metadata->index);
 
-        SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] receives InstallSnapshotReply {} from Node[{}] after sending InstallSnapshotArgs {} in term {}",
-                            m_id, reply->toString(), peer, request.toString(), m_currentTerm);
+    InstallSnapshotArgs request{};
+    request.term = m_currentTerm;
+    request.leaderId = m_id;
+    request.metadata = *metadata;
+    // 第一个请求不带数据，询问对方已经接收到的位置，从那里继续发送
+    request.offset = 0;
+    request.done = false;
+    go [peer, client = m_peers[peer], request = std::move(request), this] () mutable {
+        while (true) {
+            uint64_t sent = GetSteadyMS();
+            auto reply = client->installSnapshot(request);
+            {
+                std::unique_lock<MutexType> lock(m_mutex);
+                if (!handleInstallSnapshotReply(peer, request, reply, sent)) {
+                    return;
+                }
+            }
+            request.offset = reply->offset;
+            if (!m_persister->readSnapshotChunk(request.metadata, request.offset, s_snapshot_chunk_size, request.data, request.done)) {
+                SPDLOG_LOGGER_WARN(g_logger, "Node[{}] read snapshot [index: {}, term: {}] at offset {} fail",
+                                   m_id, request.metadata.index, request.metadata.term, request.offset);
+                std::unique_lock<MutexType> lock(m_mutex);
+                handleInstallSnapshotReply(peer, request, std::nullopt, sent);
+                return;
+            }
+        }
+    };
+}
 
-        if (m_currentTerm != request.term || m_state != Leader) {
-            return;
+void RaftNode::handleAppendEntriesReply(int64_t peer, const AppendEntriesArgs& request, const std::optional<AppendEntriesReply>& reply, uint64_t sentMs) {
+    // 自己的状态已经改变或者节点已经被移除，响应过期
+    if (m_currentTerm != request.term || m_state != RaftState::Leader || !m_progress.contains(peer)) {
+        return;
+    }
+    auto& pr = m_progress.at(peer);
+    if (!reply) {
+        // 消息丢失，窗口内之后的消息大概率也会被拒绝，回到探测状态从已经匹配的位置重新开始
+        if (pr.state() == Progress::Replicate && !request.entries.empty()) {
+            pr.becomeProbe();
         }
-        // 如果因为网络原因集群选举出新的leader则自己变成follower
-        if (reply->term > m_currentTerm) {
-            becomeFollower(reply->term, reply->leaderId);
+        return;
+    }
+
+    SPDLOG_LOGGER_TRACE(g_logger, "Node[{}] receives AppendEntriesReply {} from Node[{}] after sending AppendEntriesArgs {} in term {}",
+                        m_id, reply->toString(), peer, request.toString(), m_currentTerm);
+
+    // 如果因为网络原因集群选举出新的leader则自己变成follower
+    if (reply->term > m_currentTerm) {
+        stepDown(reply->term, reply->leaderId);
+        return;
+    }
+    // 过期的响应
+    if (reply->term < m_currentTerm) {
+        return;
+    }
+    // 对方在这个时间之后还承认自己是 Leader，无论日志是否匹配
+    pr.ack(sentMs);
+    // 日志追加失败，根据 Follower 的提示回退 next
+    if (!reply->success) {
+        if (pr.maybeDecrTo(request.prevLogIndex, reply->nextIndex)) {
+            SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] decreased progress of Node[{}] to {}", m_id, peer, pr.toString());
+            if (pr.state() == Progress::Replicate) {
+                pr.becomeProbe();
+            }
+            wakeReplicator(peer);
+        }
+        return;
+    }
+
+    // 日志追加成功，更新复制进度，乱序到达的旧响应不会让进度回退
+    bool updated = pr.maybeUpdate(reply->nextIndex - 1);
+    switch (pr.state()) {
+        case Progress::Probe:
+            // 成功的响应确认了匹配位置，可以开始流水线复制
+            pr.becomeReplicate();
+            break;
+        case Progress::Snapshot:
+            if (pr.match() >= pr.pendingSnapshot()) {
+                pr.becomeProbe();
+                pr.becomeReplicate();
+            }
+            break;
+        case Progress::Replicate:
+            pr.inflights().freeLE(pr.match());
+            break;
+    }
+    if (updated) {
+        advanceCommit();
+        // 转移的目标节点追上了日志，让它立即发起选举
+        if (peer == m_leadTransferee && pr.match() == m_logs.lastIndex()) {
+            sendTimeoutNow(peer);
+        }
+    }
+    // 窗口有空闲了，继续发送
+    wakeReplicator(peer);
+}
+
+bool RaftNode::handleInstallSnapshotReply(int64_t peer, const InstallSnapshotArgs& request, const std::optional<InstallSnapshotReply>& reply, uint64_t sentMs) {
+    if (m_currentTerm != request.term || m_state != RaftState::Leader || !m_progress.contains(peer)) {
+        return false;
+    }
+    auto& pr = m_progress.at(peer);
+    if (pr.state() != Progress::Snapshot || pr.pendingSnapshot() != request.metadata.index) {
+        return false;
+    }
+    // 对方的任期不会小于请求的任期，更小的任期说明对方上没有这个 Raft 组，按发送失败处理
+    if (!reply || reply->term < request.term) {
+        // 快照发送失败，下一次心跳重新探测，对方已经接收的分块不会丢失
+        pr.snapshotFailure();
+        pr.becomeProbe();
+        pr.pause();
+        return false;
+    }
+
+    SPDLOG_LOGGER_TRACE(g_logger, "Node[{}] receives InstallSnapshotReply {} from Node[{}] after sending InstallSnapshotArgs {} in term {}",
+                        m_id, reply->toString(), peer, request.toString(), m_currentTerm);
+
+    // 如果因为网络原因集群选举出新的leader则自己变成follower
+    if (reply->term > m_currentTerm) {
+        stepDown(reply->term, reply->leaderId);
+        return false;
+    }
+    pr.ack(sentMs);
+    if (reply->offset >= 0) {
+        // 继续发送下一个分块
+        return true;
+    }
+    SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] finished sending snapshot [index: {}, term: {}] to Node[{}]",
+                        m_id, request.metadata.index, request.metadata.term, peer);
+    pr.maybeUpdate(request.metadata.index);
+    pr.becomeProbe();
+    wakeReplicator(peer);
+    return false;
+}
+
+void RaftNode::advanceCommit() {
+    // 假设存在 N 满足N > commitIndex，使得大多数的 matchIndex[i] ≥ N以及log[N].term == currentTerm 成立，
+    // 则令 commitIndex = N（5.3 和 5.4 节）
+    // 被大多数 voter 复制的日志，learner 不参与计算，联合共识阶段取新旧配置中较小的一个
+    int64_t quorum_index = m_conf.quorumValue([this](int64_t id) -> int64_t {
+        // 自己的日志落盘之后才算复制成功
+        if (id == m_id) {
+            return m_logs.persisted();
+        }
+        auto it = m_progress.find(id);
+        return it == m_progress.end() ? 0 : it->second.match();
+    });
+    // 只有领导人当前任期里的日志条目可以被提交
+    if (m_logs.maybeCommit(quorum_index, m_currentTerm)) {
+        m_applyCond.notify_one();
+        onConfCommitted();
+        if (m_state != Leader) {
             return;
         }
-        if (request.snapshot.metadata.index > m_matchIndex[peer]) {
-            m_matchIndex[peer] = request.snapshot.metadata.index;
+        // 当前任期第一次提交日志后，之前等待的读请求才能开始确认
+        if (!m_pendingReads.empty() && !m_readConfirming) {
+            confirmReadIndex();
         }
-        if (request.snapshot.metadata.index > m_nextIndex[peer]) {
-            m_nextIndex[peer] = request.snapshot.metadata.index + 1;
+    }
+}
+
+namespace {
+// 一轮读确认
+struct ReadRound {
+    // 这一轮确认的读请求
+    std::vector<co::co_chan<int64_t>> reads;
+    // 发起确认时的 commit index
+    int64_t index = 0;
+    int64_t term = 0;
+    // 承认自己是 Leader 的节点，自己有一票
+    std::set<int64_t> acks;
+    int64_t responses = 0;
+    // 发出确认的节点数
+    int64_t peers = 0;
+    bool done = false;
+};
+}
+
+std::optional<int64_t> RaftNode::readIndex() {
+    std::unique_lock<MutexType> lock(m_mutex);
+    if (m_state != Leader) {
+        return std::nullopt;
+    }
+    // 静默时没有心跳维持租约，唤醒之后重新确认
+    if (m_quiesced) {
+        unquiesce();
+    }
+    // 租约内不需要确认领导地位，直接返回 commit index
+    if (inLease()) {
+        return m_logs.committed();
+    }
+    co::co_chan<int64_t> chan(1);
+    m_pendingReads.push_back(chan);
+    // Leader 在当前任期提交过日志之后才知道最新的 commit index，否则等第一次提交之后再确认
+    if (!m_readConfirming && m_logs.term(m_logs.committed()) == m_currentTerm) {
+        confirmReadIndex();
+    }
+    lock.unlock();
+
+    int64_t index = -1;
+    // 一个选举超时内还不能确认，说明很可能已经有了新的 Leader
+    if (!chan.TimedPop(index, std::chrono::milliseconds(s_timer_election_base_ms)) || index < 0) {
+        return std::nullopt;
+    }
+    return index;
+}
+
+void RaftNode::confirmReadIndex() {
+    auto round = std::make_shared<ReadRound>();
+    round->reads.swap(m_pendingReads);
+    round->index = m_logs.committed();
+    round->term = m_currentTerm;
+    round->acks.insert(m_id);
+    round->peers = (int64_t)m_peers.size();
+
+    if (m_conf.hasQuorum([this](int64_t id) { return id == m_id;})) {
+        for (auto& chan: round->reads) {
+            chan.TryPush(round->index);
         }
-    } else {
-        auto ents = m_logs.entries(m_nextIndex[peer]);
+        return;
+    }
+    m_readConfirming = true;
+
+    for (auto& peer: m_peers) {
+        // 从已经确认匹配的位置发送心跳，不会被拒绝，也不携带超过匹配位置的 commit
+        auto& pr = m_progress.at(peer.first);
+        int64_t prev_index = std::max(pr.match(), m_logs.lastSnapshotIndex());
         AppendEntriesArgs request{};
         request.term = m_currentTerm;
         request.leaderId = m_id;
-        request.leaderCommit = m_logs.committed();
+        request.leaderCommit = std::min(m_logs.committed(), pr.match());
         request.prevLogIndex = prev_index;
         request.prevLogTerm = m_logs.term(prev_index);
-        request.entries = ents;
-        lock.unlock();
-
-        auto reply = m_peers[peer]->appendEntries(request);
+        go [round, id = peer.first, client = peer.second, request = std::move(request), sent = GetSteadyMS(), this] {
+            auto reply = client->appendEntries(request);
+            std::unique_lock<MutexType> lock(m_mutex);
+            ++round->responses;
+            if (round->done) {
+                return;
+            }
+            if (reply && reply->term > m_currentTerm) {
+                stepDown(reply->term, reply->leaderId);
+            }
+            // 对方处于同一任期，说明承认自己是这个任期的 Leader，日志是否匹配不影响
+            if (reply && reply->term == round->term) {
+                round->acks.insert(id);
+                if (m_currentTerm == round->term && m_state == Leader && m_progress.contains(id)) {
+                    m_progress.at(id).ack(sent);
+                }
+            }
+            bool stale = m_currentTerm != round->term || m_state != Leader;
+            bool confirmed = !stale && m_conf.hasQuorum([round](int64_t id) { return round->acks.contains(id);});
+            if (!stale && !confirmed && round->responses < round->peers) {
+                return;
+            }
+            round->done = true;
+            for (auto& chan: round->reads) {
+                chan.TryPush(confirmed ? round->index : -1);
+            }
+            if (stale) {
+                return;
+            }
+            m_readConfirming = false;
+            // 确认期间到达的读请求开始下一轮确认
+            if (!m_pendingReads.empty()) {
+                confirmReadIndex();
+            }
+        };
+    }
+}
 
-        if (!reply) {
-            return;
+bool RaftNode::inLease() {
+    // 转移领导权时其他节点不再等租约过期就会投票
+    if (!s_lease_read || m_state != Leader || m_leadTransferee != -1) {
+        return false;
+    }
+    // Leader 在当前任期提交过日志之后才知道最新的 commit index
+    if (m_logs.term(m_logs.committed()) != m_currentTerm) {
+        return false;
+    }
+    // 大多数节点在这个时间之后还承认自己是 Leader，它们收到消息后的一个最小选举超时内不会给其他候选人投票，
+    // 再减去时钟漂移的上限就是租约的有效期
+    uint64_t now = GetSteadyMS();
+    auto quorum_ack = (uint64_t)m_conf.quorumValue([now, this](int64_t id) -> int64_t {
+        if (id == m_id) {
+            return (int64_t)now;
         }
+        auto it = m_progress.find(id);
+        return it == m_progress.end() ? 0 : (int64_t)it->second.lastAck();
+    });
+    return now + s_lease_drift_ms < quorum_ack + s_timer_election_base_ms;
+}
 
-        lock.lock();
-
-        SPDLOG_LOGGER_TRACE(g_logger, "Node[{}] receives AppendEntriesReply {} from Node[{}] after sending AppendEntriesArgs {} in term {}",
-                            m_id, reply->toString(), peer, request.toString(), m_currentTerm);
+void RaftNode::failPendingReads() {
+    for (auto& chan: m_pendingReads) {
+        chan.TryPush(-1);
+    }
+    m_pendingReads.clear();
+    m_readConfirming = false;
+}
 
-        if (m_state != RaftState::Leader) {
-            return;
+bool RaftNode::transferLeadership(int64_t target) {
+    std::unique_lock<MutexType> lock(m_mutex);
+    if (m_state != Leader) {
+        return false;
+    }
+    if (target == m_id) {
+        return true;
+    }
+    if (!m_peers.contains(target) || !m_conf.isVoter(target)) {
+        SPDLOG_LOGGER_WARN(g_logger, "Node[{}] cannot transfer leadership to Node[{}] which is not a voter", m_id, target);
+        return false;
+    }
+    if (m_quiesced) {
+        unquiesce();
+    }
+    co::co_chan<bool> chan(1);
+    m_transferWaiters.push_back(chan);
+    if (m_leadTransferee != target) {
+        SPDLOG_LOGGER_INFO(g_logger, "Node[{}] starts to transfer leadership to Node[{}] at term {}", m_id, target, m_currentTerm);
+        m_leadTransferee = target;
+        if (m_progress.at(target).match() == m_logs.lastIndex()) {
+            sendTimeoutNow(target);
+        } else {
+            // 先把目标节点的日志补齐
+            wakeReplicator(target);
         }
+    }
+    lock.unlock();
 
-        // 如果因为网络原因集群选举出新的leader则自己变成follower
-        if (reply->term > m_currentTerm) {
-            becomeFollower(reply->term, reply->leaderId);
-            return;
-        }
-        // 过期的响应
-        if (reply->term < m_currentTerm) {
-            return;
+    bool ok = false;
+    if (!chan.TimedPop(ok, std::chrono::milliseconds(s_timer_election_base_ms))) {
+        lock.lock();
+        if (m_leadTransferee == target) {
+            SPDLOG_LOGGER_WARN(g_logger, "Node[{}] aborted transferring leadership to Node[{}] at term {}", m_id, target, m_currentTerm);
+            finishLeaderTransfer(false);
         }
-        // 日志追加失败，根据 nextIndex 更新 m_nextIndex 和 m_matchIndex
-        if (!reply->success) {
-            if (reply->nextIndex) {
-                m_nextIndex[peer] = reply->nextIndex;
-                m_matchIndex[peer] = std::min(m_matchIndex[peer], reply->nextIndex - 1);
-            }
+        return false;
+    }
+    return ok;
+}
+
+void RaftNode::sendTimeoutNow(int64_t peer) {
+    TimeoutNowArgs request{};
+    request.term = m_currentTerm;
+    request.leaderId = m_id;
+    go [peer, client = m_peers[peer], request, this] {
+        auto reply = client->timeoutNow(request);
+        if (!reply) {
             return;
         }
-
-        // 日志追加成功，则更新 m_nextIndex 和 m_matchIndex
-        if (reply->nextIndex > m_nextIndex[peer]) {
-            m_nextIndex[peer] = reply->nextIndex;
-            m_matchIndex[peer] = m_nextIndex[peer] - 1;
+        std::unique_lock<MutexType> lock(m_mutex);
+        if (reply->term > m_currentTerm) {
+            stepDown(reply->term, reply->leaderId);
         }
+    };
+}
 
-        int64_t last_index = m_matchIndex[peer];
+void RaftNode::finishLeaderTransfer(bool ok) {
+    m_leadTransferee = -1;
+    for (auto& chan: m_transferWaiters) {
+        chan.TryPush(ok);
+    }
+    m_transferWaiters.clear();
+}
 
-        // 计算副本数目大于节点数量的一半才提交一个当前任期内的日志
-        int64_t vote = 1;
-        for (auto match: m_matchIndex) {
-            if (match.second >= last_index) {
-                ++vote;
-            }
-            // 假设存在 N 满足N > commitIndex，使得大多数的 matchIndex[i] ≥ N以及log[N].term == currentTerm 成立，
-            // 则令 commitIndex = N（5.3 和 5.4 节）
-            if (vote > ((int64_t)m_peers.size() + 1) / 2) {
-                // 只有领导人当前任期里的日志条目可以被提交
-                if (m_logs.maybeCommit(last_index, m_currentTerm)) {
-                    m_applyCond.notify_one();
-                }
-            }
-        }
+TimeoutNowReply RaftNode::handleTimeoutNow(TimeoutNowArgs request) {
+    std::unique_lock<MutexType> lock(m_mutex);
+    TimeoutNowReply reply{};
+    reply.term = m_currentTerm;
+    reply.leaderId = m_leaderId;
+    // 只响应当前任期 Leader 的请求，learner 不能成为 Leader
+    if (request.term != m_currentTerm || m_state == Leader || !m_conf.isVoter(m_id)) {
+        return reply;
     }
+    SPDLOG_LOGGER_INFO(g_logger, "Node[{}] receives TimeoutNowArgs {} and starts election at term {}",
+                       m_id, request.toString(), m_currentTerm + 1);
+    // 跳过预投票，直接以新的任期发起选举
+    becomeCandidate();
+    rescheduleElection();
+    startElection(false, true);
+    reply.term = m_currentTerm;
+    reply.leaderId = m_leaderId;
+    return reply;
 }
 
 RequestVoteReply RaftNode::handleRequestVote(RequestVoteArgs request) {
     std::unique_lock<MutexType> lock(m_mutex);
     RequestVoteReply reply{};
     co_defer_scope {
-        persist();
+        // 投票落盘之后才能回复，等待时不持有锁
+        waitPersist(lock, submitPersist());
         // 投票后节点的状态
         SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] before processing RequestVoteArgs {} and reply RequestVoteReply {}, state is {}",
                               m_id, request.toString(), reply.toString(), toString());
     };
+    // 有节点在发起选举，说明它没有跟上，静默的 Leader 恢复心跳让它回到 Follower
+    if (m_quiesced && m_state == Leader) {
+        unquiesce();
+    }
+    // 预投票不改变自己的任期和投票，只回答如果真正选举是否会投票
+    if (request.preVote) {
+        reply.term = m_currentTerm;
+        reply.leaderId = m_leaderId;
+        // Leader 还活着时拒绝，避免被隔离后重新加入的节点打断正常工作的 Leader
+        reply.voteGranted = request.term > m_currentTerm && !leaderAlive()
+                            && m_logs.isUpToDate(request.lastLogIndex, request.lastLogTerm);
+        return reply;
+    }
+    // 租约读或者 CheckQuorum 模式下，最近一个选举超时内还收到过 Leader 的消息，说明 Leader 还活着，不能让其他候选人当选，
+    // 否则旧 Leader 在租约内读到的数据可能是过期的
+    // 领导权转移发起的选举是 Leader 主动让出的，不受这个限制
+    if ((s_lease_read || s_check_quorum) && !request.leaderTransfer && request.term > m_currentTerm
+            && m_state == Follower && leaderAlive()) {
+        reply.term = m_currentTerm;
+        reply.leaderId = m_leaderId;
+        reply.voteGranted = false;
+        return reply;
+    }
     // 拒绝给任期小于自己的候选人投票
     if (request.term < m_currentTerm ||
             // 多个候选人发起选举的情况
@@ -366,14 +936,16 @@ AppendEntriesReply RaftNode::handleAppendEntries(AppendEntriesArgs request) {
     co_defer_scope {
         if (reply.success && m_logs.committed() < request.leaderCommit) {
            // 更新提交索引，为什么取了个最小？committed是leader发来的，是全局状态，但是当前节点
-           // 可能落后于全局状态，所以取了最小值。last_index 是这个节点最新的索引， 不是最大的可靠索引，
+           // 可能落后于全局状态，所以取了最小值。注意不能用这个节点最新的索引，流水线复制下乱序到达的消息
+           // 只能确认到这条消息的最后一条日志和 leader 一致，之后的日志可能还没有被覆盖。
            // 如果此时节点异常了，会不会出现commit index以前的日志已经被apply，但是有些日志还没有被持久化？
            // 这里需要解释一下，raft更新了commit index，raft会把commit index以前的日志交给使用者apply同时
            // 会把不可靠日志也交给使用者持久化，所以这要求必须先持久化日志再apply日志，否则就会出现刚刚提到的问题。
-           m_logs.commitTo(std::min(request.leaderCommit, m_logs.lastIndex()));
+           m_logs.commitTo(std::min(request.leaderCommit, reply.nextIndex - 1));
            m_applyCond.notify_one();
         }
-        persist();
+        // 新日志落盘之后才能回复，等待时不持有锁，只有心跳时不产生磁盘 IO
+        waitPersist(lock, submitPersist());
         SPDLOG_LOGGER_TRACE(g_logger, "Node[{}] before processing AppendEntriesArgs {} and reply AppendEntriesResponse {}, state is {}",
             m_id, request.toString(), reply.toString(), toString());
     };
@@ -387,8 +959,8 @@ AppendEntriesReply RaftNode::handleAppendEntries(AppendEntriesArgs request) {
 
     // 对方任期大于自己或者自己为同一任期内败选的候选人则转变为 follower
     // 已经是该任期内的follower就不用变
-    if (request.term > m_currentTerm ||
-                (request.term == m_currentTerm && m_state == RaftState::Candidate)) {
+    if (request.term > m_currentTerm || (request.term == m_currentTerm &&
+                (m_state == RaftState::Candidate || m_state == RaftState::PreCandidate))) {
         becomeFollower(request.term, request.leaderId);
     }
 
@@ -398,13 +970,15 @@ AppendEntriesReply RaftNode::handleAppendEntries(AppendEntriesArgs request) {
 
     // 自己为同一任期内的follower，更新选举定时器就行
     rescheduleElection();
+    m_lastLeaderContact = GetSteadyMS();
 
-    // 拒绝错误的日志追加请求
+    // 过期的日志追加请求，快照之前的日志都已经提交，直接确认到 commit 的位置
     if (request.prevLogIndex < m_logs.lastSnapshotIndex()) {
-        reply.term = 0;
-        reply.leaderId = -1;
-        reply.success = false;
-        SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] receives unexpected AppendEntriesArgs {} from Node[{}] because prevLogIndex {} < firstLogIndex {}",
+        reply.term = m_currentTerm;
+        reply.leaderId = m_leaderId;
+        reply.success = true;
+        reply.nextIndex = m_logs.committed() + 1;
+        SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] receives stale AppendEntriesArgs {} from Node[{}] because prevLogIndex {} < firstLogIndex {}",
            m_id, request.toString(), request.leaderId, request.prevLogIndex, m_logs.firstIndex());
         return reply;
     }
@@ -421,6 +995,14 @@ AppendEntriesReply RaftNode::handleAppendEntries(AppendEntriesArgs request) {
         return reply;
     }
 
+    // 追加了成员变更日志，或者当前配置所在的日志可能被覆盖，重新加载成员配置
+    if (!request.entries.empty() && (m_confIndex > request.prevLogIndex ||
+            std::any_of(request.entries.begin(), request.entries.end(), [](const Entry& ent) {
+                return ent.type == Entry::CONF_CHANGE;
+            }))) {
+        reloadConfState();
+    }
+
     reply.term = m_currentTerm;
     reply.leaderId = m_leaderId;
     reply.success = true;
@@ -432,25 +1014,33 @@ InstallSnapshotReply RaftNode::handleInstallSnapshot(InstallSnapshotArgs request
     std::unique_lock<MutexType> lock(m_mutex);
     InstallSnapshotReply reply{};
     co_defer_scope {
+        if (!lock.owns_lock()) {
+            lock.lock();
+        }
+        waitPersist(lock, submitPersist());
         SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] before processing InstallSnapshotArgs {} and reply InstallSnapshotReply {}, state is {}",
              m_id, request.toString(), reply.toString(), toString());
     };
     reply.term = m_currentTerm;
     reply.leaderId = m_leaderId;
+    // 默认不再需要这个快照
+    reply.offset = -1;
 
     if (request.term < m_currentTerm) {
         return reply;
     }
 
-    if (request.term > m_currentTerm) {
+    if (request.term > m_currentTerm || m_state != RaftState::Follower) {
         becomeFollower(request.term, request.leaderId);
     }
 
     rescheduleElection();
+    m_lastLeaderContact = GetSteadyMS();
+    reply.term = m_currentTerm;
     reply.leaderId = m_leaderId;
 
-    const int64_t snap_index = request.snapshot.metadata.index;
-    const int64_t snap_term = request.snapshot.metadata.term;
+    const int64_t snap_index = request.metadata.index;
+    const int64_t snap_term = request.metadata.term;
 
     // 过时的快照
     if (snap_index <= m_logs.committed()) {
@@ -466,69 +1056,294 @@ InstallSnapshotReply RaftNode::handleInstallSnapshot(InstallSnapshotArgs request
         return reply;
     }
 
-    SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] starts to restore snapshot [index: {}, term: {}]", m_id, snap_index, snap_term);
+    // 分块直接追加到临时文件，磁盘 IO 的时候不持有锁
+    lock.unlock();
+    reply.offset = m_persister->receiveSnapshotChunk(request.metadata, request.offset, request.data);
+    if (!request.done || reply.offset != request.offset + (int64_t)request.data.size()) {
+        return reply;
+    }
+    Snapshot::ptr snapshot = m_persister->finishSnapshot(request.metadata);
+    if (!snapshot) {
+        // 快照损坏，从头开始接收
+        reply.offset = 0;
+        return reply;
+    }
+    lock.lock();
+    reply.offset = -1;
+
+    // 接收期间状态可能已经改变
+    if (m_currentTerm != request.term || snap_index <= m_logs.committed()) {
+        reply.term = m_currentTerm;
+        return reply;
+    }
 
+    SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] starts to restore snapshot [index: {}, term: {}]", m_id, snap_index, snap_term);
 
-    if (request.snapshot.metadata.index > m_logs.lastIndex()) {
+    if (snap_index > m_logs.lastIndex()) {
         // 如果自己的日志太旧了就全部清除了
-        m_logs.clearEntries(request.snapshot.metadata.index, request.snapshot.metadata.term);
+        m_logs.clearEntries(snap_index, snap_term);
     } else {
         // 压缩一部分日志
-        m_logs.compact(request.snapshot.metadata.index);
+        m_logs.compact(snap_index);
+    }
+    if (!snapshot->metadata.conf.empty()) {
+        m_snapshotConf = snapshot->metadata.conf;
     }
+    reloadConfState();
 
-    go [snap = request.snapshot, this] {
-        m_applyChan << ApplyMsg{snap};
+    go [snapshot, this] {
+        m_applyChan << ApplyBatch{ApplyMsg{*snapshot}};
     };
-    persist(std::make_shared<Snapshot>(std::move(request.snapshot)));
+    saveSnapshot(lock, snapshot);
     return reply;
 }
 
 void RaftNode::addPeer(int64_t id, Address::ptr address) {
-    RaftPeer::ptr peer = std::make_shared<RaftPeer>(id, address);
+    RaftPeer::ptr peer;
+    if (m_host) {
+        // 同一个远端节点上的所有 Raft 组共享一个连接
+        peer = std::make_shared<RaftPeer>(id, m_host->getConnection(id, address), m_group);
+    } else {
+        peer = std::make_shared<RaftPeer>(id, address);
+    }
     m_peers[id] = peer;
-    m_nextIndex[id] = 0;
-    m_matchIndex[id] = 0;
+    m_progress.insert_or_assign(id, Progress(m_logs.lastIndex() + 1, s_max_inflight));
+    m_replicateChans.emplace(id, co::co_chan<bool>(1));
+    if (m_started) {
+        go [id, this] {
+            replicator(id);
+        };
+    }
     SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] add peer[{}], address is {}", m_id, id, address->toString());
 }
 
+void RaftNode::removePeer(int64_t id) {
+    auto it = m_replicateChans.find(id);
+    if (it != m_replicateChans.end()) {
+        // 关闭 channel 后复制协程退出
+        it->second.close();
+        m_replicateChans.erase(it);
+    }
+    m_peers.erase(id);
+    m_progress.erase(id);
+    m_heartbeatPending.erase(id);
+    if (m_leadTransferee == id) {
+        finishLeaderTransfer(false);
+    }
+    SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] remove peer[{}]", m_id, id);
+}
+
+void RaftNode::applyConfState(const ConfState& conf, int64_t index) {
+    m_conf = conf;
+    m_confIndex = index;
+    auto members = conf.members();
+    for (auto& [id, address]: members) {
+        if (id == m_id || m_peers.contains(id)) {
+            continue;
+        }
+        Address::ptr addr = Address::LookupAny(address);
+        if (!addr) {
+            SPDLOG_LOGGER_ERROR(g_logger, "Node[{}] cannot resolve address {} of Node[{}]", m_id, address, id);
+            continue;
+        }
+        addPeer(id, addr);
+    }
+    std::vector<int64_t> removed;
+    for (auto& peer: m_peers) {
+        if (!members.contains(peer.first)) {
+            removed.push_back(peer.first);
+        }
+    }
+    for (int64_t id: removed) {
+        removePeer(id);
+    }
+}
+
+void RaftNode::reloadConfState() {
+    int64_t index = m_logs.lastConfIndex(m_logs.lastIndex());
+    ConfState conf = confAt(index);
+    if (index != m_confIndex) {
+        SPDLOG_LOGGER_INFO(g_logger, "Node[{}] uses conf state {} at index {}", m_id, conf.toString(), index);
+    }
+    applyConfState(conf, index);
+}
+
+ConfState RaftNode::confAt(int64_t index) {
+    int64_t conf_index = m_logs.lastConfIndex(index);
+    if (!conf_index) {
+        return m_snapshotConf;
+    }
+    auto ents = m_logs.slice(conf_index, conf_index + 1, 1);
+    if (ents.empty()) {
+        SPDLOG_LOGGER_ERROR(g_logger, "Node[{}] load conf change entry {} fail", m_id, conf_index);
+        return m_conf;
+    }
+    ConfState conf;
+    Serializer s(ents.front().data);
+    s >> conf;
+    return conf;
+}
+
+ConfChangeResult RaftNode::canChangeConf() {
+    if (m_state != Leader || m_leadTransferee != -1) {
+        return ConfChangeResult::NotLeader;
+    }
+    // 上一个成员变更还没有提交，或者还处于联合共识
+    if (m_conf.joint() || m_confIndex > m_logs.committed()) {
+        SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] has a pending conf change at index {}", m_id, m_confIndex);
+        return ConfChangeResult::Pending;
+    }
+    return ConfChangeResult::Ok;
+}
+
+ConfChangeResult RaftNode::proposeConfChange(const ConfState& conf) {
+    SPDLOG_LOGGER_INFO(g_logger, "Node[{}] proposes conf change from {} to {} at term {}",
+                       m_id, m_conf.toString(), conf.toString(), m_currentTerm);
+    Serializer s;
+    s << conf;
+    s.reset();
+    return Propose(s.toString(), Entry::CONF_CHANGE) ? ConfChangeResult::Ok : ConfChangeResult::NotLeader;
+}
+
+void RaftNode::onConfCommitted() {
+    if (m_confIndex == 0 || m_confIndex > m_logs.committed()) {
+        return;
+    }
+    if (m_conf.joint()) {
+        // C(old,new) 已经提交，追加 C(new) 离开联合共识
+        proposeConfChange(m_conf.leaveJoint());
+    } else if (!m_conf.isVoter(m_id)) {
+        SPDLOG_LOGGER_INFO(g_logger, "Node[{}] is not a voter of committed conf state {} and steps down at term {}",
+                           m_id, m_conf.toString(), m_currentTerm);
+        becomeFollower(m_currentTerm);
+    }
+}
+
+ConfChangeResult RaftNode::addLearner(int64_t id, const std::string& address) {
+    std::unique_lock<MutexType> lock(m_mutex);
+    if (auto result = canChangeConf(); result != ConfChangeResult::Ok) {
+        return result;
+    }
+    if (id == m_id || m_conf.contains(id)) {
+        return ConfChangeResult::Invalid;
+    }
+    // learner 不影响大多数的计算，不需要联合共识
+    ConfState conf = m_conf;
+    conf.learners[id] = address;
+    return proposeConfChange(conf);
+}
+
+ConfChangeResult RaftNode::promoteLearner(int64_t id) {
+    std::unique_lock<MutexType> lock(m_mutex);
+    if (auto result = canChangeConf(); result != ConfChangeResult::Ok) {
+        return result;
+    }
+    if (!m_conf.isLearner(id)) {
+        return ConfChangeResult::Invalid;
+    }
+    // 追上 commit 之后再提升，否则新配置的大多数可能要等它追上才能提交日志
+    auto& pr = m_progress.at(id);
+    if (pr.match() < m_logs.committed()) {
+        SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] cannot promote learner Node[{}] which is not caught up, match {}, commit {}",
+                            m_id, id, pr.match(), m_logs.committed());
+        return ConfChangeResult::NotCaughtUp;
+    }
+    ConfState conf = m_conf;
+    conf.outgoing = m_conf.voters;
+    conf.voters[id] = m_conf.learners.at(id);
+    conf.learners.erase(id);
+    return proposeConfChange(conf);
+}
+
+ConfChangeResult RaftNode::removeMember(int64_t id) {
+    std::unique_lock<MutexType> lock(m_mutex);
+    if (auto result = canChangeConf(); result != ConfChangeResult::Ok) {
+        return result;
+    }
+    if (!m_conf.contains(id)) {
+        return ConfChangeResult::Invalid;
+    }
+    ConfState conf = m_conf;
+    if (m_conf.isLearner(id)) {
+        conf.learners.erase(id);
+    } else {
+        if (m_conf.voters.size() == 1) {
+            return ConfChangeResult::Invalid;
+        }
+        conf.outgoing = m_conf.voters;
+        conf.voters.erase(id);
+    }
+    return proposeConfChange(conf);
+}
+
+ConfState RaftNode::getConfState() {
+    std::unique_lock<MutexType> lock(m_mutex);
+    return m_conf;
+}
+
 bool RaftNode::isLeader() {
     std::unique_lock<MutexType> lock(m_mutex);
     return m_state == Leader;
 }
 
+bool RaftNode::isQuiesced() {
+    std::unique_lock<MutexType> lock(m_mutex);
+    return m_quiesced;
+}
+
 std::pair<int64_t, bool> RaftNode::getState() {
     std::unique_lock<MutexType> lock(m_mutex);
     return {m_currentTerm, m_state == Leader};
 }
 
 std::string RaftNode::toString() {
-    std::map<RaftState, std::string> mp{{Follower, "Follower"}, {Candidate, "Candidate"}, {Leader, "Leader"}};
+    std::map<RaftState, std::string> mp{{Follower, "Follower"}, {PreCandidate, "PreCandidate"}, {Candidate, "Candidate"}, {Leader, "Leader"}};
     std::string str = fmt::format("Id: {}, State: {}, LeaderId: {}, CurrentTerm: {}, VotedFor: {}, CommitIndex: {}, LastApplied: {}",
                         m_id, mp[m_state], m_leaderId, m_currentTerm, m_votedFor, m_logs.committed(), m_logs.applied());
     return "{" + str + "}";
 }
 
 void RaftNode::becomeFollower(int64_t term, int64_t leaderId) {
-    // 成为follower停止心跳定时器
-    if (m_heartbeatTimer && m_state == RaftState::Leader) {
+    if (m_state == RaftState::Leader) {
+        // 成为follower停止心跳定时器，重新开始选举计时
         m_heartbeatTimer.stop();
+        failPendingReads();
+        if (m_leadTransferee != -1) {
+            finishLeaderTransfer(true);
+        }
+        rescheduleElection();
+    }
+    // 任期改变后原来的 Leader 不再有效
+    if (m_quiesced && term != m_currentTerm) {
+        unquiesce();
     }
-
     m_state = RaftState::Follower;
+    // 同一个任期内只能投一次票，任期不变时保留投票
+    if (term != m_currentTerm) {
+        m_votedFor = -1;
+    }
+    // 任期和投票的变化由 submitPersist 和 m_hardState 比较得出，这里不做磁盘 IO
     m_currentTerm = term;
-    m_votedFor = -1;
     m_leaderId = leaderId;
-    persist();
     SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] became follower at term [{}], state is {}", m_id, term, toString());
 }
 
+void RaftNode::stepDown(int64_t term, int64_t leaderId) {
+    becomeFollower(term, leaderId);
+    persistAsync();
+}
+
+void RaftNode::becomePreCandidate() {
+    m_state = RaftState::PreCandidate;
+    m_leaderId = -1;
+    SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] became PreCandidate at term {}, state is {}", m_id, m_currentTerm, toString());
+}
+
 void RaftNode::becomeCandidate() {
     m_state = RaftState::Candidate;
     ++m_currentTerm;
     m_votedFor = m_id;
     m_leaderId = -1;
-    persist();
     SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] became Candidate at term {}, state is {}", m_id, m_currentTerm, toString());
 }
 
@@ -539,50 +1354,201 @@ void RaftNode::becomeLeader() {
     }
     m_state = RaftState::Leader;
     m_leaderId = m_id;
+    m_leaderSince = GetSteadyMS();
     // 成为领导者后，领导者并不知道其它节点的日志情况，因此与其它节点需要同步那么日志，领导者并不知道集群其他节点状态，
     // 因此他选择了不断尝试。nextIndex、matchIndex 分别用来保存其他节点的下一个待同步日志index、已匹配的日志index。
     // nextIndex初始化值为lastIndex+1，即领导者最后一个日志序号+1，因此其实这个日志序号是不存在的，显然领导者也不
     // 指望一次能够同步成功，而是拿出一个值来试探。matchIndex初始化值为0，这个很好理解，因为他还未与任何节点同步成功过，
-    // 所以直接为0。
+    // 所以直接为0。每个节点都从探测状态开始，确认匹配位置后进入复制状态流水线地发送日志。
     for (auto& peer : m_peers) {
-        m_nextIndex[peer.first] = m_logs.lastIndex() + 1;
-        m_matchIndex[peer.first] = 0;
+        m_progress.insert_or_assign(peer.first, Progress(m_logs.lastIndex() + 1, s_max_inflight));
     }
-    persist();
     SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] became Leader at term {}, state is {}", m_id, m_currentTerm, toString());
 
     // note: 即使日志已经被同步到了大多数个节点上，依然不能认为是已经提交了
-    // 所以 leader 上任后应该提交一条空日志来提交之前的日志
+    // 所以 leader 上任后应该提交一条空日志来提交之前的日志，同时也作为第一轮探测
     Propose("");
-    // 成为领导者，发起一轮心跳
-    broadcastHeartbeat();
     // 开启心跳定时器
     resetHeartbeatTimer();
 }
 
 void RaftNode::rescheduleElection() {
+    // 重新开始选举计时，说明已经离开静默
+    m_quiesced = false;
     m_electionTimer.stop();
     m_electionTimer = CycleTimer(GetRandomizedElectionTimeout(), [this] {
         std::unique_lock<MutexType> lock(m_mutex);
-        if (m_state != RaftState::Leader) {
-            becomeCandidate();
+        // learner 不发起选举
+        if (m_state != RaftState::Leader && m_conf.isVoter(m_id)) {
             // 异步投票，不阻塞选举定时器
-            startElection();
+            if (s_pre_vote) {
+                becomePreCandidate();
+                startElection(true);
+            } else {
+                becomeCandidate();
+                startElection();
+            }
         }
     });
 }
 
 void RaftNode::resetHeartbeatTimer() {
     m_heartbeatTimer.stop();
+    // 托管的节点由 RaftHost 统一发送心跳
+    if (m_host) {
+        return;
+    }
     m_heartbeatTimer = CycleTimer(GetStableHeartbeatTimeout(), [this] {
         std::unique_lock<MutexType> lock(m_mutex);
         if (m_state == RaftState::Leader) {
+            // 和大多数节点失去联系，退位让出领导权，不再接受写入
+            if (s_check_quorum && !checkQuorum()) {
+                SPDLOG_LOGGER_WARN(g_logger, "Node[{}] stepped down at term {} since quorum is not active", m_id, m_currentTerm);
+                becomeFollower(m_currentTerm);
+                return;
+            }
             // broadcast
             broadcastHeartbeat();
         }
     });
 }
 
+void RaftNode::tick(std::map<int64_t, std::vector<HeartbeatArgs>>& heartbeats) {
+    std::unique_lock<MutexType> lock(m_mutex);
+    if (!m_started) {
+        return;
+    }
+    if (m_state != Leader) {
+        // 静默的 Follower 没有选举计时，Leader 所在的节点失联后恢复计时
+        if (m_quiesced && !leaderAlive()) {
+            SPDLOG_LOGGER_INFO(g_logger, "Node[{}] group {} lost contact with leader Node[{}], unquiesce", m_id, m_group, m_leaderId);
+            unquiesce();
+        }
+        return;
+    }
+    if (m_quiesced) {
+        return;
+    }
+    // 和大多数节点失去联系，退位让出领导权，不再接受写入
+    if (s_check_quorum && !checkQuorum()) {
+        SPDLOG_LOGGER_WARN(g_logger, "Node[{}] stepped down at term {} since quorum is not active", m_id, m_currentTerm);
+        becomeFollower(m_currentTerm);
+        return;
+    }
+    bool quiesce = canQuiesce();
+    for (auto& peer: m_peers) {
+        auto& pr = m_progress.at(peer.first);
+        // 还有日志没有复制或者需要探测，由复制协程发送带日志的心跳
+        if (pr.state() != Progress::Replicate || pr.match() < m_logs.lastIndex()) {
+            wakeReplicator(peer.first, true);
+            continue;
+        }
+        heartbeats[peer.first].push_back(HeartbeatArgs{
+            .group = m_group,
+            .term = m_currentTerm,
+            .leaderId = m_id,
+            .commit = std::min(m_logs.committed(), pr.match()),
+            .quiesce = quiesce,
+        });
+    }
+    if (quiesce) {
+        m_quiesced = true;
+        SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] group {} quiesces at term {}, index {}", m_id, m_group, m_currentTerm, m_logs.lastIndex());
+    }
+}
+
+HeartbeatReply RaftNode::handleHeartbeat(const HeartbeatArgs& request) {
+    std::unique_lock<MutexType> lock(m_mutex);
+    HeartbeatReply reply{.group = m_group, .term = m_currentTerm, .leaderId = m_leaderId, .success = false};
+    co_defer_scope {
+        // 新的任期落盘之后才能回复
+        waitPersist(lock, submitPersist());
+    };
+    if (request.term < m_currentTerm) {
+        return reply;
+    }
+    if (request.term > m_currentTerm || (request.term == m_currentTerm &&
+                (m_state == RaftState::Candidate || m_state == RaftState::PreCandidate))) {
+        becomeFollower(request.term, request.leaderId);
+    }
+    m_leaderId = request.leaderId;
+    rescheduleElection();
+    m_lastLeaderContact = GetSteadyMS();
+    // commit 不超过 Leader 确认的匹配位置，这之前的日志一定和 Leader 一致
+    if (m_logs.committed() < request.commit) {
+        m_logs.commitTo(std::min(request.commit, m_logs.lastIndex()));
+        m_applyCond.notify_one();
+    }
+    reply.term = m_currentTerm;
+    reply.leaderId = m_leaderId;
+    reply.success = true;
+    if (request.quiesce) {
+        // 日志已经追上并且全部落盘才能静默，否则拒绝，Leader 会继续发送心跳
+        if (m_logs.lastIndex() != request.commit || m_logs.persisted() != request.commit) {
+            reply.success = false;
+            return reply;
+        }
+        m_electionTimer.stop();
+        m_quiesced = true;
+        SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] group {} quiesces at term {}, index {}", m_id, m_group, m_currentTerm, request.commit);
+    }
+    return reply;
+}
+
+void RaftNode::handleHeartbeatReply(int64_t peer, const HeartbeatArgs& request, const std::optional<HeartbeatReply>& reply, uint64_t sentMs) {
+    std::unique_lock<MutexType> lock(m_mutex);
+    if (m_currentTerm != request.term || m_state != RaftState::Leader || !m_progress.contains(peer)) {
+        return;
+    }
+    if (reply && reply->term > m_currentTerm) {
+        stepDown(reply->term, reply->leaderId);
+        return;
+    }
+    // 对方的任期不会小于请求的任期，更小说明对方没有这个 Raft 组
+    if (!reply || reply->term < request.term) {
+        if (request.quiesce && m_quiesced) {
+            unquiesce();
+        }
+        return;
+    }
+    m_progress.at(peer).ack(sentMs);
+    // 对方没有进入静默，恢复心跳
+    if (request.quiesce && !reply->success && m_quiesced) {
+        unquiesce();
+    }
+}
+
+bool RaftNode::canQuiesce() {
+    // 单独运行的节点没有节点级别的心跳，不能判断静默的 Leader 是否存活
+    if (!m_host || !s_quiesce) {
+        return false;
+    }
+    if (m_leadTransferee != -1 || !m_pendingReads.empty() || m_readConfirming || m_conf.joint()) {
+        return false;
+    }
+    // 所有日志都已经提交和落盘，并且每个节点都已经追上
+    int64_t last = m_logs.lastIndex();
+    if (m_logs.committed() != last || m_logs.persisted() != last) {
+        return false;
+    }
+    return std::all_of(m_peers.begin(), m_peers.end(), [last, this](auto& peer) {
+        auto& pr = m_progress.at(peer.first);
+        return pr.state() == Progress::Replicate && pr.match() == last;
+    });
+}
+
+void RaftNode::unquiesce() {
+    if (m_state == Leader) {
+        m_quiesced = false;
+        // 静默期间没有收到响应，重新给 CheckQuorum 一个选举超时的宽限
+        m_leaderSince = GetSteadyMS();
+        broadcastHeartbeat();
+    } else {
+        rescheduleElection();
+    }
+    SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] group {} unquiesces at term {}", m_id, m_group, m_currentTerm);
+}
+
 uint64_t RaftNode::GetStableHeartbeatTimeout() {
     return s_timer_heartbeat_ms;
 }
@@ -593,34 +1559,112 @@ uint64_t RaftNode::GetRandomizedElectionTimeout() {
     return dist(engine);
 }
 
-void RaftNode::persist(Snapshot::ptr snap) {
+void RaftNode::saveSnapshot(std::unique_lock<MutexType>& lock, Snapshot::ptr snapshot) {
+    // 快照之前还没有落盘的状态和日志先加入批次，保证写入顺序
+    auto ticket = submitPersist();
+    lock.unlock();
+    bool ok = m_persister->saveSnapshot(snapshot);
+    lock.lock();
+    if (!ok) {
+        SPDLOG_LOGGER_CRITICAL(g_logger, "Node[{}] persist snapshot [index: {}, term: {}] fail",
+                               m_id, snapshot->metadata.index, snapshot->metadata.term);
+        return;
+    }
+    // 快照写入时已经等待了之前的所有批次
+    onPersisted(ticket);
+}
+
+RaftNode::PersistTicket RaftNode::submitPersist() {
+    PersistTicket ticket{};
+    auto ents = m_logs.unstableEntries();
+    // commit index 不需要持久化，重启后会重新从 Leader 获得
+    if (ents.empty() && m_currentTerm == m_hardState.term && m_votedFor == m_hardState.vote) {
+        // 之前异步提交的状态可能还没有落盘，回复之前同样需要等待
+        if (m_submittedSeq > m_durableSeq) {
+            ticket.seq = m_submittedSeq;
+        }
+        return ticket;
+    }
     HardState hs{};
     hs.vote = m_votedFor;
     hs.term = m_currentTerm;
     hs.commit = m_logs.committed();
-    m_persister->persist(hs, m_logs.allEntries(), snap);
+    // 持有锁加入批次，保证和其他持久化的顺序一致
+    ticket.seq = m_persister->append(hs, ents);
+    m_submittedSeq = ticket.seq;
+    m_hardState = hs;
+    if (!ents.empty()) {
+        ticket.index = ents.back().index;
+        ticket.term = ents.back().term;
+        m_logs.stableTo(ticket.index);
+    }
+    return ticket;
+}
+
+bool RaftNode::waitPersist(std::unique_lock<MutexType>& lock, const PersistTicket& ticket) {
+    if (!ticket.seq) {
+        return true;
+    }
+    lock.unlock();
+    bool ok = m_persister->wait(ticket.seq);
+    lock.lock();
+    if (!ok) {
+        SPDLOG_LOGGER_CRITICAL(g_logger, "Node[{}] persist entries up to {} fail", m_id, ticket.index);
+        return false;
+    }
+    onPersisted(ticket);
+    return true;
+}
+
+void RaftNode::onPersisted(const PersistTicket& ticket) {
+    m_durableSeq = std::max(m_durableSeq, ticket.seq);
+    // 等待期间日志可能已经被覆盖
+    if (ticket.index && ticket.index <= m_logs.stabled() && m_logs.term(ticket.index) == ticket.term) {
+        m_logs.persistedTo(ticket.index);
+        m_applyCond.notify_one();
+    }
+}
+
+void RaftNode::persistAsync() {
+    auto ticket = submitPersist();
+    if (!ticket.seq) {
+        return;
+    }
+    go [ticket, this] {
+        std::unique_lock<MutexType> lock(m_mutex);
+        if (waitPersist(lock, ticket) && m_state == Leader) {
+            advanceCommit();
+        }
+    };
 }
 
 void RaftNode::persistStateAndSnapshot(int64_t index, const std::string& snap) {
     std::unique_lock<MutexType> lock(m_mutex);
     auto snapshot = m_logs.createSnapshot(index, snap);
     if (snapshot) {
+        // 快照之前的成员变更日志会被压缩，配置记录在快照中
+        snapshot->metadata.conf = confAt(snapshot->metadata.index);
+        m_snapshotConf = snapshot->metadata.conf;
         // 压缩日志
         m_logs.compact(snapshot->metadata.index);
         SPDLOG_LOGGER_DEBUG(g_logger, "starts to restore snapshot [index: {}, term: {}]",
                             snapshot->metadata.index, snapshot->metadata.term);
-        persist(snapshot);
+        saveSnapshot(lock, snapshot);
     }
 }
 
 void RaftNode::persistSnapshot(Snapshot::ptr snapshot) {
     std::unique_lock<MutexType> lock(m_mutex);
     if (snapshot) {
+        if (snapshot->metadata.conf.empty()) {
+            snapshot->metadata.conf = confAt(snapshot->metadata.index);
+        }
+        m_snapshotConf = snapshot->metadata.conf;
         // 压缩日志
         m_logs.compact(snapshot->metadata.index);
         SPDLOG_LOGGER_DEBUG(g_logger, "starts to restore snapshot [index: {}, term: {}]",
                             snapshot->metadata.index, snapshot->metadata.term);
-        persist(snapshot);
+        saveSnapshot(lock, snapshot);
     }
 }
 
@@ -629,18 +1673,34 @@ std::optional<Entry> RaftNode::propose(const std::string& data) {
     return Propose(data);
 }
 
-std::optional<Entry> RaftNode::Propose(const std::string &data) {
+std::optional<Entry> RaftNode::Propose(const std::string &data, Entry::Type type) {
     if (m_state != Leader) {
         SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] no leader at term {}; dropping proposal", m_id, m_currentTerm);
         return std::nullopt;
     }
+    if (m_leadTransferee != -1) {
+        SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] is transferring leadership to Node[{}] at term {}; dropping proposal",
+                            m_id, m_leadTransferee, m_currentTerm);
+        return std::nullopt;
+    }
+    // 有新的写入，恢复心跳
+    if (m_quiesced) {
+        unquiesce();
+    }
     Entry ent;
     ent.term = m_currentTerm;
     ent.index = m_logs.lastIndex() + 1;
     ent.data = data;
+    ent.type = type;
 
     m_logs.append(ent);
-    broadcastHeartbeat();
+    if (type == Entry::CONF_CHANGE) {
+        // 追加成员变更日志后立即使用新配置，新加入的节点也会收到这条日志
+        reloadConfState();
+    }
+    // 同时发送给 Follower 和写入自己的磁盘
+    broadcastAppend();
+    persistAsync();
     SPDLOG_LOGGER_DEBUG(g_logger, "Node[{}] receives a new log entry[index: {}, term: {}] to replicate in term {}", m_id, ent.index, ent.term, m_currentTerm);
     return ent;
 }
@@ -9,29 +9,46 @@
 #include "../rpc/rpc_server.h"
 #include "raft_log.h"
 #include "raft_peer.h"
+#include "membership.h"
+#include "progress.h"
 #include "snapshot.h"
 
 namespace acid::raft {
+class RaftHost;
 using namespace acid::rpc;
 /**
  * @brief Raft 的状态
  */
 enum RaftState {
-    Follower,   // 追随者
-    Candidate,  // 候选人
-    Leader      // 领导者
+    Follower,       // 追随者
+    PreCandidate,   // 预候选人，预投票阶段，不增加任期
+    Candidate,      // 候选人
+    Leader          // 领导者
+};
+/**
+ * @brief 成员变更的结果
+ */
+enum class ConfChangeResult {
+    Ok,             // 已经追加成员变更日志
+    NotLeader,      // 不是 Leader，或者正在转移领导权
+    Pending,        // 上一个成员变更还没有提交，或者还处于联合共识
+    Invalid,        // 目标节点不满足变更的条件，比如已经是成员、不是 learner、是唯一的 voter
+    NotCaughtUp,    // learner 的日志还没有追上 commit
 };
 
 struct ApplyMsg {
     enum MsgType {
-        ENTRY,      // 日志
-        SNAPSHOT,   // 快照
+        ENTRY,          // 日志
+        SNAPSHOT,       // 快照
+        CONF_CHANGE,    // 成员变更，由 raft 处理，使用者只需要推进 apply 的位置
     };
     ApplyMsg() = default;
-    explicit ApplyMsg(const Entry& ent) : type(ENTRY), data(ent.data), index(ent.index), term(ent.term) {}
+    explicit ApplyMsg(const Entry& ent)
+            : type(ent.type == Entry::CONF_CHANGE ? CONF_CHANGE : ENTRY), data(ent.data), index(ent.index), term(ent.term) {}
     explicit ApplyMsg(const Snapshot& snap) : type(SNAPSHOT), data(snap.data), index(snap.metadata.index), term(snap.metadata.term) {}
     MsgType type = ENTRY;
-    std::string data{};
+    // 和日志共享同一份内容
+    Payload data{};
     int64_t index{};
     int64_t term{};
 
@@ -49,6 +66,7 @@ struct ApplyMsg {
         switch (type) {
             case ENTRY: t = "Entry"; break;
             case SNAPSHOT: t = "Snapshot"; break;
+            case CONF_CHANGE: t = "ConfChange"; break;
             default: t = "Unexpect";
         }
         str = fmt::format("type: {}, index: {}, term: {}, data size: {}", t, index, term, data.size());
@@ -56,6 +74,11 @@ struct ApplyMsg {
     }
 };
 
+/**
+ * @brief 一批达成共识的消息，按日志顺序排列，快照单独成为一批
+ */
+using ApplyBatch = std::vector<ApplyMsg>;
+
 /**
  * @brief Raft 节点，处理 rpc 请求，并改变状态，通过 RaftPeer 调用远端 Raft 节点
  */
@@ -69,26 +92,26 @@ public:
      * @param servers 其他 raft 节点的地址
      * @param id 当前 raft 节点在集群内的唯一标识
      * @param persister raft 保存其持久状态的地方，并且从保存的状态初始化当前节点
-     * @param applyChan 是发送达成共识的日志的 channel
+     * @param applyChan 是发送达成共识的日志的 channel，一次发送一批
+     */
+    RaftNode(std::map<int64_t, std::string>& servers, int64_t id, Persister::ptr persister, co::co_chan<ApplyBatch> applyChan);
+    /**
+     * Create a Raft server hosted by RaftHost
+     * @param host 托管该节点的 RaftHost，节点不单独监听端口，和同一个 RaftHost 中的其他 Raft 组共享 rpc 服务和连接
+     * @param group Raft 组 id
      */
-    RaftNode(std::map<int64_t, std::string>& servers, int64_t id, Persister::ptr persister, co::co_chan<ApplyMsg> applyChan);
+    RaftNode(RaftHost* host, uint64_t group, std::map<int64_t, std::string>& servers, int64_t id, Persister::ptr persister, co::co_chan<ApplyBatch> applyChan);
 
     ~RaftNode();
     /**
      * @brief 启动 raft
+     * @note 独立运行的节点会阻塞在 rpc 服务上直到 stop，托管的节点不阻塞
      */
     void start() override;
     /**
-     * @brief 关闭 raft
+     * @brief 关闭 raft，独立运行的节点同时关闭 rpc 服务
      */
     void stop() override;
-    /**
-     * @brief 增加 raft 节点
-     * @param[in] id raft 节点id
-     * @param[in] address raft 节点地址
-     */
-    void addPeer(int64_t id, Address::ptr address);
-
     bool isLeader();
     /**
      * @brief 获取 raft 节点状态
@@ -99,6 +122,10 @@ public:
      * @brief 获取 leader id
      */
     int64_t getLeaderId() const { return m_leaderId;}
+    /**
+     * @brief 获取 Raft 组 id，单独运行的节点为 0
+     */
+    uint64_t getGroup() const { return m_group;}
     /**
      * @brief 发起一条消息
      * @return 如果该节点不是 Leader 返回 std::nullopt
@@ -113,6 +140,36 @@ public:
         s.reset();
         return Propose(s.toString());
     }
+    /**
+     * @brief 线性一致读（ReadIndex），不经过日志，确认自己仍然是 Leader 后返回读请求可以读取的 commit index
+     * @details 同一时间等待的读请求共享一轮心跳确认，调用者需要等状态机应用到返回的 index 之后再读取
+     * @return 如果该节点不是 Leader 或者没能确认领导地位返回 std::nullopt
+     */
+    std::optional<int64_t> readIndex();
+    /**
+     * @brief 把领导权转移给指定节点，用于下线维护前主动让出领导权
+     * @details 转移期间不接受新的提议，等目标节点的日志追上之后发送 TimeoutNow 让它立即发起选举，
+     * 一个选举超时内没有完成则放弃转移
+     * @param target 目标节点 id
+     * @return 是否已经让出领导权，该节点不是 Leader 或者转移超时返回 false
+     */
+    bool transferLeadership(int64_t target);
+    /**
+     * @brief 添加一个 learner，learner 只接收日志和快照，不参与投票，不影响 commit
+     */
+    ConfChangeResult addLearner(int64_t id, const std::string& address);
+    /**
+     * @brief 把已经追上 commit 的 learner 提升为 voter，通过联合共识完成
+     */
+    ConfChangeResult promoteLearner(int64_t id);
+    /**
+     * @brief 移除一个成员，移除 voter 通过联合共识完成，被移除的 Leader 在新配置提交后退位
+     */
+    ConfChangeResult removeMember(int64_t id);
+    /**
+     * @brief 获取当前的成员配置
+     */
+    ConfState getConfState();
     /**
      * @brief 处理远端 raft 节点的投票请求
      */
@@ -125,6 +182,30 @@ public:
      * @brief 处理远端 raft 节点的快照安装请求
      */
     InstallSnapshotReply handleInstallSnapshot(InstallSnapshotArgs arg);
+    /**
+     * @brief 处理 Leader 转移领导权的请求，立即发起选举
+     */
+    TimeoutNowReply handleTimeoutNow(TimeoutNowArgs request);
+    /**
+     * @brief 处理合并心跳中本组的心跳
+     */
+    HeartbeatReply handleHeartbeat(const HeartbeatArgs& request);
+    /**
+     * @brief 处理合并心跳中本组的响应
+     * @param reply rpc 失败时为 std::nullopt
+     */
+    void handleHeartbeatReply(int64_t peer, const HeartbeatArgs& request, const std::optional<HeartbeatReply>& reply, uint64_t sentMs);
+    /**
+     * @brief 托管的节点由 RaftHost 每个心跳周期调用一次，代替心跳定时器
+     * @details Leader 把日志已经匹配的节点的心跳放入 heartbeats，由 RaftHost 按节点合并发送，
+     * 其他节点仍由复制协程发送。空闲时进入静默，之后不再产生心跳，直到有新的提议
+     * @param heartbeats 远端节点 id 到心跳的映射
+     */
+    void tick(std::map<int64_t, std::vector<HeartbeatArgs>>& heartbeats);
+    /**
+     * @brief 是否处于静默
+     */
+    bool isQuiesced();
     /**
      * @brief 获取节点 id
      */
@@ -154,11 +235,63 @@ public:
     static uint64_t GetRandomizedElectionTimeout();
 private:
     /**
-     * @brief 转化为 Follower
+     * @brief 是否可以进入静默：托管在 RaftHost 中，没有进行中的读、领导权转移和联合共识，
+     * 所有日志都已经提交和落盘，并且所有节点都已经追上
+     */
+    bool canQuiesce();
+    /**
+     * @brief 离开静默，Leader 恢复心跳，Follower 恢复选举计时
+     */
+    void unquiesce();
+    /**
+     * @brief 增加 raft 节点
+     * @param[in] id raft 节点id
+     * @param[in] address raft 节点地址
+     */
+    void addPeer(int64_t id, Address::ptr address);
+    /**
+     * @brief 移除 raft 节点，停止它的复制协程
+     */
+    void removePeer(int64_t id);
+    /**
+     * @brief 使用新的成员配置，连接新加入的节点，断开被移除的节点
+     * @param index 配置所在的日志索引，来自快照或者初始配置时为 0
+     */
+    void applyConfState(const ConfState& conf, int64_t index);
+    /**
+     * @brief 从日志和快照中重新加载最新的成员配置，追加或者覆盖了成员变更日志之后调用
+     */
+    void reloadConfState();
+    /**
+     * @brief 获取不大于 index 的最新的成员配置
+     */
+    ConfState confAt(int64_t index);
+    /**
+     * @brief 是否可以发起新的成员变更，同一时间只能有一个成员变更
+     */
+    ConfChangeResult canChangeConf();
+    /**
+     * @brief 发起成员变更，不加锁
+     */
+    ConfChangeResult proposeConfChange(const ConfState& conf);
+    /**
+     * @brief 成员变更日志提交后，离开联合共识或者让不在新配置中的 Leader 退位
+     */
+    void onConfCommitted();
+    /**
+     * @brief 转化为 Follower，只修改内存中的状态，变化的任期和投票由调用者持久化
      * @param[in] term 任期
      * @param[in] leaderId 任期领导人id，如果还未选举出来默认为-1
      */
     void becomeFollower(int64_t term, int64_t leaderId = -1);
+    /**
+     * @brief 收到更大任期的响应时转化为 Follower，不在 RPC 处理函数中，异步持久化新的任期
+     */
+    void stepDown(int64_t term, int64_t leaderId);
+    /**
+     * @brief 转化为 PreCandidate，不增加任期，不投票给自己
+     */
+    void becomePreCandidate();
     /**
      * @brief 转化为 Candidate
      */
@@ -176,33 +309,137 @@ private:
      */
     void resetHeartbeatTimer();
     /**
-     * @brief 对一个节点发起复制请求
+     * @brief 根据复制进度向一个节点发送日志，复制状态下会在窗口内连续发送多条消息，不等待响应
      * @param peer 对方节点 id
+     * @param heartbeat 是否为心跳，心跳即使没有新日志也会发送一条消息
+     */
+    void sendAppend(int64_t peer, bool heartbeat = false);
+    /**
+     * @brief 向一个节点发送快照，在协程中从快照文件依次读取分块发送，内存占用只和分块大小有关
+     */
+    void sendSnapshot(int64_t peer);
+    /**
+     * @brief 处理 AppendEntries 的响应，响应可能乱序或者过期
+     * @param reply 为空表示 rpc 失败
+     * @param sentMs 请求的发送时间（单调时钟）
+     */
+    void handleAppendEntriesReply(int64_t peer, const AppendEntriesArgs& request, const std::optional<AppendEntriesReply>& reply, uint64_t sentMs);
+    /**
+     * @brief 处理 InstallSnapshot 的响应
+     * @param reply 为空表示 rpc 失败
+     * @param sentMs 请求的发送时间（单调时钟）
+     * @return 是否继续发送下一个分块
+     */
+    bool handleInstallSnapshotReply(int64_t peer, const InstallSnapshotArgs& request, const std::optional<InstallSnapshotReply>& reply, uint64_t sentMs);
+    /**
+     * @brief Leader 是否持有租约，租约内其他节点不会选出新的 Leader，可以不经过网络确认直接读
+     */
+    bool inLease();
+    /**
+     * @brief 根据大多数节点的复制进度推进 commit
+     */
+    void advanceCommit();
+    /**
+     * @brief 发起一轮心跳确认领导地位，确认后唤醒这一轮的所有读请求
+     */
+    void confirmReadIndex();
+    /**
+     * @brief 让还在等待的读请求全部失败
      */
-    void replicateOneRound(int64_t peer);
+    void failPendingReads();
+    /**
+     * @brief 通知目标节点立即发起选举
+     */
+    void sendTimeoutNow(int64_t peer);
+    /**
+     * @brief 结束领导权转移，唤醒等待的调用者
+     * @param ok 是否已经让出领导权
+     */
+    void finishLeaderTransfer(bool ok);
     /**
      * @brief 用来往 applyCh 中 push 提交的日志
      */
     void applier();
     /**
      * @brief 开始选举，发起异步投票
+     * @param preVote 是否为预投票，预投票以 任期 + 1 询问其他节点是否会投票，得到大多数同意后才真正开始选举
+     * @param leaderTransfer 是否为领导权转移发起的选举
      */
-    void startElection();
+    void startElection(bool preVote = false, bool leaderTransfer = false);
+    /**
+     * @brief 在一个选举超时内是否收到过 Leader 的消息，如果是则认为 Leader 还活着
+     */
+    bool leaderAlive();
+    /**
+     * @brief Leader 在一个选举超时内是否收到过大多数节点的响应
+     */
+    bool checkQuorum();
     /**
      * @brief 广播心跳
      */
     void broadcastHeartbeat();
     /**
-     * @brief 持久化，内部调用，不加锁
+     * @brief 向所有节点发送新日志
+     */
+    void broadcastAppend();
+    /**
+     * @brief 唤醒一个节点的复制协程，多次唤醒会被合并
+     * @param peer 对方节点 id
+     * @param heartbeat 是否需要发送心跳
+     */
+    void wakeReplicator(int64_t peer, bool heartbeat = false);
+    /**
+     * @brief 每个节点一个的常驻复制协程，被唤醒后把积攒的新日志一次性发送出去
+     */
+    void replicator(int64_t peer);
+    /**
+     * @brief 一次提交给持久化层的写入
+     */
+    struct PersistTicket {
+        // 持久化层的批次序号，0 表示没有需要写入的内容
+        uint64_t seq = 0;
+        // 写入的最后一条日志，0 表示没有日志
+        int64_t index = 0;
+        int64_t term = 0;
+    };
+    /**
+     * @brief 持久化快照，磁盘 IO 期间释放锁
+     * @param lock 已经加锁的 m_mutex
+     */
+    void saveSnapshot(std::unique_lock<MutexType>& lock, Snapshot::ptr snapshot);
+    /**
+     * @brief 把变化的 HardState 和新日志交给持久化层，不等待落盘，不加锁
+     * @details 只有任期、投票变化或者有新日志时才写入，空闲的心跳不产生磁盘 IO。
+     * 没有新内容但之前提交的批次还没有落盘时返回那个批次，回复 RPC 之前同样需要等待
+     */
+    PersistTicket submitPersist();
+    /**
+     * @brief 释放锁等待写入落盘，落盘后重新加锁并更新已经落盘的日志索引
+     * @param lock 已经加锁的 m_mutex
+     * @return 是否写入成功
+     */
+    bool waitPersist(std::unique_lock<MutexType>& lock, const PersistTicket& ticket);
+    /**
+     * @brief 批次落盘后更新已经落盘的日志索引，不加锁
+     */
+    void onPersisted(const PersistTicket& ticket);
+    /**
+     * @brief Leader 异步持久化新追加的日志，不加锁
+     * @details 日志交给持久化层后立即返回，和发送给 Follower 同时进行，
+     * 落盘后自己的日志才算一票，参与计算 commit index
      */
-    void persist(Snapshot::ptr snap = nullptr);
+    void persistAsync();
     /**
      * @brief 发起一条消息，不加锁
      */
-    std::optional<Entry> Propose(const std::string& data);
+    std::optional<Entry> Propose(const std::string& data, Entry::Type type = Entry::NORMAL);
 
 private:
     MutexType m_mutex;
+    // 托管该节点的 RaftHost，单独运行时为 nullptr
+    RaftHost* m_host = nullptr;
+    // Raft 组 id
+    uint64_t m_group = 0;
     // 节点状态，初始为 Follower
     RaftState m_state = Follower;
     // 该 raft 节点的唯一id
@@ -215,21 +452,52 @@ private:
     int64_t m_votedFor = -1;
     // 日志条目，每个条目包含了用于状态机的命令，以及领导人接收到该条目时的任期（初始索引为1）
     RaftLog m_logs;
-    // 远端的 raft 节点，id 到节点的映射
+    // 远端的 raft 节点，id 到节点的映射，包括 voter 和 learner
     std::map<int64_t, RaftPeer::ptr> m_peers;
-    // 对于每一台服务器，发送到该服务器的下一个日志条目的索引（初始值为领导人最后的日志条目的索引+1）
-    std::map<int64_t, int64_t> m_nextIndex;
-    // 对于每一台服务器，已知的已经复制到该服务器的最高日志条目的索引（初始值为0，单调递增）
-    std::map<int64_t, int64_t> m_matchIndex;
+    // 当前使用的成员配置，追加成员变更日志后立即生效
+    ConfState m_conf;
+    // 当前配置所在的日志索引，0 表示来自快照或者初始配置
+    int64_t m_confIndex = 0;
+    // 快照位置的成员配置，没有快照时为启动时的初始配置
+    ConfState m_snapshotConf;
+    // 是否已经启动，启动后新加入的节点立即开始复制
+    bool m_started = false;
+    // 对于每一台服务器的复制进度，包括发送到该服务器的下一个日志条目的索引（初始值为领导人最后的日志条目的索引+1）
+    // 和已知的已经复制到该服务器的最高日志条目的索引（初始值为0，单调递增）
+    std::map<int64_t, Progress> m_progress;
+    // 唤醒每个节点的复制协程，容量为 1，唤醒前已有信号则直接合并
+    std::map<int64_t, co::co_chan<bool>> m_replicateChans;
+    // 复制协程下一次发送时是否需要发送心跳
+    std::map<int64_t, bool> m_heartbeatPending;
+    // 等待确认领导地位的读请求，确认后通过 channel 返回 read index，-1 表示失败
+    std::vector<co::co_chan<int64_t>> m_pendingReads;
+    // 是否有一轮读确认正在进行
+    bool m_readConfirming = false;
+    // 最近一次收到当前 Leader 消息的时间（单调时钟），租约读模式下在选举超时之内拒绝投票
+    uint64_t m_lastLeaderContact = 0;
+    // 成为 Leader 的时间（单调时钟），上任后的第一个选举超时内不检查大多数节点是否活跃
+    uint64_t m_leaderSince = 0;
+    // 是否处于静默，静默的 Leader 不发送心跳，Follower 不进行选举计时
+    bool m_quiesced = false;
+    // 领导权转移的目标节点，-1 表示没有正在进行的转移，转移期间不接受新的提议
+    int64_t m_leadTransferee = -1;
+    // 等待领导权转移结果的调用者
+    std::vector<co::co_chan<bool>> m_transferWaiters;
     // 选举定时器，超时后节点将转换为候选人发起投票
     CycleTimerTocken m_electionTimer;
     // 心跳定时器，领导者定时发送日志维持心跳，和同步日志
     CycleTimerTocken m_heartbeatTimer;
     // 持久化
     Persister::ptr m_persister;
+    // 最后一次交给持久化层的状态，任期和投票没有变化时不需要再次写入
+    HardState m_hardState{.term = -1, .vote = -1, .commit = 0};
+    // 最后一次交给持久化层的批次序号
+    uint64_t m_submittedSeq = 0;
+    // 已经确认落盘的批次序号
+    uint64_t m_durableSeq = 0;
     co::co_condition_variable m_applyCond;
     // 用来已通过raft达成共识的已提交的提议通知给其它组件的信道。
-    co::co_chan<ApplyMsg> m_applyChan;
+    co::co_chan<ApplyBatch> m_applyChan;
 };
 
 }
@@ -41,7 +41,7 @@ static RaftPeerIniter s_initer;
 }
 
 
-RaftPeer::RaftPeer(int64_t id, Address::ptr address)
+RaftConnection::RaftConnection(int64_t id, Address::ptr address)
         : m_id(id), m_address(std::move(address)) {
     m_client = std::make_shared<rpc::RpcClient>();
     // 关闭心跳
@@ -50,11 +50,16 @@ RaftPeer::RaftPeer(int64_t id, Address::ptr address)
     m_client->setTimeout(s_rpc_timeout);
 }
 
-bool RaftPeer::connect() {
+bool RaftConnection::connect() {
     if (!m_client->isClose()) {
         return true;
     }
+    std::unique_lock<MutexType> lock(m_mutex);
     for (int i = 1; i <= (int)s_connect_retry; ++i) {
+        // 其他协程可能已经重连成功
+        if (!m_client->isClose()) {
+            return true;
+        }
         // 重连 Raft 节点
         m_client->connect(m_address);
         if (!m_client->isClose()) {
@@ -62,55 +67,67 @@ bool RaftPeer::connect() {
         }
         co_sleep(10 * i);
     }
+    SPDLOG_LOGGER_DEBUG(g_logger, "connect Node[{}] {} fail", m_id, m_address->toString());
     return false;
 }
 
-std::optional<RequestVoteReply> RaftPeer::requestVote(const RequestVoteArgs& arg) {
+std::optional<std::vector<HeartbeatReply>> RaftConnection::heartbeat(int64_t from, const std::vector<HeartbeatArgs>& args) {
     if (!connect()) {
         return std::nullopt;
     }
-    rpc::Result<RequestVoteReply> result = m_client->call<RequestVoteReply>(REQUEST_VOTE, arg);
-    if (result.getCode() == rpc::RpcState::RPC_SUCCESS) {
+    rpc::Result<std::vector<HeartbeatReply>> result = m_client->call<std::vector<HeartbeatReply>>(HEARTBEAT, from, args);
+    if (result.getCode() == rpc::RpcState::RPC_SUCCESS && result.getVal().size() == args.size()) {
         return result.getVal();
     }
     if (result.getCode() == rpc::RpcState::RPC_CLOSED) {
-        m_client->close();
+        close();
     }
-    SPDLOG_LOGGER_DEBUG(g_logger, "Rpc call Node[{}] method [ {} ] failed, code is {}, msg is {}, RequestVoteArgs is {}",
-                      m_id, REQUEST_VOTE, result.getCode(), result.getMsg(), arg.toString());
+    SPDLOG_LOGGER_DEBUG(g_logger, "Rpc call Node[{}] method [ {} ] failed, code is {}, msg is {}, heartbeats: {}",
+                        m_id, HEARTBEAT, result.getCode(), result.getMsg(), args.size());
     return std::nullopt;
 }
 
-std::optional<AppendEntriesReply> RaftPeer::appendEntries(const AppendEntriesArgs& arg) {
-    if (!connect()) {
+RaftPeer::RaftPeer(int64_t id, Address::ptr address)
+        : m_id(id), m_connection(std::make_shared<RaftConnection>(id, std::move(address))) {
+}
+
+RaftPeer::RaftPeer(int64_t id, RaftConnection::ptr connection, uint64_t group)
+        : m_id(id), m_connection(std::move(connection)), m_group(group), m_hosted(true) {
+}
+
+template<typename Reply, typename Args>
+std::optional<Reply> RaftPeer::call(const std::string& method, const Args& arg) {
+    if (!m_connection->connect()) {
         return std::nullopt;
     }
-    rpc::Result<AppendEntriesReply> result = m_client->call<AppendEntriesReply>(APPEND_ENTRIES, arg);
+    // 独立运行的节点保持原来的 rpc 签名，只有 RaftHost 托管的组在参数前带上组 id
+    rpc::Result<Reply> result = m_hosted ? m_connection->getClient()->call<Reply>(method, m_group, arg)
+                                         : m_connection->getClient()->call<Reply>(method, arg);
     if (result.getCode() == rpc::RpcState::RPC_SUCCESS) {
         return result.getVal();
     }
     if (result.getCode() == rpc::RpcState::RPC_CLOSED) {
-        m_client->close();
+        m_connection->close();
     }
-    SPDLOG_LOGGER_DEBUG(g_logger, "Rpc call Node[{}] method [ {} ] failed, code is {}, msg is {}",
-                        m_id, APPEND_ENTRIES, result.getCode(), result.getMsg());
+    SPDLOG_LOGGER_DEBUG(g_logger, "Rpc call Node[{}] group {} method [ {} ] failed, code is {}, msg is {}, args is {}",
+                        m_id, m_group, method, result.getCode(), result.getMsg(), arg.toString());
     return std::nullopt;
 }
 
+std::optional<RequestVoteReply> RaftPeer::requestVote(const RequestVoteArgs& arg) {
+    return call<RequestVoteReply>(REQUEST_VOTE, arg);
+}
+
+std::optional<AppendEntriesReply> RaftPeer::appendEntries(const AppendEntriesArgs& arg) {
+    return call<AppendEntriesReply>(APPEND_ENTRIES, arg);
+}
+
 std::optional<InstallSnapshotReply> RaftPeer::installSnapshot(const InstallSnapshotArgs& arg) {
-    if (!connect()) {
-        return std::nullopt;
-    }
-    rpc::Result<InstallSnapshotReply> result = m_client->call<InstallSnapshotReply>(INSTALL_SNAPSHOT, arg);
-    if (result.getCode() == rpc::RpcState::RPC_SUCCESS) {
-        return result.getVal();
-    }
-    if (result.getCode() == rpc::RpcState::RPC_CLOSED) {
-        m_client->close();
-    }
-    SPDLOG_LOGGER_DEBUG(g_logger, "Rpc call Node[{}] method [ {} ] failed, code is {}, msg is {}, InstallSnapshotArgs is {}",
-                      m_id, INSTALL_SNAPSHOT, result.getCode(), result.getMsg(), arg.toString());
-    return std::nullopt;
+    return call<InstallSnapshotReply>(INSTALL_SNAPSHOT, arg);
 }
 
-}
\ No newline at end of file
+std::optional<TimeoutNowReply> RaftPeer::timeoutNow(const TimeoutNowArgs& arg) {
+    return call<TimeoutNowReply>(TIMEOUT_NOW, arg);
+}
+
+}
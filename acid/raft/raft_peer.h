@@ -10,10 +10,13 @@
 namespace acid::raft {
 using namespace acid::rpc;
 
-// constant rpc method name
+// constant rpc method name，所有方法的第一个参数都是 Raft 组 id，用来在 RaftHost 中路由到对应的组
 inline const std::string REQUEST_VOTE = "RaftNode::handleRequestVote";
 inline const std::string APPEND_ENTRIES = "RaftNode::handleAppendEntries";
 inline const std::string INSTALL_SNAPSHOT = "RaftNode::handleInstallSnapshot";
+inline const std::string TIMEOUT_NOW = "RaftNode::handleTimeoutNow";
+// RaftHost 之间的合并心跳，参数是发送方的节点 id 和所有 Raft 组的心跳
+inline const std::string HEARTBEAT = "RaftHost::handleHeartbeat";
 
 /**
  * @brief RequestVote rpc 调用的参数
@@ -23,9 +26,11 @@ struct RequestVoteArgs {
     int64_t candidateId;   // 请求选票的候选人的 ID
     int64_t lastLogIndex;  // 候选人的最后日志条目的索引值
     int64_t lastLogTerm;   // 候选人的最后日志条目的任期号
+    bool preVote;          // 是否为预投票，预投票不会改变投票者的任期和投票
+    bool leaderTransfer;   // 是否为 Leader 主动转移领导权发起的选举，投票者不因为 Leader 还活着而拒绝
     std::string toString() const {
-        std::string str = fmt::format("Term: {}, CandidateId: {}, LastLogIndex: {}, LastLogTerm: {}",
-                                      term, candidateId, lastLogIndex, lastLogTerm);
+        std::string str = fmt::format("Term: {}, CandidateId: {}, LastLogIndex: {}, LastLogTerm: {}, PreVote: {}, LeaderTransfer: {}",
+                                      term, candidateId, lastLogIndex, lastLogTerm, preVote, leaderTransfer);
         return "{" + str + "}";
     }
 };
@@ -80,33 +85,138 @@ struct AppendEntriesReply {
     }
 };
 
+/**
+ * @brief InstallSnapshot rpc 调用的参数，快照文件被切分成多个分块依次发送
+ */
 struct InstallSnapshotArgs {
     int64_t term;               // 领导人的任期号
     int64_t leaderId;           // 领导人的 ID，以便于跟随者重定向请求
-    Snapshot snapshot;          // 快照
+    SnapshotMetadata metadata;  // 快照元数据
+    int64_t offset;             // 分块在快照文件中的偏移
+    std::string data;           // 分块数据，为空时用来询问跟随者已经接收的位置
+    bool done;                  // 是否为最后一个分块
     std::string toString() const {
-        std::string str = fmt::format("Term: {}, LeaderId: {}, Snapshot.Metadata.Index: {}, Snapshot.Metadata.Term: {}",
-                                      term, leaderId, snapshot.metadata.index, snapshot.metadata.term);
+        std::string str = fmt::format("Term: {}, LeaderId: {}, Snapshot.Metadata.Index: {}, Snapshot.Metadata.Term: {}, Offset: {}, Length: {}, Done: {}",
+                                      term, leaderId, metadata.index, metadata.term, offset, data.size(), done);
         return "{" + str + "}";
     }
 };
 
+/**
+ * @brief InstallSnapshot rpc 调用的返回值
+ */
 struct InstallSnapshotReply {
     int64_t term;           // 当前任期号，便于领导人更新自己
     int64_t leaderId;       // 当前任期领导人
+    int64_t offset;         // 期望的下一个分块的偏移，-1 表示不再需要这个快照
+    std::string toString() const {
+        std::string str = fmt::format("Term: {}, LeaderId: {}, Offset: {}", term, leaderId, offset);
+        return "{" + str + "}";
+    }
+};
+
+/**
+ * @brief TimeoutNow rpc 调用的参数，Leader 转移领导权时让目标节点立即发起选举
+ */
+struct TimeoutNowArgs {
+    int64_t term;       // 领导人的任期
+    int64_t leaderId;   // 领导人的 ID
+    std::string toString() const {
+        std::string str = fmt::format("Term: {}, LeaderId: {}", term, leaderId);
+        return "{" + str + "}";
+    }
+};
+
+/**
+ * @brief TimeoutNow rpc 调用的返回值
+ */
+struct TimeoutNowReply {
+    int64_t term;       // 当前任期号，便于领导人更新自己
+    int64_t leaderId;   // 当前任期领导人
     std::string toString() const {
         std::string str = fmt::format("Term: {}, LeaderId: {}", term, leaderId);
         return "{" + str + "}";
     }
 };
 
+/**
+ * @brief 合并心跳中一个 Raft 组的心跳，只在日志已经匹配时代替空的 AppendEntries
+ */
+struct HeartbeatArgs {
+    uint64_t group;     // Raft 组 id
+    int64_t term;       // 领导人的任期
+    int64_t leaderId;   // 领导人的 ID
+    int64_t commit;     // 不超过对方匹配位置的 commit index
+    bool quiesce;       // 是否进入静默，静默后 Leader 不再发送心跳，Follower 停止选举计时
+    std::string toString() const {
+        std::string str = fmt::format("Group: {}, Term: {}, LeaderId: {}, Commit: {}, Quiesce: {}",
+                                      group, term, leaderId, commit, quiesce);
+        return "{" + str + "}";
+    }
+};
+
+/**
+ * @brief 合并心跳中一个 Raft 组的响应
+ */
+struct HeartbeatReply {
+    uint64_t group;     // Raft 组 id
+    int64_t term;       // 当前任期号，0 表示对方没有这个 Raft 组
+    int64_t leaderId;   // 当前任期领导人
+    bool success;       // 是否承认对方为 Leader，要求静默时还表示日志已经追上并进入了静默
+    std::string toString() const {
+        std::string str = fmt::format("Group: {}, Term: {}, LeaderId: {}, Success: {}", group, term, leaderId, success);
+        return "{" + str + "}";
+    }
+};
+
+/**
+ * @brief 到一个远端 Raft 节点的 rpc 连接，同一个进程内的多个 Raft 组可以共享同一个连接
+ * @details rpc 客户端按序列号区分并发的请求，多个组的请求可以在同一个连接上同时进行
+ */
+class RaftConnection {
+public:
+    using ptr = std::shared_ptr<RaftConnection>;
+    using MutexType = co::co_mutex;
+    RaftConnection(int64_t id, Address::ptr address);
+    /**
+     * @brief 连接断开时重连，同一时间只有一个协程在重连
+     */
+    bool connect();
+
+    void close() { m_client->close();}
+
+    rpc::RpcClient::ptr getClient() const { return m_client;}
+
+    Address::ptr getAddress() const { return m_address;}
+    /**
+     * @brief 发送合并心跳
+     * @param from 发送方的节点 id
+     * @param args 所有 Raft 组的心跳，可以为空，只用来表示节点存活
+     * @return 按顺序对应每个心跳的响应，rpc 失败返回 std::nullopt
+     */
+    std::optional<std::vector<HeartbeatReply>> heartbeat(int64_t from, const std::vector<HeartbeatArgs>& args);
+private:
+    MutexType m_mutex;
+    int64_t m_id;
+    rpc::RpcClient::ptr m_client;
+    Address::ptr m_address;
+};
+
 /**
  * @brief RaftNode 通过 RaftPeer 调用远端 Raft 节点，封装了 rpc 请求
  */
 class RaftPeer {
 public:
     using ptr = std::shared_ptr<RaftPeer>;
+    /**
+     * @brief 独占一个连接，调用独立运行的节点，请求不带组 id
+     */
     RaftPeer(int64_t id, Address::ptr address);
+    /**
+     * @param connection 共享的连接
+     * @param group 对方所在的 Raft 组
+     */
+    RaftPeer(int64_t id, RaftConnection::ptr connection, uint64_t group);
 
     std::optional<RequestVoteReply> requestVote(const RequestVoteArgs& arg);
 
@@ -114,15 +224,20 @@ public:
 
     std::optional<InstallSnapshotReply> installSnapshot(const InstallSnapshotArgs& arg);
 
-    Address::ptr getAddress() const { return m_address;}
+    std::optional<TimeoutNowReply> timeoutNow(const TimeoutNowArgs& arg);
+
+    Address::ptr getAddress() const { return m_connection->getAddress();}
 
 private:
-    bool connect();
+    template<typename Reply, typename Args>
+    std::optional<Reply> call(const std::string& method, const Args& arg);
 
 private:
     int64_t m_id;
-    rpc::RpcClient::ptr m_client;
-    Address::ptr m_address;
+    RaftConnection::ptr m_connection;
+    uint64_t m_group = 0;
+    // 对方由 RaftHost 托管，请求带上组 id
+    bool m_hosted = false;
 };
 
 }
@@ -4,11 +4,14 @@
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <cstring>
 #include <fstream>
 #include "snapshot.h"
 
 namespace acid::raft {
 static auto g_logger = GetLogInstance();
+// 快照文件的格式标记，旧版本的快照文件以快照索引开头，索引不会是负数
+static constexpr int64_t s_snap_format = -2;
 
 Snapshotter::Snapshotter(const std::filesystem::path& dir,
                          const std::string& snap_suffix /* = ".snap"*/)
@@ -54,6 +57,107 @@ Snapshot::ptr Snapshotter::loadSnap() {
     return nullptr;
 }
 
+std::optional<SnapshotMetadata> Snapshotter::latestMetadata() {
+    for (auto& name: snapNames()) {
+        SnapshotMetadata metadata{};
+        if (sscanf(name.c_str(), "%016ld-%016ld", &metadata.term, &metadata.index) == 2) {
+            return metadata;
+        }
+    }
+    return std::nullopt;
+}
+
+bool Snapshotter::exists(const SnapshotMetadata& metadata) {
+    return std::filesystem::exists(m_dir / fileName(metadata));
+}
+
+bool Snapshotter::readChunk(const SnapshotMetadata& metadata, int64_t offset, int64_t size, std::string& data, bool& done) {
+    std::ifstream file(m_dir / fileName(metadata), std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    file.seekg(0, file.end);
+    int64_t length = file.tellg();
+    if (offset < 0 || offset > length) {
+        return false;
+    }
+    size = std::min(size, length - offset);
+    data.resize(size);
+    file.seekg(offset, file.beg);
+    file.read(&data[0], size);
+    done = offset + size >= length;
+    return true;
+}
+
+int64_t Snapshotter::receiveChunk(const SnapshotMetadata& metadata, int64_t offset, const std::string& data) {
+    std::filesystem::path tmp = m_dir / (fileName(metadata) + ".tmp");
+    int64_t received = 0;
+    if (std::filesystem::exists(tmp)) {
+        received = std::filesystem::file_size(tmp);
+    } else {
+        // 开始接收新的快照，之前没有接收完的快照已经没用了
+        for (auto& ite: std::filesystem::directory_iterator(m_dir)) {
+            if (ite.path().extension() == ".tmp") {
+                std::filesystem::remove(ite.path());
+            }
+        }
+    }
+    // 分块不连续，让 leader 从已经接收的位置重发
+    if (offset != received || data.empty()) {
+        return received;
+    }
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (fd < 0) {
+        return 0;
+    }
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = write(fd, data.data() + written, data.size() - written);
+        if (n < 0) {
+            close(fd);
+            std::filesystem::remove(tmp);
+            return 0;
+        }
+        written += n;
+    }
+    close(fd);
+    return received + (int64_t)data.size();
+}
+
+Snapshot::ptr Snapshotter::finishReceive(const SnapshotMetadata& metadata) {
+    std::string name = fileName(metadata);
+    std::filesystem::path tmp = m_dir / (name + ".tmp");
+    int fd = open(tmp.c_str(), O_WRONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    if (m_sync && fsync(fd) < 0) {
+        SPDLOG_LOGGER_ERROR(g_logger, "sync received snapshot {} fail, errno: {}, {}", name, errno, strerror(errno));
+        close(fd);
+        std::filesystem::remove(tmp);
+        return nullptr;
+    }
+    close(fd);
+    std::filesystem::rename(tmp, m_dir / name);
+    // 重命名落盘后快照文件才算持久化，否则宕机后快照可能丢失
+    if (!syncDir()) {
+        std::filesystem::remove(m_dir / name);
+        return nullptr;
+    }
+    std::unique_ptr<Snapshot> snapshot;
+    try {
+        snapshot = read(name);
+    } catch (...) {
+        snapshot = nullptr;
+    }
+    if (!snapshot || snapshot->metadata.index != metadata.index || snapshot->metadata.term != metadata.term) {
+        SPDLOG_LOGGER_ERROR(g_logger, "received snapshot {} is corrupted", name);
+        std::filesystem::remove(m_dir / name);
+        return nullptr;
+    }
+    return snapshot;
+}
+
 std::vector<std::string> Snapshotter::snapNames() {
     std::vector<std::string> snaps;
     if (!std::filesystem::exists(m_dir) || !std::filesystem::is_directory(m_dir)) {
@@ -84,11 +188,15 @@ std::vector<std::string> Snapshotter::checkSffix(const std::vector<std::string>&
     return snaps;
 }
 
-bool Snapshotter::save(const Snapshot& snapshot) {
+std::string Snapshotter::fileName(const SnapshotMetadata& metadata) {
     // 快照名格式 %016ld-%016ld%s
     std::unique_ptr<char[]> buff = std::make_unique<char[]>(16 + 1 + 16 + m_snap_suffix.size() + 1);
-    sprintf(&buff[0],"%016ld-%016ld%s", snapshot.metadata.term, snapshot.metadata.index, m_snap_suffix.c_str());
-    std::string filename = m_dir / (&buff[0]);
+    sprintf(&buff[0],"%016ld-%016ld%s", metadata.term, metadata.index, m_snap_suffix.c_str());
+    return &buff[0];
+}
+
+bool Snapshotter::save(const Snapshot& snapshot) {
+    std::string filename = m_dir / fileName(snapshot.metadata);
 
     int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
     if (fd < 0) {
@@ -96,17 +204,38 @@ bool Snapshotter::save(const Snapshot& snapshot) {
     }
 
     rpc::Serializer ser;
-    ser << snapshot;
+    ser << s_snap_format << snapshot;
     ser.reset();
 
     std::string data = ser.toString();
     if (write(fd, data.c_str(), data.size()) < 0) {
+        close(fd);
+        return false;
+    }
+    if (m_sync && fsync(fd) < 0) {
+        SPDLOG_LOGGER_ERROR(g_logger, "sync snapshot {} fail, errno: {}, {}", filename, errno, strerror(errno));
+        close(fd);
         return false;
     }
-    // 持久化，必须马上刷新磁盘
-    fsync(fd);
     close(fd);
-    return true;
+    return syncDir();
+}
+
+bool Snapshotter::syncDir() {
+    if (!m_sync) {
+        return true;
+    }
+    int fd = open(m_dir.c_str(), O_RDONLY);
+    if (fd < 0) {
+        SPDLOG_LOGGER_ERROR(g_logger, "open snapshot dir {} fail, errno: {}, {}", m_dir.string(), errno, strerror(errno));
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    if (!ok) {
+        SPDLOG_LOGGER_ERROR(g_logger, "sync snapshot dir {} fail, errno: {}, {}", m_dir.string(), errno, strerror(errno));
+    }
+    close(fd);
+    return ok;
 }
 
 std::unique_ptr<Snapshot> Snapshotter::read(const std::string& snapname) {
@@ -125,7 +254,20 @@ std::unique_ptr<Snapshot> Snapshotter::read(const std::string& snapname) {
 
     rpc::Serializer ser(data);
     std::unique_ptr<Snapshot> snapshot = std::make_unique<Snapshot>();
-    ser >> (*snapshot);
+    try {
+        int64_t format;
+        ser >> format;
+        if (format == s_snap_format) {
+            ser >> (*snapshot);
+        } else {
+            // 旧版本的快照没有格式标记和成员配置，成员配置从启动参数中恢复
+            snapshot->metadata.index = format;
+            ser >> snapshot->metadata.term >> snapshot->data;
+        }
+    } catch (...) {
+        SPDLOG_LOGGER_ERROR(g_logger, "decode snapshot {} fail", snapname);
+        return nullptr;
+    }
     return snapshot;
 }
-}
\ No newline at end of file
+}
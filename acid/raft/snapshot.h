@@ -6,7 +6,9 @@
 #define ACID_SNAPSHOT_H
 
 #include <filesystem>
+#include <optional>
 #include "../rpc/serializer.h"
+#include "membership.h"
 
 namespace acid::raft {
 
@@ -18,12 +20,14 @@ struct SnapshotMetadata {
     int64_t index;
     // 快照中包含的最后日志条目的任期号
     int64_t term;
+    // 快照位置的成员配置，快照之前的配置日志被压缩后从这里恢复
+    ConfState conf{};
     friend rpc::Serializer& operator<<(rpc::Serializer& s, const SnapshotMetadata& snap) {
-        s << snap.index << snap.term;
+        s << snap.index << snap.term << snap.conf;
         return s;
     }
     friend rpc::Serializer& operator>>(rpc::Serializer& s, SnapshotMetadata& snap) {
-        s >> snap.index >> snap.term;
+        s >> snap.index >> snap.term >> snap.conf;
         return s;
     }
 };
@@ -51,6 +55,7 @@ struct Snapshot {
 
 /**
  * @brief 快照管理器，复制快照的存储和加载
+ * @details 快照文件以格式标记开头，之后是序列化的 Snapshot。没有格式标记的旧版本快照只有索引、任期和数据，读取时成员配置为空
  */
 class Snapshotter {
 public:
@@ -70,6 +75,40 @@ public:
     * @return Snapshot::ptr 如果没有快照则返回nullptr
     */
     Snapshot::ptr loadSnap();
+    /**
+    * @brief 获取最新快照的元数据，不读取快照内容
+    * @return 如果没有快照则返回 std::nullopt
+    */
+    std::optional<SnapshotMetadata> latestMetadata();
+    /**
+    * @brief 快照文件是否已经存在
+    */
+    bool exists(const SnapshotMetadata& metadata);
+    /**
+    * @brief 从快照文件中读取一个分块
+    * @param[in] metadata 快照元数据
+    * @param[in] offset 分块在文件中的偏移
+    * @param[in] size 分块大小的上限
+    * @param[out] data 分块数据
+    * @param[out] done 是否已经读到文件末尾
+    * @return 快照文件不存在或者偏移越界返回 false
+    */
+    bool readChunk(const SnapshotMetadata& metadata, int64_t offset, int64_t size, std::string& data, bool& done);
+    /**
+    * @brief 接收一个分块，追加写入快照的临时文件
+    * @details 临时文件的大小就是已经接收的位置，节点重启或者 leader 重发后可以从这里继续接收
+    * @return 期望的下一个分块的偏移，写入失败返回 0 从头开始接收
+    */
+    int64_t receiveChunk(const SnapshotMetadata& metadata, int64_t offset, const std::string& data);
+    /**
+    * @brief 快照接收完成，临时文件落盘后重命名为快照文件，再刷新目录保证重命名持久化
+    * @return 接收到的快照，失败返回 nullptr
+    */
+    Snapshot::ptr finishReceive(const SnapshotMetadata& metadata);
+    /**
+    * @brief 设置保存快照后是否刷新磁盘，默认刷新
+    */
+    void setSync(bool sync) { m_sync = sync;}
 private:
     /**
     * @brief 按逻辑顺序（最新的快照到旧快照）返回快照列表
@@ -83,6 +122,10 @@ private:
     */
     std::vector<std::string> checkSffix(const std::vector<std::string>& names);
     /**
+    * @brief 快照文件名
+    */
+    std::string fileName(const SnapshotMetadata& metadata);
+    /**
     * @brief 将snapshot序列化后持久化到磁盘
     */
     bool save(const Snapshot& snapshot);
@@ -90,11 +133,17 @@ private:
     * @brief 反序列化成 snapshot
     */
     std::unique_ptr<Snapshot> read(const std::string& snapname);
+    /**
+    * @brief 刷新快照目录，保证文件的创建和重命名持久化
+    */
+    bool syncDir();
 private:
     // 快照目录
     const std::filesystem::path m_dir;
     // 快照文件后缀
     const std::string m_snap_suffix;
+    // 保存快照后是否刷新磁盘
+    bool m_sync = true;
 };
 
 }
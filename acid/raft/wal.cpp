@@ -0,0 +1,460 @@
+//
+// Created by zavier on 2023/2/10.
+//
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <fstream>
+#include "wal.h"
+
+namespace acid::raft {
+static auto g_logger = GetLogInstance();
+
+namespace {
+// 记录头部，length(4) + crc(4)
+constexpr uint32_t HEADER_SIZE = 8;
+
+uint32_t Crc32(const char* data, size_t len) {
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < len; ++i) {
+        crc = table[(crc ^ (uint8_t)data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFF;
+}
+
+std::string SegmentName(uint64_t seq, int64_t index) {
+    // 段名格式 %016lx-%016lx.wal
+    char buff[16 + 1 + 16 + 4 + 1];
+    sprintf(buff, "%016lx-%016lx.wal", seq, index);
+    return buff;
+}
+}
+
+WAL::WAL(const std::filesystem::path& dir, uint64_t segmentSize)
+        : m_dir(dir)
+        , m_segmentSize(segmentSize) {
+    m_hs.vote = -1;
+    if (!std::filesystem::exists(m_dir)) {
+        std::filesystem::create_directories(m_dir);
+    }
+    open();
+}
+
+WAL::~WAL() {
+    if (m_fd >= 0) {
+        sync();
+        close(m_fd);
+    }
+}
+
+void WAL::open() {
+    std::filesystem::directory_iterator dirite(m_dir);
+    for (auto& ite : dirite) {
+        if (ite.status().type() != std::filesystem::file_type::regular) {
+            continue;
+        }
+        Segment seg{};
+        seg.name = ite.path().filename().string();
+        if (sscanf(seg.name.c_str(), "%016lx-%016lx.wal", &seg.seq, &seg.index) != 2) {
+            SPDLOG_LOGGER_WARN(g_logger, "skipped unexpected non wal file {}", seg.name);
+            continue;
+        }
+        m_segments.push_back(seg);
+    }
+    std::sort(m_segments.begin(), m_segments.end(), [](const Segment& a, const Segment& b) {
+        return a.seq < b.seq;
+    });
+
+    uint64_t end = 0;
+    for (auto& seg: m_segments) {
+        end = parse(seg, [&seg, this](RecordType type, rpc::Serializer& s, uint64_t offset, uint32_t length) {
+            switch (type) {
+                case ENTRY: {
+                    Entry ent;
+                    s >> ent;
+                    track(ent.index, ent.term, ent.type, seg.seq, offset, length);
+                    break;
+                }
+                case STATE:
+                    s >> m_hs;
+                    break;
+                case SNAPSHOT:
+                    s >> m_snap;
+                    release(m_snap.index);
+                    break;
+                default:
+                    SPDLOG_LOGGER_WARN(g_logger, "unexpected wal record type {} in {}", (int)type, seg.name);
+            }
+        });
+        if (end < std::filesystem::file_size(m_dir / seg.name) && &seg != &m_segments.back()) {
+            SPDLOG_LOGGER_CRITICAL(g_logger, "wal segment {} is corrupted at offset {}", seg.name, end);
+        }
+    }
+
+    if (m_segments.empty()) {
+        return;
+    }
+    // 截断最后一个段尾部没有写完整的记录
+    auto last = m_dir / m_segments.back().name;
+    if (end < std::filesystem::file_size(last)) {
+        SPDLOG_LOGGER_WARN(g_logger, "truncate torn wal records of {} from offset {}", last.string(), end);
+        std::filesystem::resize_file(last, end);
+    }
+    m_fd = ::open(last.c_str(), O_WRONLY | O_APPEND, 0600);
+    if (m_fd < 0) {
+        SPDLOG_LOGGER_ERROR(g_logger, "open wal segment {} fail", last.string());
+    }
+    m_offset = end;
+}
+
+bool WAL::readAll(HardState& hs, std::vector<Entry>& ents) {
+    if (m_segments.empty()) {
+        return false;
+    }
+    hs = HardState{.term = 0, .vote = -1, .commit = 0};
+    ents.clear();
+    // 第一个为虚拟entry
+    ents.emplace_back();
+    for (auto& seg: m_segments) {
+        parse(seg, [&hs, &ents](RecordType type, rpc::Serializer& s, uint64_t, uint32_t) {
+            if (type == STATE) {
+                s >> hs;
+            } else if (type == SNAPSHOT) {
+                SnapshotMetadata snap{};
+                s >> snap;
+                int64_t offset = ents.front().index;
+                if (snap.index <= offset) {
+                    return;
+                }
+                if (snap.index - offset >= (int64_t)ents.size()) {
+                    ents.clear();
+                    ents.push_back({.index = snap.index, .term = snap.term});
+                } else {
+                    ents.erase(ents.begin(), ents.begin() + (snap.index - offset));
+                    ents.front().data = {};
+                }
+            } else if (type == ENTRY) {
+                Entry ent;
+                s >> ent;
+                int64_t offset = ents.front().index;
+                if (ent.index <= offset) {
+                    return;
+                }
+                if (ent.index - offset > (int64_t)ents.size()) {
+                    // 中间的段已经因为快照被删除，后面必然还有一条快照记录
+                    ents.clear();
+                    ents.push_back({.index = ent.index - 1});
+                } else {
+                    // 冲突的日志，截断
+                    ents.resize(ent.index - offset);
+                }
+                ents.push_back(std::move(ent));
+            }
+        });
+    }
+    return true;
+}
+
+bool WAL::readMeta(HardState& hs, std::vector<Entry>& ents) const {
+    if (m_segments.empty()) {
+        return false;
+    }
+    hs = m_hs;
+    ents.clear();
+    ents.reserve(m_positions.size() + 1);
+    ents.push_back({.index = m_snap.index, .term = m_snap.term});
+    for (auto& pos: m_positions) {
+        ents.push_back({.index = pos.index, .term = pos.term, .type = pos.type});
+    }
+    return true;
+}
+
+bool WAL::read(int64_t lo, int64_t hi, std::vector<Entry>& ents) {
+    ents.clear();
+    if (lo >= hi) {
+        return true;
+    }
+    auto it = std::lower_bound(m_positions.begin(), m_positions.end(), lo, [](const Position& pos, int64_t index) {
+        return pos.index < index;
+    });
+    if (it == m_positions.end() || it->index != lo || it + (hi - lo - 1) >= m_positions.end()
+        || (it + (hi - lo - 1))->index != hi - 1) {
+        SPDLOG_LOGGER_ERROR(g_logger, "entries [{}, {}) are not in wal", lo, hi);
+        return false;
+    }
+    ents.reserve(hi - lo);
+    auto end = it + (hi - lo);
+    while (it != end) {
+        // 同一个段中连续的日志一次读出
+        auto last = it;
+        while (last + 1 != end && (last + 1)->seq == it->seq) {
+            ++last;
+        }
+        const Segment& seg = m_segments[it->seq - m_segments.front().seq];
+        uint64_t begin = it->offset;
+        std::string buf(last->offset + last->length - begin, '\0');
+        int fd = ::open((m_dir / seg.name).c_str(), O_RDONLY);
+        if (fd < 0) {
+            SPDLOG_LOGGER_ERROR(g_logger, "open wal segment {} fail", seg.name);
+            return false;
+        }
+        ssize_t n = pread(fd, buf.data(), buf.size(), (off_t)begin);
+        close(fd);
+        if (n != (ssize_t)buf.size()) {
+            SPDLOG_LOGGER_ERROR(g_logger, "read wal segment {} fail at offset {}", seg.name, begin);
+            return false;
+        }
+        for (; it != last + 1; ++it) {
+            const char* record = &buf[it->offset - begin];
+            uint32_t length, crc;
+            memcpy(&length, record, sizeof(length));
+            memcpy(&crc, record + sizeof(length), sizeof(crc));
+            const char* body = record + HEADER_SIZE;
+            if (HEADER_SIZE + length != it->length || Crc32(body, length) != crc || body[0] != ENTRY) {
+                SPDLOG_LOGGER_ERROR(g_logger, "wal segment {} is corrupted at offset {}", seg.name, it->offset);
+                return false;
+            }
+            rpc::Serializer s(body + 1, (int)length - 1);
+            Entry ent;
+            try {
+                s >> ent;
+            } catch (...) {
+                SPDLOG_LOGGER_ERROR(g_logger, "wal segment {} decode entry fail at offset {}", seg.name, it->offset);
+                return false;
+            }
+            ents.push_back(std::move(ent));
+        }
+    }
+    return true;
+}
+
+void WAL::Batch::add(const HardState* hs, const std::vector<Entry>& ents) {
+    for (auto& ent: ents) {
+        rpc::Serializer s;
+        s << ent;
+        uint32_t length = Encode(m_buf, ENTRY, s);
+        m_records.push_back({.type = ENTRY, .length = length, .index = ent.index, .term = ent.term, .entryType = ent.type});
+    }
+    if (hs) {
+        rpc::Serializer s;
+        s << *hs;
+        uint32_t length = Encode(m_buf, STATE, s);
+        m_records.push_back({.type = STATE, .length = length, .hs = *hs});
+    }
+}
+
+void WAL::Batch::add(const SnapshotMetadata& snap) {
+    rpc::Serializer s;
+    s << snap;
+    uint32_t length = Encode(m_buf, SNAPSHOT, s);
+    m_records.push_back({.type = SNAPSHOT, .length = length, .index = snap.index, .term = snap.term, .snap = snap});
+}
+
+bool WAL::write(const Batch& batch, bool durable) {
+    if (batch.empty()) {
+        return true;
+    }
+    if (m_fd < 0 && !cut(durable)) {
+        return false;
+    }
+    if (!flush(batch.m_buf, durable)) {
+        return false;
+    }
+
+    int64_t snapshot = -1;
+    for (auto& record: batch.m_records) {
+        switch (record.type) {
+            case ENTRY:
+                track(record.index, record.term, record.entryType, m_segments.back().seq, m_offset, record.length);
+                break;
+            case STATE:
+                m_hs = record.hs;
+                break;
+            case SNAPSHOT:
+                m_snap = record.snap;
+                release(record.index);
+                snapshot = record.index;
+                break;
+        }
+        m_offset += record.length;
+    }
+
+    // 快照记录已经写入，删除只包含快照之前日志的段，最后一个段永远保留
+    while (snapshot >= 0 && m_segments.size() > 1 && m_segments[1].index - 1 <= snapshot) {
+        SPDLOG_LOGGER_DEBUG(g_logger, "remove wal segment {} which is covered by snapshot [index: {}, term: {}]",
+                            m_segments.front().name, m_snap.index, m_snap.term);
+        std::filesystem::remove(m_dir / m_segments.front().name);
+        m_segments.pop_front();
+    }
+    // 切段失败时旧段可能没有落盘，不能确认这批记录已经持久化
+    if (m_offset >= m_segmentSize && !cut(durable)) {
+        return false;
+    }
+    return true;
+}
+
+bool WAL::save(const HardState* hs, const std::vector<Entry>& ents) {
+    Batch batch;
+    batch.add(hs, ents);
+    return write(batch);
+}
+
+bool WAL::saveSnapshot(const SnapshotMetadata& snap) {
+    Batch batch;
+    batch.add(snap);
+    return write(batch);
+}
+
+bool WAL::sync() {
+    if (m_fd < 0 || !m_unsynced) {
+        return true;
+    }
+    if (fdatasync(m_fd) < 0) {
+        SPDLOG_LOGGER_ERROR(g_logger, "sync wal fail, errno: {}, {}", errno, strerror(errno));
+        return false;
+    }
+    m_unsynced = false;
+    return true;
+}
+
+uint64_t WAL::parse(const Segment& seg, const std::function<void(RecordType, rpc::Serializer&, uint64_t, uint32_t)>& cb) {
+    std::ifstream in(m_dir / seg.name, std::ios::binary);
+    if (!in.is_open()) {
+        return 0;
+    }
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    uint64_t offset = 0;
+    while (offset + HEADER_SIZE < data.size()) {
+        uint32_t length, crc;
+        memcpy(&length, &data[offset], sizeof(length));
+        memcpy(&crc, &data[offset + sizeof(length)], sizeof(crc));
+        if (length == 0 || offset + HEADER_SIZE + length > data.size()) {
+            break;
+        }
+        const char* body = &data[offset + HEADER_SIZE];
+        if (Crc32(body, length) != crc) {
+            SPDLOG_LOGGER_WARN(g_logger, "wal segment {} crc mismatch at offset {}", seg.name, offset);
+            break;
+        }
+        rpc::Serializer s(body + 1, (int)length - 1);
+        try {
+            cb(static_cast<RecordType>(body[0]), s, offset, HEADER_SIZE + length);
+        } catch (...) {
+            SPDLOG_LOGGER_WARN(g_logger, "wal segment {} decode record fail at offset {}", seg.name, offset);
+            break;
+        }
+        offset += HEADER_SIZE + length;
+    }
+    return offset;
+}
+
+bool WAL::cut(bool durable) {
+    uint64_t seq = m_segments.empty() ? 0 : m_segments.back().seq + 1;
+    int64_t index = m_positions.empty() ? m_snap.index + 1 : m_positions.back().index + 1;
+    Segment seg{.seq = seq, .index = index, .name = SegmentName(seq, index)};
+    // 关闭旧段之前把没有刷新的数据落盘，之后就没有机会了，失败时继续使用旧段
+    if (!sync()) {
+        return false;
+    }
+    int fd = ::open((m_dir / seg.name).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    if (fd < 0) {
+        SPDLOG_LOGGER_ERROR(g_logger, "create wal segment {} fail", seg.name);
+        return false;
+    }
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+    m_fd = fd;
+    m_offset = 0;
+    m_segments.push_back(seg);
+
+    // 新段以快照和状态开头，保证删除旧段后依然能恢复
+    std::string buf;
+    rpc::Serializer snap;
+    snap << m_snap;
+    Encode(buf, SNAPSHOT, snap);
+    rpc::Serializer hs;
+    hs << m_hs;
+    Encode(buf, STATE, hs);
+    if (!flush(buf, durable)) {
+        // 段头没有完整写入，丢弃这个段，下次写入时重新创建
+        close(m_fd);
+        m_fd = -1;
+        std::filesystem::remove(m_dir / seg.name);
+        m_segments.pop_back();
+        return false;
+    }
+    m_offset = buf.size();
+    SPDLOG_LOGGER_DEBUG(g_logger, "cut wal segment {}", seg.name);
+    return true;
+}
+
+bool WAL::flush(const std::string& buf, bool durable) {
+    size_t written = 0;
+    while (written < buf.size()) {
+        ssize_t n = ::write(m_fd, buf.data() + written, buf.size() - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            SPDLOG_LOGGER_ERROR(g_logger, "write wal fail, errno: {}, {}", errno, strerror(errno));
+            return false;
+        }
+        written += n;
+    }
+    m_unsynced = true;
+    if (durable) {
+        // 持久化，必须马上刷新磁盘
+        return sync();
+    }
+    return true;
+}
+
+uint32_t WAL::Encode(std::string& buf, RecordType type, rpc::Serializer& payload) {
+    payload.reset();
+    std::string body;
+    body.push_back(static_cast<char>(type));
+    body += payload.toString();
+    uint32_t length = body.size();
+    uint32_t crc = Crc32(body.data(), body.size());
+    buf.append(reinterpret_cast<const char*>(&length), sizeof(length));
+    buf.append(reinterpret_cast<const char*>(&crc), sizeof(crc));
+    buf += body;
+    return HEADER_SIZE + length;
+}
+
+void WAL::track(int64_t index, int64_t term, Entry::Type type, uint64_t seq, uint64_t offset, uint32_t length) {
+    // 覆盖冲突的日志
+    while (!m_positions.empty() && m_positions.back().index >= index) {
+        m_liveBytes -= m_positions.back().length;
+        m_positions.pop_back();
+    }
+    if (index <= m_snap.index) {
+        return;
+    }
+    m_positions.push_back({.index = index, .term = term, .type = type, .seq = seq, .offset = offset, .length = length});
+    m_liveBytes += length;
+}
+
+void WAL::release(int64_t index) {
+    while (!m_positions.empty() && m_positions.front().index <= index) {
+        m_liveBytes -= m_positions.front().length;
+        m_positions.pop_front();
+    }
+}
+
+}
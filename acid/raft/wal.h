@@ -0,0 +1,214 @@
+//
+// Created by zavier on 2023/2/10.
+//
+
+#ifndef ACID_WAL_H
+#define ACID_WAL_H
+
+#include <atomic>
+#include <deque>
+#include <filesystem>
+#include "../rpc/serializer.h"
+#include "entry.h"
+#include "snapshot.h"
+
+namespace acid::raft {
+// raft节点状态的持久化数据
+struct HardState {
+    // 当前任期
+    int64_t term;
+    // 任期内给谁投过票
+    int64_t vote;
+    // 已经commit的最大index
+    int64_t commit;
+    friend rpc::Serializer& operator<<(rpc::Serializer& s, const HardState& hs) {
+        s << hs.term << hs.vote << hs.commit;
+        return s;
+    }
+    friend rpc::Serializer& operator>>(rpc::Serializer& s, HardState& hs) {
+        s >> hs.term >> hs.vote >> hs.commit;
+        return s;
+    }
+};
+
+/**
+ * @brief 分段、只追加的预写日志（Write-Ahead Log）
+ * @details
+ * 日志目录下有多个段文件，文件名格式为 %016lx-%016lx.wal，分别是段序号和创建该段时下一条日志的索引。
+ * 每条记录的格式为 | length(4) | crc(4) | type(1) | payload |，持久化的开销只和写入的增量有关。
+ * 1. ENTRY 记录一条日志，如果它的 index 不大于已有的最后一条日志，说明发生了冲突，重放时截断之后的日志
+ * 2. STATE 记录 HardState，重放时以最后一条为准
+ * 3. SNAPSHOT 记录快照的元数据，重放时丢弃快照之前的日志
+ * 每个段文件都以 SNAPSHOT 和 STATE 记录开头，所以任意一个后缀的段都能独立恢复出状态，
+ * 快照之后就可以直接删除那些只包含快照之前日志的旧段。
+ */
+class WAL {
+public:
+    enum RecordType : uint8_t {
+        ENTRY = 1,
+        STATE = 2,
+        SNAPSHOT = 3,
+    };
+    /**
+     * @param dir 日志目录
+     * @param segmentSize 段文件大小的上限，超过后切换到新段
+     */
+    WAL(const std::filesystem::path& dir, uint64_t segmentSize);
+
+    ~WAL();
+    /**
+     * @brief 目录下是否已经存在日志
+     */
+    bool exist() const { return !m_segments.empty();}
+    /**
+     * @brief 从磁盘读取日志
+     * @param[out] hs 最后一次保存的 HardState
+     * @param[out] ents 日志，第一条为快照位置的虚拟日志
+     * @return 是否存在日志
+     */
+    bool readAll(HardState& hs, std::vector<Entry>& ents);
+    /**
+     * @brief 获取 HardState 和日志的索引、任期，不读取日志内容，不涉及磁盘 IO
+     * @param[out] hs 最后一次保存的 HardState
+     * @param[out] ents 日志，data 为空，第一条为快照位置的虚拟日志
+     * @return 是否存在日志
+     */
+    bool readMeta(HardState& hs, std::vector<Entry>& ents) const;
+    /**
+     * @brief 获取最后一次记录的快照元数据
+     */
+    const SnapshotMetadata& snapshot() const { return m_snap;}
+    /**
+     * @brief 从磁盘读取 [lo, hi) 的日志
+     * @return 日志不在 WAL 中或者读取失败返回 false
+     */
+    bool read(int64_t lo, int64_t hi, std::vector<Entry>& ents);
+    /**
+     * @brief 一批待写入的记录，编码在内存中完成，不涉及磁盘 IO
+     */
+    class Batch {
+    public:
+        /**
+         * @brief 追加 HardState 和日志
+         * @param hs 为空则不写 HardState
+         * @param ents 需要追加的日志，如果与已写入的日志重叠则覆盖
+         */
+        void add(const HardState* hs, const std::vector<Entry>& ents);
+        /**
+         * @brief 追加快照记录
+         */
+        void add(const SnapshotMetadata& snap);
+
+        bool empty() const { return m_records.empty();}
+    private:
+        friend class WAL;
+        // 记录的元数据，写入后用于更新索引和状态
+        struct Record {
+            RecordType type;
+            uint32_t length;
+            // ENTRY 和 SNAPSHOT 记录的 index 和 term
+            int64_t index;
+            int64_t term;
+            // STATE 记录的状态
+            HardState hs;
+            // ENTRY 记录的日志类型
+            Entry::Type entryType;
+            // SNAPSHOT 记录的元数据
+            SnapshotMetadata snap;
+        };
+        std::string m_buf;
+        std::vector<Record> m_records;
+    };
+    /**
+     * @brief 写入一批记录，如果其中有快照记录，写入后删除只包含快照之前日志的旧段
+     * @param batch 记录
+     * @param durable 是否刷新磁盘
+     */
+    bool write(const Batch& batch, bool durable = true);
+    /**
+     * @brief 追加 HardState 和日志并刷新磁盘
+     */
+    bool save(const HardState* hs, const std::vector<Entry>& ents);
+    /**
+     * @brief 记录快照并刷新磁盘
+     */
+    bool saveSnapshot(const SnapshotMetadata& snap);
+    /**
+     * @brief 将已经写入但还未刷新的数据刷新到磁盘
+     */
+    bool sync();
+    /**
+     * @brief 获取快照之后的有效数据大小，不需要加锁
+     */
+    int64_t size() const { return m_liveBytes;}
+private:
+    // 段文件
+    struct Segment {
+        uint64_t seq;
+        // 创建该段时下一条日志的索引
+        int64_t index;
+        std::string name;
+    };
+    // 日志在段文件中的位置
+    struct Position {
+        int64_t index;
+        int64_t term;
+        Entry::Type type;
+        uint64_t seq;
+        uint64_t offset;
+        uint32_t length;
+    };
+    /**
+     * @brief 打开日志目录，修复尾部损坏的记录，并建立日志位置索引
+     */
+    void open();
+    /**
+     * @brief 解析一个段文件
+     * @param seg 段文件
+     * @param cb 每解析出一条记录回调一次，参数为记录类型，记录内容，记录在文件中的偏移和长度
+     * @return 最后一条完整记录结束的偏移
+     */
+    uint64_t parse(const Segment& seg, const std::function<void(RecordType, rpc::Serializer&, uint64_t, uint32_t)>& cb);
+    /**
+     * @brief 创建一个新的段，并写入当前的快照和状态
+     * @return 旧段落盘失败或新段写入失败时返回 false
+     */
+    bool cut(bool durable);
+    /**
+     * @brief 写入当前段
+     * @param durable 是否刷新磁盘
+     */
+    bool flush(const std::string& buf, bool durable);
+    /**
+     * @brief 将一条记录编码到 buf 中
+     * @return 记录的长度
+     */
+    static uint32_t Encode(std::string& buf, RecordType type, rpc::Serializer& payload);
+    /**
+     * @brief 记录写入后更新日志位置索引
+     */
+    void track(int64_t index, int64_t term, Entry::Type type, uint64_t seq, uint64_t offset, uint32_t length);
+    /**
+     * @brief 丢弃快照之前的日志位置索引
+     */
+    void release(int64_t index);
+private:
+    const std::filesystem::path m_dir;
+    const uint64_t m_segmentSize;
+    std::deque<Segment> m_segments;
+    // 当前段的文件描述符和写入偏移
+    int m_fd = -1;
+    uint64_t m_offset = 0;
+    // 当前段是否有还未刷新到磁盘的数据
+    bool m_unsynced = false;
+    // 最后一次写入的状态，新段的开头会重新写入
+    HardState m_hs{};
+    SnapshotMetadata m_snap{};
+    // 快照之后的日志位置
+    std::deque<Position> m_positions;
+    // 快照之后的日志所占的字节数
+    std::atomic<int64_t> m_liveBytes = 0;
+};
+
+}
+#endif //ACID_WAL_H
@@ -0,0 +1,132 @@
+//
+// Created by zavier on 2023/2/22.
+//
+
+#include "acid/common/config.h"
+#include "acid/kvraft/kvserver.h"
+
+using namespace acid;
+using namespace rpc;
+using namespace kvraft;
+
+std::map<int64_t, std::string> peers = {
+        {1, "localhost:7191"},
+};
+
+// 按顺序并发提交，每个命令间隔一小段时间保证进入批量的顺序，全部落在同一条日志中
+std::vector<CommandResponse> submitInOrder(const std::vector<std::function<CommandResponse()>>& commands) {
+    std::vector<CommandResponse> responses(commands.size());
+    co::co_chan<bool> done(commands.size());
+    for (size_t i = 0; i < commands.size(); ++i) {
+        go [i, &commands, &responses, done] {
+            responses[i] = commands[i]();
+            done << true;
+        };
+        co_sleep(5);
+    }
+    bool ok;
+    for (size_t i = 0; i < commands.size(); ++i) {
+        done >> ok;
+    }
+    return responses;
+}
+
+// 同一批中重复的命令只应用一次，重复的命令得到第一次执行的响应
+void test_duplicate_in_batch(KVServer& server) {
+    CommandRequest request{.operation = APPEND, .key = "dup", .value = "x", .clientId = 1, .commandId = 1};
+    auto append = [&server, request] { return server.handleCommand(request); };
+    auto responses = submitInOrder({append, append, append});
+    for (auto& response: responses) {
+        if (response.error != OK) {
+            SPDLOG_ERROR("duplicate in batch: {}", response.toString());
+            return;
+        }
+    }
+    auto value = server.Get("dup").value;
+    if (value != "x") {
+        SPDLOG_ERROR("duplicate in batch: appended {} times", value.size());
+        return;
+    }
+    SPDLOG_INFO("duplicate in batch: 3 copies applied once");
+}
+
+// MULTI_PUT 是屏障，前面的单 key 写入先生效，后面的单 key 写入后生效，即使它们在不同的分区
+void test_multi_put_barrier(KVServer& server) {
+    auto responses = submitInOrder({
+        [&server] { return server.Put("barrier-a", "1"); },
+        [&server] { return server.MultiPut({{"barrier-a", "2"}, {"barrier-b", "2"}}); },
+        [&server] { return server.Put("barrier-b", "3"); },
+    });
+    for (auto& response: responses) {
+        if (response.error != OK) {
+            SPDLOG_ERROR("multi put barrier: {}", response.toString());
+            return;
+        }
+    }
+    auto a = server.Get("barrier-a").value;
+    auto b = server.Get("barrier-b").value;
+    if (a != "2" || b != "3") {
+        SPDLOG_ERROR("multi put barrier: barrier-a = {}, barrier-b = {}", a, b);
+        return;
+    }
+    SPDLOG_INFO("multi put barrier: writes around MULTI_PUT applied in log order");
+}
+
+// 一批写入分散在所有分区，写入返回之后的读一定能看到，lastApplied 不会越过没有应用完的分区
+void test_last_applied(KVServer& server) {
+    std::vector<std::function<CommandResponse()>> commands;
+    for (int i = 0; i < 32; ++i) {
+        commands.emplace_back([&server, i] {
+            auto key = fmt::format("applied-{}", i);
+            auto response = server.Put(key, std::to_string(i));
+            if (response.error != OK) {
+                return response;
+            }
+            return server.Get(key);
+        });
+    }
+    auto responses = submitInOrder(commands);
+    for (int i = 0; i < 32; ++i) {
+        if (responses[i].error != OK || responses[i].value != std::to_string(i)) {
+            SPDLOG_ERROR("last applied: applied-{} read {}", i, responses[i].toString());
+            return;
+        }
+    }
+    std::vector<std::string> keys;
+    for (int i = 0; i < 32; ++i) {
+        keys.push_back(fmt::format("applied-{}", i));
+    }
+    auto results = Unpack<std::vector<KeyResult>>(server.MultiGet(keys).value);
+    for (int i = 0; i < 32; ++i) {
+        if (results.size() != keys.size() || results[i].value != std::to_string(i)) {
+            SPDLOG_ERROR("last applied: multi get after the batch missed applied-{}", i);
+            return;
+        }
+    }
+    SPDLOG_INFO("last applied: 32 writes across partitions visible to reads");
+}
+
+void Main() {
+    std::filesystem::remove_all("kv-apply");
+    Config::Lookup<uint32_t>("kvraft.apply.workers")->setValue(4);
+    // 攒批的时间足够长，一组命令进入同一条日志
+    Config::Lookup<uint64_t>("kvraft.batch.linger")->setValue(100);
+    Persister::ptr persister = std::make_shared<Persister>("kv-apply");
+    KVServer server(peers, 1, persister, -1);
+    go [&server] {
+        server.start();
+    };
+    while (server.Get("").error == WRONG_LEADER) {
+        sleep(1);
+    }
+    test_duplicate_in_batch(server);
+    test_multi_put_barrier(server);
+    test_last_applied(server);
+    // 调度器不会自己退出
+    exit(EXIT_SUCCESS);
+}
+
+int main() {
+    go Main;
+    co_sched.Start();
+}
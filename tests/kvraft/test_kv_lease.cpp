@@ -0,0 +1,145 @@
+//
+// Created by zavier on 2023/2/20.
+//
+
+#include "acid/common/config.h"
+#include "acid/kvraft/kvserver.h"
+
+using namespace acid;
+using namespace rpc;
+using namespace kvraft;
+
+// 单节点集群，启动后自己成为 Leader
+std::map<int64_t, std::string> peers1 = {
+        {1, "localhost:7121"},
+};
+std::map<int64_t, std::string> peers2 = {
+        {1, "localhost:7122"},
+};
+
+void waitLeader(KVServer& server) {
+    while (server.Get("").error == WRONG_LEADER) {
+        sleep(1);
+    }
+}
+
+bool exists(KVServer& server, const std::string& key) {
+    return server.Get(key).error == OK;
+}
+
+int64_t grant(KVServer& server, int64_t ttl) {
+    auto response = server.LeaseGrant(ttl);
+    if (response.error != OK) {
+        return 0;
+    }
+    return Unpack<Lease>(response.value).id;
+}
+
+// 续约期间租约不会过期，停止续约后绑定的 key 被删除，不带租约的 Put 解除绑定
+void test_expire(KVServer& server) {
+    int64_t lease = grant(server, 1000);
+    server.Put("a", "1", lease);
+    server.Put("b", "1", lease);
+    server.Put("c", "1", lease);
+    // 重新写入不带租约，不再随租约删除
+    server.Put("c", "2");
+    for (int i = 0; i < 4; ++i) {
+        co_sleep(500);
+        if (server.LeaseKeepAlive(lease).error != OK) {
+            SPDLOG_ERROR("expire: keepalive fail");
+            return;
+        }
+    }
+    if (!exists(server, "a") || !exists(server, "b")) {
+        SPDLOG_ERROR("expire: lease expired while keeping alive");
+        return;
+    }
+    co_sleep(2000);
+    if (exists(server, "a") || exists(server, "b") || !exists(server, "c")) {
+        SPDLOG_ERROR("expire: a {} b {} c {}", exists(server, "a"), exists(server, "b"), exists(server, "c"));
+        return;
+    }
+    if (server.LeaseKeepAlive(lease).error != NO_LEASE || server.Put("d", "1", lease).error != NO_LEASE) {
+        SPDLOG_ERROR("expire: expired lease still usable");
+        return;
+    }
+    SPDLOG_INFO("expire: lease {} expired, rebound key c kept", lease);
+}
+
+// 撤销租约时删除绑定的 key，重复撤销返回 NO_LEASE
+void test_revoke(KVServer& server) {
+    int64_t lease = grant(server, 60000);
+    server.Put("e", "1", lease);
+    if (server.LeaseRevoke(lease).error != OK || exists(server, "e")) {
+        SPDLOG_ERROR("revoke: key e not deleted");
+        return;
+    }
+    if (server.LeaseRevoke(lease).error != NO_LEASE || server.LeaseGrant(0).error != BAD_REQUEST) {
+        SPDLOG_ERROR("revoke: revoked lease still exists");
+        return;
+    }
+    SPDLOG_INFO("revoke: lease {} revoked", lease);
+}
+
+// 租约表、最后分配的租约 id 和 key 的绑定都保存在快照中
+void test_snapshot() {
+    std::string dir = "kv-lease";
+    std::filesystem::remove_all(dir);
+    int64_t lease;
+    {
+        Persister::ptr persister = std::make_shared<Persister>(dir);
+        // 每次应用日志之后都做快照
+        KVServer server(peers1, 1, persister, 1);
+        go [&server] {
+            server.start();
+        };
+        waitLeader(server);
+        test_expire(server);
+        test_revoke(server);
+        lease = grant(server, 60000);
+        server.Put("f", "1", lease);
+        server.Put("g", "1", lease);
+        server.Put("g", "2");
+        // 等待后台的快照落盘
+        sleep(2);
+        if (!persister->loadSnapshot()) {
+            SPDLOG_ERROR("snapshot: no snapshot");
+            return;
+        }
+        server.stop();
+    }
+    Persister::ptr persister = std::make_shared<Persister>(dir);
+    KVServer server(peers2, 1, persister, -1);
+    go [&server] {
+        server.start();
+    };
+    waitLeader(server);
+    if (server.LeaseKeepAlive(lease).error != OK) {
+        SPDLOG_ERROR("snapshot: lease {} lost", lease);
+        return;
+    }
+    // 租约 id 不会重复分配
+    int64_t next = grant(server, 60000);
+    if (next != lease + 1) {
+        SPDLOG_ERROR("snapshot: granted lease {} after {}", next, lease);
+        return;
+    }
+    server.LeaseRevoke(lease);
+    if (exists(server, "f") || !exists(server, "g")) {
+        SPDLOG_ERROR("snapshot: bindings not restored, f {} g {}", exists(server, "f"), exists(server, "g"));
+        return;
+    }
+    SPDLOG_INFO("snapshot: lease {} restored, next lease {}", lease, next);
+}
+
+void Main() {
+    Config::Lookup<uint64_t>("kvraft.lease.check_interval")->setValue(100);
+    test_snapshot();
+    // 调度器不会自己退出
+    exit(EXIT_SUCCESS);
+}
+
+int main() {
+    go Main;
+    co_sched.Start();
+}
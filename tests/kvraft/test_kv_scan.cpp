@@ -0,0 +1,130 @@
+//
+// Created by zavier on 2023/2/18.
+//
+
+#include "acid/common/config.h"
+#include "acid/kvraft/kvserver.h"
+
+using namespace acid;
+using namespace rpc;
+using namespace kvraft;
+
+std::map<int64_t, std::string> peers = {
+        {1, "localhost:7111"},
+};
+
+// 前缀的上界，末尾的 0xff 向前进位，全是 0xff 时没有上界
+void test_prefix_end() {
+    std::vector<std::pair<std::string, std::string>> cases = {
+            {"", ""},
+            {"ab", "ac"},
+            {"a\xff", "b"},
+            {"a\xff\xff", "b"},
+            {"\xff\xff", ""},
+    };
+    for (auto& [prefix, end]: cases) {
+        if (PrefixEnd(prefix) != end) {
+            SPDLOG_ERROR("prefix end: prefix size {} got size {}", prefix.size(), PrefixEnd(prefix).size());
+            return;
+        }
+    }
+    SPDLOG_INFO("prefix end: {} cases", cases.size());
+}
+
+// 冻结期间的扫描合并基础数据和增量层，删除的 key 不返回
+void test_frozen_scan() {
+    KVStore store;
+    for (int i = 0; i < 10; ++i) {
+        store.put(fmt::format("k{}", i), "base");
+    }
+    auto view = store.freeze();
+    store.erase("k1");
+    store.put("k3", "delta");
+    store.put("k35", "delta");
+    store.erase("k9");
+    auto kvs = store.scan("k1", "k5", 3);
+    std::vector<std::pair<std::string, std::string>> expect = {{"k2", "base"}, {"k3", "delta"}, {"k35", "delta"}};
+    if (kvs != expect) {
+        SPDLOG_ERROR("frozen scan: {} kvs", kvs.size());
+        return;
+    }
+    kvs = store.scan("k8", "", 10);
+    if (kvs.size() != 1 || kvs[0].first != "k8") {
+        SPDLOG_ERROR("frozen scan: deleted key k9 returned");
+        return;
+    }
+    SPDLOG_INFO("frozen scan: {} {} {}", expect[0].first, expect[1].first, expect[2].first);
+}
+
+// 分页扫描一个前缀，多个分区的结果有序，没有重复和遗漏，期间的写入和快照不影响分页
+void test_paging() {
+    std::filesystem::remove_all("kv-scan");
+    Config::Lookup<uint32_t>("kvraft.apply.workers")->setValue(4);
+    Persister::ptr persister = std::make_shared<Persister>("kv-scan");
+    // 每次应用日志之后都做快照，扫描时经常有冻结的增量层
+    KVServer server(peers, 1, persister, 1);
+    go [&server] {
+        server.start();
+    };
+    while (server.Get("").error == WRONG_LEADER) {
+        sleep(1);
+    }
+    std::vector<std::pair<std::string, std::string>> kvs;
+    for (int i = 0; i < 100; ++i) {
+        kvs.emplace_back(fmt::format("user:{:03}", i), "v");
+    }
+    // 前缀之外的相邻 key 不应该被扫描到
+    kvs.emplace_back("user", "v");
+    kvs.emplace_back("user;", "v");
+    server.MultiPut(kvs);
+
+    int64_t limit = 7;
+    int pages = 0;
+    std::vector<std::string> keys;
+    std::string token;
+    do {
+        // 分页期间覆盖已有的 key，触发快照
+        server.Put(fmt::format("user:{:03}", pages * 3), "w");
+        auto response = server.PrefixScan("user:", limit, token);
+        if (response.error != OK || (int64_t)response.kvs.size() > limit) {
+            SPDLOG_ERROR("paging: page {} error {} size {}", pages, toString(response.error), response.kvs.size());
+            return;
+        }
+        // 续传 token 是下一页的第一个 key
+        if (!response.next.empty() && response.next <= response.kvs.back().first) {
+            SPDLOG_ERROR("paging: token {} is not after {}", response.next, response.kvs.back().first);
+            return;
+        }
+        for (auto& kv: response.kvs) {
+            keys.push_back(kv.first);
+        }
+        token = response.next;
+        ++pages;
+    } while (!token.empty());
+    if (keys.size() != 100 || !std::is_sorted(keys.begin(), keys.end())
+        || std::adjacent_find(keys.begin(), keys.end()) != keys.end()) {
+        SPDLOG_ERROR("paging: {} keys in {} pages", keys.size(), pages);
+        return;
+    }
+    // 限制正好等于剩余数量时，多取的一个确定没有下一页
+    auto response = server.PrefixScan("user:09", 10);
+    if (response.kvs.size() != 10 || !response.next.empty()) {
+        SPDLOG_ERROR("paging: exact page returned token {}", response.next);
+        return;
+    }
+    SPDLOG_INFO("paging: {} keys in {} pages", keys.size(), pages);
+    server.stop();
+}
+
+void Main() {
+    test_prefix_end();
+    test_frozen_scan();
+    test_paging();
+    // 调度器不会自己退出
+    exit(EXIT_SUCCESS);
+}
+
+int main() {
+    go Main;
+    co_sched.Start();
+}
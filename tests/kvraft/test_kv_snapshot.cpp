@@ -0,0 +1,124 @@
+//
+// Created by zavier on 2023/2/19.
+//
+
+#include "acid/kvraft/kvserver.h"
+
+using namespace acid;
+using namespace rpc;
+using namespace kvraft;
+
+// 单节点集群，启动后自己成为 Leader
+std::map<int64_t, std::string> peers1 = {
+        {1, "localhost:7101"},
+};
+std::map<int64_t, std::string> peers2 = {
+        {1, "localhost:7102"},
+};
+
+void waitLeader(KVServer& server) {
+    while (server.Get("").error == WRONG_LEADER) {
+        sleep(1);
+    }
+}
+
+std::vector<int64_t> versionsOf(KVServer& server, const std::vector<std::string>& keys) {
+    std::vector<int64_t> versions;
+    for (auto& result: Unpack<std::vector<KeyResult>>(server.MultiGet(keys).value)) {
+        versions.push_back(result.version);
+    }
+    return versions;
+}
+
+// 没有版本号和租约的旧快照，所有 key 的版本号恢复为 1
+void test_legacy_snapshot() {
+    std::string dir = "kv-snapshot-legacy";
+    std::filesystem::remove_all(dir);
+    Persister::ptr persister = std::make_shared<Persister>(dir);
+    Serializer s;
+    s << KVStore::KVMap{{"a", "1"}, {"b", "2"}} << std::map<int64_t, std::pair<int64_t, CommandResponse>>{};
+    s.reset();
+    Snapshot::ptr snap = std::make_shared<Snapshot>();
+    snap->metadata.index = 1;
+    snap->metadata.term = 1;
+    snap->data = s.toString();
+    persister->persist({1, -1, 1}, {}, snap);
+
+    KVServer server(peers1, 1, persister, -1);
+    go [&server] {
+        server.start();
+    };
+    waitLeader(server);
+    auto data = server.getData();
+    auto versions = versionsOf(server, {"a", "b"});
+    if (data != KVStore::KVMap{{"a", "1"}, {"b", "2"}} || versions != std::vector<int64_t>{1, 1}) {
+        SPDLOG_ERROR("legacy snapshot: {} keys, versions {}", data.size(), fmt::join(versions, ","));
+        return;
+    }
+    server.Put("a", "x");
+    if (versionsOf(server, {"a"}).front() != 2) {
+        SPDLOG_ERROR("legacy snapshot: write after restore has version {}", versionsOf(server, {"a"}).front());
+        return;
+    }
+    SPDLOG_INFO("legacy snapshot: {} keys restored with version 1", data.size());
+}
+
+// 快照保存后重启，数据和版本号都恢复
+void test_round_trip() {
+    std::string dir = "kv-snapshot";
+    std::filesystem::remove_all(dir);
+    std::vector<std::string> keys = {"a", "b", "c", "d"};
+    KVStore::KVMap data;
+    std::vector<int64_t> versions;
+    {
+        Persister::ptr persister = std::make_shared<Persister>(dir);
+        // 每次应用日志之后都做快照
+        KVServer server(peers1, 1, persister, 1);
+        go [&server] {
+            server.start();
+        };
+        waitLeader(server);
+        server.Put("a", "1");
+        server.Put("a", "2");
+        server.Append("a", "3");
+        server.Put("b", "1");
+        server.Delete("b");
+        server.Put("b", "2");
+        server.MultiPut({{"c", "1"}, {"d", "1"}});
+        server.Delete("d");
+        // 等待后台的快照落盘
+        sleep(2);
+        data = server.getData();
+        versions = versionsOf(server, keys);
+        if (!persister->loadSnapshot()) {
+            SPDLOG_ERROR("round trip: no snapshot");
+            return;
+        }
+        server.stop();
+    }
+    Persister::ptr persister = std::make_shared<Persister>(dir);
+    KVServer server(peers2, 1, persister, -1);
+    go [&server] {
+        server.start();
+    };
+    waitLeader(server);
+    auto restored = server.getData();
+    auto restoredVersions = versionsOf(server, keys);
+    if (restored != data || restoredVersions != versions || versions != std::vector<int64_t>{3, 1, 1, 0}) {
+        SPDLOG_ERROR("round trip: versions {} restored {}", fmt::join(versions, ","), fmt::join(restoredVersions, ","));
+        return;
+    }
+    SPDLOG_INFO("round trip: {} keys, versions {}", restored.size(), fmt::join(restoredVersions, ","));
+}
+
+void Main() {
+    test_legacy_snapshot();
+    test_round_trip();
+    // 调度器不会自己退出
+    exit(EXIT_SUCCESS);
+}
+
+int main() {
+    go Main;
+    co_sched.Start();
+}
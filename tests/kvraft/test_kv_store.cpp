@@ -0,0 +1,131 @@
+//
+// Created by zavier on 2023/2/18.
+//
+
+#include "acid/kvraft/kv_store.h"
+#include "acid/common/util.h"
+
+using namespace acid::kvraft;
+
+// 冻结期间的写入对 get 和 scan 可见，对冻结的视图不可见
+void test_frozen_write() {
+    KVStore store;
+    store.put("a", "1");
+    store.put("b", "2");
+    auto view = store.freeze();
+    store.put("a", "x");
+    store.put("c", "3");
+    store.erase("b");
+    if (!store.get("a") || *store.get("a") != "x" || !store.get("c") || store.get("b")) {
+        SPDLOG_ERROR("frozen write: get does not see the delta");
+        return;
+    }
+    auto kvs = store.scan("", "", 10);
+    if (kvs.size() != 2 || kvs[0] != std::pair<std::string, std::string>{"a", "x"} || kvs[1].first != "c") {
+        SPDLOG_ERROR("frozen write: scan does not see the delta");
+        return;
+    }
+    if (view.data->size() != 2 || view.data->at("a") != "1" || view.data->at("b") != "2" || view.data->count("c")) {
+        SPDLOG_ERROR("frozen write: view changed");
+        return;
+    }
+    // 冻结期间再次冻结返回空的视图
+    if (store.freeze().data) {
+        SPDLOG_ERROR("frozen write: freeze twice");
+        return;
+    }
+    SPDLOG_INFO("frozen write: view a={} b={}, store a={}", view.data->at("a"), view.data->at("b"), *store.get("a"));
+}
+
+// 结束冻结后合并增量，包括删除和清空
+void test_thaw() {
+    KVStore store;
+    store.put("a", "1");
+    store.put("b", "2");
+    store.put("c", "3");
+    auto view = store.freeze();
+    store.erase("a");
+    store.append("b", "x");
+    store.put("d", "4");
+    view = {};
+    store.thaw();
+    auto data = store.dump();
+    if (store.frozen() || data != KVStore::KVMap{{"b", "2x"}, {"c", "3"}, {"d", "4"}}) {
+        SPDLOG_ERROR("thaw: delete tombstone not merged, {} keys", data.size());
+        return;
+    }
+    // 清空之后基础数据全部失效，只保留清空之后的写入
+    view = store.freeze();
+    store.clear();
+    store.put("e", "5");
+    store.erase("e");
+    store.put("f", "6");
+    if (store.get("b") || store.scan("", "", 10).size() != 1) {
+        SPDLOG_ERROR("thaw: clear not visible while frozen");
+        return;
+    }
+    if (view.data->size() != 3) {
+        SPDLOG_ERROR("thaw: clear changed the view");
+        return;
+    }
+    view = {};
+    store.thaw();
+    data = store.dump();
+    if (data != KVStore::KVMap{{"f", "6"}}) {
+        SPDLOG_ERROR("thaw: clear tombstone not merged, {} keys", data.size());
+        return;
+    }
+    SPDLOG_INFO("thaw: {} keys after clear", data.size());
+}
+
+// 版本号创建时为 1，每次修改加 1，删除后为 0，冻结期间的修改同样生效
+void test_version() {
+    KVStore store;
+    store.put("a", "1");
+    int64_t created = store.version("a");
+    store.put("a", "2");
+    store.append("a", "3");
+    int64_t written = store.version("a");
+    auto view = store.freeze();
+    store.put("a", "4");
+    store.erase("b");
+    int64_t frozen = store.version("a");
+    if (created != 1 || written != 3 || frozen != 4 || view.versions->at("a") != 3) {
+        SPDLOG_ERROR("version: created {} written {} frozen {} view {}", created, written, frozen, view.versions->at("a"));
+        return;
+    }
+    store.erase("a");
+    if (store.version("a") != 0 || store.version("b") != 0) {
+        SPDLOG_ERROR("version: deleted key has version {}", store.version("a"));
+        return;
+    }
+    // 删除之后重新创建，版本号从 1 开始
+    store.put("a", "5");
+    view = {};
+    store.thaw();
+    if (store.version("a") != 1) {
+        SPDLOG_ERROR("version: recreated key has version {}", store.version("a"));
+        return;
+    }
+    view = store.freeze();
+    store.clear();
+    view = {};
+    store.thaw();
+    if (store.version("a") != 0) {
+        SPDLOG_ERROR("version: cleared key has version {}", store.version("a"));
+        return;
+    }
+    // 从快照恢复时版本号和数据一起替换
+    store.restore({{"c", "1"}}, {{"c", 7}});
+    if (store.version("c") != 7 || store.version("a") != 0) {
+        SPDLOG_ERROR("version: restored key has version {}", store.version("c"));
+        return;
+    }
+    SPDLOG_INFO("version: created {}, after two writes {}, while frozen {}", created, written, frozen);
+}
+
+int main() {
+    test_frozen_write();
+    test_thaw();
+    test_version();
+}
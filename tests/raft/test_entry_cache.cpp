@@ -0,0 +1,100 @@
+//
+// Created by zavier on 2023/2/19.
+//
+
+#include "acid/common/config.h"
+#include "acid/raft/raft_log.h"
+
+using namespace acid;
+using namespace acid::raft;
+
+// 持久化之后占用不超过容量，没有持久化的日志不会被淘汰
+void test_budget() {
+    uint64_t capacity = 10 * 1000;
+    EntryCache cache(capacity);
+    for (int64_t i = 1; i <= 100; ++i) {
+        cache.put(i, std::string(1000, 'a'));
+    }
+    if (cache.bytes() != 100 * 1000 || !cache.get(1)) {
+        SPDLOG_ERROR("budget: unstable entries evicted, {} bytes", cache.bytes());
+        return;
+    }
+    cache.stableTo(50);
+    if (!cache.get(51) || !cache.get(100)) {
+        SPDLOG_ERROR("budget: unstable entries evicted after stableTo(50)");
+        return;
+    }
+    cache.stableTo(100);
+    if (cache.bytes() > capacity || cache.get(1) || !cache.get(100)) {
+        SPDLOG_ERROR("budget: {} bytes after stableTo(100), capacity {}", cache.bytes(), capacity);
+        return;
+    }
+    // 从 WAL 读回的日志同样受容量限制
+    for (int64_t i = 1; i <= 100; ++i) {
+        cache.put(i, std::string(1000, 'b'));
+        if (cache.bytes() > capacity) {
+            SPDLOG_ERROR("budget: {} bytes after put({})", cache.bytes(), i);
+            return;
+        }
+    }
+    SPDLOG_INFO("budget: {} bytes, capacity {}", cache.bytes(), capacity);
+}
+
+// 大量没有持久化的日志超过容量时，只淘汰已经持久化的日志，没有持久化的日志全部保留
+void test_pinned() {
+    EntryCache cache(1000);
+    uint64_t n = 100000;
+    for (uint64_t i = n + 1; i <= 2 * n; ++i) {
+        cache.put(i, std::string(100, 'a'));
+    }
+    cache.stableTo(n);
+    for (uint64_t i = 1; i <= n; ++i) {
+        cache.put(i, std::string(100, 'b'));
+    }
+    if (cache.bytes() != n * 100 || cache.get(1) || !cache.get(2 * n)) {
+        SPDLOG_ERROR("pinned: {} bytes", cache.bytes());
+        return;
+    }
+    SPDLOG_INFO("pinned: {} puts with {} pinned entries, {} bytes", n, n, cache.bytes());
+}
+
+// 被淘汰的日志从 WAL 中重新读取
+void test_reread() {
+    std::filesystem::remove_all("entry-cache");
+    Config::Lookup<uint64_t>("raft.log.cache_size")->setValue(10 * 1000);
+    Persister::ptr persister = std::make_shared<Persister>("entry-cache");
+    RaftLog log(persister);
+    std::vector<Entry> ents;
+    for (int64_t i = 1; i <= 100; ++i) {
+        Entry entry;
+        entry.index = i;
+        entry.term = 1;
+        entry.data = std::string(1000, 'a' + i % 26);
+        ents.push_back(entry);
+    }
+    log.append(ents);
+    persister->persist({1, -1, 0}, log.unstableEntries());
+    log.stableTo(100);
+    log.persistedTo(100);
+    for (int round = 0; round < 2; ++round) {
+        auto all = log.slice(1, 101, RaftLog::NO_LIMIT);
+        if (all.size() != 100) {
+            SPDLOG_ERROR("reread: {} entries", all.size());
+            return;
+        }
+        for (auto& entry: all) {
+            if (entry.data.str() != std::string(1000, 'a' + entry.index % 26)) {
+                SPDLOG_ERROR("reread: entry {} mismatch", entry.index);
+                return;
+            }
+        }
+    }
+    SPDLOG_INFO("reread: 100 entries read back with a {} bytes cache", 10 * 1000);
+    std::filesystem::remove_all("entry-cache");
+}
+
+int main() {
+    test_budget();
+    test_pinned();
+    test_reread();
+}
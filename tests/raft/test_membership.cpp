@@ -0,0 +1,113 @@
+//
+// Created by zavier on 2023/2/20.
+//
+
+#include "acid/raft/raft_node.h"
+
+using namespace acid;
+using namespace acid::raft;
+
+// Node[1] 单独启动成为 Leader，Node[2] 作为 learner 加入，Node[3] 的地址上没有节点
+std::map<int64_t, std::string> peers1 = {
+        {1, "localhost:7141"},
+};
+std::map<int64_t, std::string> peers2 = {
+        {1, "localhost:7141"},
+        {2, "localhost:7142"},
+};
+
+std::unique_ptr<RaftNode> startNode(std::map<int64_t, std::string>& peers, int64_t id) {
+    std::filesystem::remove_all(fmt::format("membership-{}", id));
+    Persister::ptr persister = std::make_shared<Persister>(fmt::format("membership-{}", id));
+    co::co_chan<ApplyBatch> applyChan;
+    auto node = std::make_unique<RaftNode>(peers, id, persister, applyChan);
+    node->bind(Address::LookupAny(peers[id]));
+    go [applyChan] {
+        // 只需要消费达成共识的日志
+        ApplyBatch batch;
+        while (applyChan.pop(batch)) {
+        }
+    };
+    // 独立运行的节点启动后阻塞在 rpc 服务上
+    go [node = node.get()] {
+        node->start();
+    };
+    return node;
+}
+
+template<class Pred>
+bool waitFor(Pred pred) {
+    for (int i = 0; i < 10; ++i) {
+        if (pred()) {
+            return true;
+        }
+        sleep(1);
+    }
+    return false;
+}
+
+bool check(const std::string& step, ConfChangeResult result, ConfChangeResult expect) {
+    if (result != expect) {
+        SPDLOG_ERROR("{}: got result {}, expect {}", step, (int)result, (int)expect);
+        return false;
+    }
+    SPDLOG_INFO("{}: ok", step);
+    return true;
+}
+
+void Main() {
+    auto node1 = startNode(peers1, 1);
+    if (!waitFor([&] { return node1->isLeader(); })) {
+        SPDLOG_ERROR("Node[1] is not leader");
+        return;
+    }
+    auto node2 = startNode(peers2, 2);
+    if (!check("add learner", node1->addLearner(2, peers2[2]), ConfChangeResult::Ok)) {
+        return;
+    }
+    // 等待 learner 的配置提交并追上日志
+    waitFor([&] { return node2->getConfState().isLearner(2); });
+    sleep(1);
+    if (!check("add existing member", node1->addLearner(2, peers2[2]), ConfChangeResult::Invalid)
+        || !check("propose on learner", node2->addLearner(4, "localhost:7144"), ConfChangeResult::NotLeader)
+        || !check("add unreachable learner", node1->addLearner(3, "localhost:7143"), ConfChangeResult::Ok)) {
+        return;
+    }
+    // learner 不影响 commit，只有 Node[1] 一个 voter 时立即提交
+    sleep(1);
+    if (!check("promote lagging learner", node1->promoteLearner(3), ConfChangeResult::NotCaughtUp)
+        || !check("promote non-learner", node1->promoteLearner(4), ConfChangeResult::Invalid)
+        || !check("remove only voter", node1->removeMember(1), ConfChangeResult::Invalid)
+        || !check("promote learner", node1->promoteLearner(2), ConfChangeResult::Ok)) {
+        return;
+    }
+    // 联合共识提交后自动离开
+    if (!waitFor([&] { auto conf = node1->getConfState(); return !conf.joint() && conf.isVoter(2); })) {
+        SPDLOG_ERROR("promote learner: conf state {}", node1->getConfState().toString());
+        return;
+    }
+    if (!check("remove learner", node1->removeMember(3), ConfChangeResult::Ok)) {
+        return;
+    }
+    if (!waitFor([&] { return !node1->getConfState().contains(3); })) {
+        SPDLOG_ERROR("remove learner: conf state {}", node1->getConfState().toString());
+        return;
+    }
+    // Node[2] 停止后新的配置得不到大多数，提交之前拒绝其他的成员变更
+    node2->stop();
+    if (!check("add learner without quorum", node1->addLearner(3, "localhost:7143"), ConfChangeResult::Ok)
+        || !check("add learner while pending", node1->addLearner(4, "localhost:7144"), ConfChangeResult::Pending)
+        || !check("remove member while pending", node1->removeMember(2), ConfChangeResult::Pending)) {
+        return;
+    }
+    SPDLOG_INFO("conf state {}", node1->getConfState().toString());
+}
+
+int main() {
+    go [] {
+        Main();
+        // 调度器不会自己退出
+        exit(EXIT_SUCCESS);
+    };
+    co_sched.Start();
+}
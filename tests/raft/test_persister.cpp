@@ -2,11 +2,61 @@
 // Created by zavier on 2022/11/28.
 //
 
+#include "acid/common/config.h"
 #include "acid/raft/persister.h"
 
+using namespace acid;
 using namespace acid::raft;
 
+// 每种刷盘策略写入的状态、日志和快照在重新打开后都能完整恢复，未知的策略按 always 处理
+void test_sync_policy() {
+    for (std::string policy: {"always", "batch", "none", "unknown"}) {
+        Config::Lookup<std::string>("raft.wal.sync_policy")->setValue(policy);
+        std::string dir = "sync-policy-" + policy;
+        std::filesystem::remove_all(dir);
+        {
+            Persister persister(dir);
+            std::vector<Entry> ents;
+            for (int64_t i = 1; i <= 10; ++i) {
+                Entry entry;
+                entry.index = i;
+                entry.term = 1;
+                entry.data = fmt::format("{}-{}", policy, i);
+                ents.push_back(entry);
+            }
+            // 先攒一批再等待落盘，和 Raft 节点的用法一致
+            uint64_t seq = persister.append({1, 1, 5}, {ents.begin(), ents.begin() + 5});
+            persister.append({1, 1, 10}, {ents.begin() + 5, ents.end()});
+            if (!persister.wait(seq) || !persister.wait(seq + 1)) {
+                SPDLOG_ERROR("sync policy {}: wait fail", policy);
+                return;
+            }
+            Snapshot::ptr snap = std::make_shared<Snapshot>();
+            snap->metadata = {.index = 5, .term = 1};
+            snap->data = policy;
+            if (!persister.saveSnapshot(snap)) {
+                SPDLOG_ERROR("sync policy {}: save snapshot fail", policy);
+                return;
+            }
+        }
+        Persister persister(dir);
+        auto hs = persister.loadHardState();
+        auto ents = persister.loadEntries();
+        auto snap = persister.loadSnapshot();
+        if (!hs || hs->commit != 10 || !ents || ents->back().index != 10 || ents->back().data.str() != policy + "-10"
+                || !snap || snap->metadata.index != 5 || snap->data != policy) {
+            SPDLOG_ERROR("sync policy {}: state lost after reopen", policy);
+            return;
+        }
+        SPDLOG_INFO("sync policy {}: {} entries and snapshot {} recovered", policy, ents->size(), snap->metadata.index);
+        std::filesystem::remove_all(dir);
+    }
+    Config::Lookup<std::string>("raft.wal.sync_policy")->setValue("always");
+}
+
 int main() {
+    test_sync_policy();
+
     Persister persister(".");
 
     HardState hs;
@@ -27,7 +77,17 @@ int main() {
     snap->data = "snap";
 
     // 持久化存储
-    persister.persist(hs, ents, snap);
+    persister.persist(hs, ents);
+
+    // 只追加新增的日志
+    entry.index = 2;
+    entry.data = "entry2";
+    persister.persist(hs, {entry});
+
+    // 与已持久化的日志冲突，覆盖 index 2 之后的日志
+    entry.term = 3;
+    entry.data = "entry2-overwrite";
+    persister.persist(hs, {entry}, snap);
 
     if (!persister.loadHardState() || !persister.loadEntries()) {
         SPDLOG_CRITICAL("persist fail, maybe path error");
@@ -40,7 +100,8 @@ int main() {
 
     SPDLOG_INFO("hs.term {}, hs.vote {}, hs.commit {}", hs.term, hs.vote, hs.commit);
     for (auto ent: ents) {
-        SPDLOG_INFO("entry.index {}, entry.term {}, entry.data {}", entry.index, entry.term, entry.data);
+        SPDLOG_INFO("entry.index {}, entry.term {}, entry.data {}", ent.index, ent.term, ent.data);
     }
+    SPDLOG_INFO("raft state size {}", persister.getRaftStateSize());
     SPDLOG_INFO("snap->metadata.term {}, snap->metadata.index {}, snap->data {}", snap->metadata.term, snap->metadata.index, snap->data);
 }
\ No newline at end of file
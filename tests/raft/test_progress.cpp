@@ -0,0 +1,106 @@
+//
+// Created by zavier on 2023/2/14.
+//
+
+#include "acid/raft/progress.h"
+
+using namespace acid::raft;
+
+bool check(const std::string& step, bool ok, const Progress& pr) {
+    if (!ok) {
+        SPDLOG_ERROR("{}: {}", step, pr.toString());
+        return false;
+    }
+    return true;
+}
+
+// 探测状态每次只发送一条消息，拒绝后按 Follower 的建议回退，过期的拒绝被忽略
+void test_probe() {
+    Progress pr(11, 2);
+    if (!check("probe not paused", !pr.isPaused(), pr)) {
+        return;
+    }
+    pr.pause();
+    if (!check("probe paused after send", pr.isPaused(), pr)
+        || !check("stale reject ignored", !pr.maybeDecrTo(5, 0) && pr.next() == 11, pr)
+        || !check("reject with hint", pr.maybeDecrTo(10, 7) && pr.next() == 7 && !pr.isPaused(), pr)) {
+        return;
+    }
+    // 心跳允许再发送一条探测，用来从丢失的消息中恢复
+    pr.pause();
+    pr.onHeartbeat();
+    if (!check("heartbeat resumes probe", !pr.isPaused(), pr)
+        || !check("probe matched", pr.maybeUpdate(6) && pr.match() == 6 && pr.next() == 7, pr)) {
+        return;
+    }
+    SPDLOG_INFO("probe: {}", pr.toString());
+}
+
+// 复制状态在窗口内流水线发送，窗口满了暂停，确认后释放
+void test_replicate() {
+    Progress pr(7, 2);
+    pr.maybeUpdate(6);
+    pr.becomeReplicate();
+    pr.optimisticUpdate(8);
+    pr.inflights().add(8);
+    if (!check("window not full", !pr.isPaused() && pr.next() == 9, pr)) {
+        return;
+    }
+    pr.optimisticUpdate(9);
+    pr.inflights().add(9);
+    if (!check("window full", pr.isPaused() && pr.inflights().count() == 2, pr)) {
+        return;
+    }
+    pr.maybeUpdate(8);
+    pr.inflights().freeLE(8);
+    if (!check("ack frees window", !pr.isPaused() && pr.match() == 8 && pr.next() == 10, pr)
+        || !check("reordered ack ignored", !pr.maybeUpdate(7) && pr.match() == 8, pr)) {
+        return;
+    }
+    // 窗口满了一直没有响应，心跳释放最早的一条
+    pr.optimisticUpdate(10);
+    pr.inflights().add(10);
+    pr.onHeartbeat();
+    if (!check("heartbeat frees one", !pr.isPaused() && pr.inflights().count() == 1, pr)
+        || !check("stale reject ignored", !pr.maybeDecrTo(8, 0) && pr.next() == 11, pr)
+        || !check("reject falls back to match", pr.maybeDecrTo(9, 0) && pr.next() == 9, pr)) {
+        return;
+    }
+    pr.becomeProbe();
+    if (!check("back to probe", pr.state() == Progress::Probe && pr.inflights().count() == 0 && pr.next() == 9, pr)) {
+        return;
+    }
+    SPDLOG_INFO("replicate: {}", pr.toString());
+}
+
+// 快照状态暂停发送日志，发送成功后从快照之后探测，失败后从 match 之后探测
+void test_snapshot() {
+    Progress pr(9, 2);
+    pr.maybeUpdate(8);
+    pr.becomeSnapshot(100);
+    if (!check("snapshot paused", pr.isPaused() && pr.pendingSnapshot() == 100, pr)) {
+        return;
+    }
+    pr.snapshotFailure();
+    pr.becomeProbe();
+    if (!check("snapshot failure", pr.state() == Progress::Probe && pr.next() == 9, pr)) {
+        return;
+    }
+    pr.becomeSnapshot(100);
+    pr.maybeUpdate(100);
+    pr.becomeProbe();
+    if (!check("snapshot done", pr.next() == 101 && pr.match() == 100, pr)) {
+        return;
+    }
+    pr.becomeReplicate();
+    if (!check("replicate after snapshot", pr.state() == Progress::Replicate && pr.next() == 101, pr)) {
+        return;
+    }
+    SPDLOG_INFO("snapshot: {}", pr.toString());
+}
+
+int main() {
+    test_probe();
+    test_replicate();
+    test_snapshot();
+}
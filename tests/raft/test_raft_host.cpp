@@ -0,0 +1,197 @@
+//
+// Created by zavier on 2023/2/21.
+//
+
+#include <mutex>
+#include "acid/raft/raft_host.h"
+
+using namespace acid;
+using namespace acid::raft;
+
+std::map<int64_t, std::string> peers = {
+        {1, "localhost:7161"},
+        {2, "localhost:7162"},
+        {3, "localhost:7163"},
+};
+
+std::map<int64_t, RaftHost::ptr> hosts;
+// 组 id 到各个节点上的 Raft 组的映射
+std::map<uint64_t, std::map<int64_t, RaftNode::ptr>> groups;
+// 各个节点上每个 Raft 组应用的日志内容
+std::mutex appliedMutex;
+std::map<uint64_t, std::map<int64_t, std::vector<std::string>>> applied;
+
+void startHosts(const std::vector<uint64_t>& ids) {
+    for (auto& [id, address]: peers) {
+        auto host = std::make_shared<RaftHost>(id);
+        host->bind(Address::LookupAny(address));
+        for (auto group: ids) {
+            std::string dir = fmt::format("raft-host-{}-{}", id, group);
+            std::filesystem::remove_all(dir);
+            co::co_chan<ApplyBatch> applyChan;
+            groups[group][id] = host->addGroup(group, peers, std::make_shared<Persister>(dir), applyChan);
+            go [applyChan, group, id] {
+                ApplyBatch batch;
+                while (applyChan.pop(batch)) {
+                    std::unique_lock<std::mutex> lock(appliedMutex);
+                    for (auto& msg: batch) {
+                        if (msg.type == ApplyMsg::ENTRY && !msg.data.str().empty()) {
+                            applied[group][id].push_back(msg.data.str());
+                        }
+                    }
+                }
+            };
+        }
+        // 启动 rpc 服务会阻塞，放到单独的协程
+        go [host] {
+            host->start();
+        };
+        hosts[id] = host;
+    }
+    for (auto& [_, nodes]: groups) {
+        for (auto& [_, node]: nodes) {
+            node->start();
+        }
+    }
+}
+
+template<class Pred>
+bool waitFor(Pred pred, int seconds = 10) {
+    for (int i = 0; i < seconds; ++i) {
+        if (pred()) {
+            return true;
+        }
+        sleep(1);
+    }
+    return false;
+}
+
+// 组内的 Leader，没有返回 -1
+int64_t leaderOf(uint64_t group) {
+    for (auto& [id, node]: groups[group]) {
+        if (hosts.contains(id) && node->isLeader()) {
+            return id;
+        }
+    }
+    return -1;
+}
+
+// 每个组的日志只复制和应用到同一个组
+void test_routing() {
+    for (auto& [group, _]: groups) {
+        if (!waitFor([group] { return leaderOf(group) != -1; })) {
+            SPDLOG_ERROR("routing: group {} has no leader", group);
+            return;
+        }
+        for (int i = 0; i < 3; ++i) {
+            groups[group][leaderOf(group)]->propose(fmt::format("group-{}-{}", group, i));
+        }
+    }
+    auto all_applied = [] {
+        std::unique_lock<std::mutex> lock(appliedMutex);
+        for (auto& [group, _]: groups) {
+            for (auto& [id, _]: peers) {
+                if (applied[group][id].size() < 3) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+    if (!waitFor(all_applied)) {
+        SPDLOG_ERROR("routing: entries not applied on every node");
+        return;
+    }
+    std::unique_lock<std::mutex> lock(appliedMutex);
+    for (auto& [group, nodes]: applied) {
+        for (auto& [id, entries]: nodes) {
+            std::vector<std::string> expect;
+            for (int i = 0; i < 3; ++i) {
+                expect.push_back(fmt::format("group-{}-{}", group, i));
+            }
+            if (entries != expect) {
+                SPDLOG_ERROR("routing: Node[{}] group {} applied {}", id, group, fmt::join(entries, ","));
+                return;
+            }
+        }
+    }
+    SPDLOG_INFO("routing: {} groups applied their own entries on {} nodes", groups.size(), peers.size());
+}
+
+// 所有 Raft 组都静默之后，节点之间仍然每个周期发送一条合并心跳，节点存活的判断和组的数量无关
+void test_coalescing() {
+    auto all_quiesced = [] {
+        for (auto& [_, nodes]: groups) {
+            for (auto& [_, node]: nodes) {
+                if (!node->isQuiesced()) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+    if (!waitFor(all_quiesced)) {
+        SPDLOG_ERROR("coalescing: groups not quiesced");
+        return;
+    }
+    uint64_t start = GetSteadyMS();
+    sleep(2);
+    for (auto& [id, host]: hosts) {
+        for (auto& [peer, _]: peers) {
+            if (peer != id && host->lastContact(peer) <= start) {
+                SPDLOG_ERROR("coalescing: Node[{}] lost contact with Node[{}] while quiesced", id, peer);
+                return;
+            }
+        }
+    }
+    // 到同一个远端节点的所有组共用一个连接
+    auto address = Address::LookupAny(peers[2]);
+    if (hosts[1]->getConnection(2, address) != hosts[1]->getConnection(2, address)) {
+        SPDLOG_ERROR("coalescing: connections not shared");
+        return;
+    }
+    SPDLOG_INFO("coalescing: {} quiesced groups, node heartbeats still flowing", groups.size());
+}
+
+// 静默的 Leader 所在的节点宕机后，Follower 在一个选举超时内发现节点心跳中断，选出新的 Leader
+void test_quiesced_leader_dies(uint64_t group) {
+    if (!waitFor([group] { return leaderOf(group) != -1; })) {
+        SPDLOG_ERROR("quiesced leader dies: no leader");
+        return;
+    }
+    auto all_quiesced = [group] {
+        return std::all_of(groups[group].begin(), groups[group].end(), [](auto& node) { return node.second->isQuiesced();});
+    };
+    if (!waitFor(all_quiesced)) {
+        SPDLOG_ERROR("quiesced leader dies: group {} not quiesced", group);
+        return;
+    }
+    int64_t leader = leaderOf(group);
+    int64_t term = groups[group][leader]->getState().first;
+    hosts[leader]->stop();
+    hosts.erase(leader);
+    uint64_t start = GetSteadyMS();
+    auto elected = [group, term] {
+        int64_t id = leaderOf(group);
+        return id != -1 && groups[group][id]->getState().first > term;
+    };
+    if (!waitFor(elected)) {
+        SPDLOG_ERROR("quiesced leader dies: no new leader after Node[{}] died", leader);
+        return;
+    }
+    SPDLOG_INFO("quiesced leader dies: Node[{}] died, Node[{}] elected after {}ms", leader, leaderOf(group), GetSteadyMS() - start);
+}
+
+void Main() {
+    startHosts({1, 2, 3});
+    test_routing();
+    test_coalescing();
+    test_quiesced_leader_dies(1);
+    // 调度器不会自己退出
+    exit(EXIT_SUCCESS);
+}
+
+int main() {
+    go Main;
+    co_sched.Start();
+}
@@ -16,7 +16,7 @@ std::map<int64_t, std::string> peers = {
 void Main() {
     int64_t id = 3;
     Persister::ptr persister = std::make_shared<Persister>(fmt::format("raft-node-{}", id));
-    co::co_chan<ApplyMsg> applyChan;
+    co::co_chan<ApplyBatch> applyChan;
     RaftNode node(peers, id, persister, applyChan);
     Address::ptr addr = Address::LookupAny(peers[node.getNodeId()]);
     node.bind(addr);
@@ -30,15 +30,19 @@ void Main() {
     };
     go [applyChan] {
         // 接收raft达成共识的日志
-        ApplyMsg msg;
-        while (applyChan.pop(msg)) {
-            switch (msg.type) {
-                case ApplyMsg::ENTRY:
-                    SPDLOG_INFO("entry-> index: {}, term: {}, data: {}", msg.index, msg.term, msg.data);
-                    break;
-                case ApplyMsg::SNAPSHOT:
-                    SPDLOG_INFO("snapshot-> index: {}, term: {}, data: {}", msg.index, msg.term, msg.data);
-                    break;
+        ApplyBatch batch;
+        while (applyChan.pop(batch)) {
+            for (auto& msg: batch) {
+                switch (msg.type) {
+                    case ApplyMsg::ENTRY:
+                        SPDLOG_INFO("entry-> index: {}, term: {}, data: {}", msg.index, msg.term, msg.data);
+                        break;
+                    case ApplyMsg::SNAPSHOT:
+                        SPDLOG_INFO("snapshot-> index: {}, term: {}, data: {}", msg.index, msg.term, msg.data);
+                        break;
+                    default:
+                        break;
+                }
             }
         }
     };
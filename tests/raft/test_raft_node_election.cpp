@@ -0,0 +1,239 @@
+//
+// Created by zavier on 2023/2/22.
+//
+
+#include "acid/common/config.h"
+#include "acid/raft/raft_host.h"
+
+using namespace acid;
+using namespace acid::raft;
+
+std::map<int64_t, std::string> peers = {
+        {1, "localhost:7181"},
+        {2, "localhost:7182"},
+        {3, "localhost:7183"},
+};
+// 被隔离的 Node[3] 监听另一个端口，其他节点的地址上都没有节点，双向都不通
+std::map<int64_t, std::string> isolated = {
+        {1, "localhost:7185"},
+        {2, "localhost:7186"},
+        {3, "localhost:7184"},
+};
+
+const uint64_t group = 1;
+std::map<int64_t, RaftHost::ptr> hosts;
+std::map<int64_t, RaftNode::ptr> nodes;
+std::map<int64_t, Persister::ptr> persisters;
+// 已经关闭的节点，协程中可能还在使用，不能析构
+std::vector<RaftHost::ptr> stopped;
+std::vector<RaftNode::ptr> stoppedNodes;
+
+void startNode(int64_t id, std::map<int64_t, std::string>& servers) {
+    if (!persisters.contains(id)) {
+        std::string dir = fmt::format("raft-election-{}", id);
+        std::filesystem::remove_all(dir);
+        persisters[id] = std::make_shared<Persister>(dir);
+    }
+    auto host = std::make_shared<RaftHost>(id);
+    host->bind(Address::LookupAny(servers[id]));
+    co::co_chan<ApplyBatch> applyChan;
+    auto node = host->addGroup(group, servers, persisters[id], applyChan);
+    go [applyChan] {
+        // 只需要消费达成共识的日志
+        ApplyBatch batch;
+        while (applyChan.pop(batch)) {
+        }
+    };
+    // 启动 rpc 服务会阻塞，放到单独的协程
+    go [host] {
+        host->start();
+    };
+    node->start();
+    hosts[id] = host;
+    nodes[id] = node;
+}
+
+void stopNode(int64_t id) {
+    hosts[id]->stop();
+    stopped.push_back(hosts[id]);
+    stoppedNodes.push_back(nodes[id]);
+    hosts.erase(id);
+    nodes.erase(id);
+}
+
+template<class Pred>
+bool waitFor(Pred pred, int seconds = 10) {
+    for (int i = 0; i < seconds; ++i) {
+        if (pred()) {
+            return true;
+        }
+        sleep(1);
+    }
+    return false;
+}
+
+// 存活节点中的 Leader，没有返回 -1
+int64_t leader() {
+    for (auto& [id, node]: nodes) {
+        if (node->isLeader()) {
+            return id;
+        }
+    }
+    return -1;
+}
+
+// 开启预投票时，被隔离的节点得不到预投票，任期不会增加，重新加入集群后不会打断 Leader
+void test_pre_vote() {
+    startNode(1, peers);
+    startNode(2, peers);
+    startNode(3, isolated);
+    if (!waitFor([] { return leader() != -1; })) {
+        SPDLOG_ERROR("pre vote: no leader");
+        return;
+    }
+    int64_t id = leader();
+    int64_t term = nodes[id]->getState().first;
+    // 隔离几个选举超时，没有预投票的话每个超时都会增加一次任期
+    sleep(8);
+    int64_t isolatedTerm = nodes[3]->getState().first;
+    if (isolatedTerm != 0) {
+        SPDLOG_ERROR("pre vote: isolated Node[3] increased term to {}", isolatedTerm);
+        return;
+    }
+    // 重新加入集群
+    stopNode(3);
+    startNode(3, peers);
+    if (!waitFor([id] { return nodes[3]->getLeaderId() == id; })) {
+        SPDLOG_ERROR("pre vote: Node[3] does not follow Node[{}] after rejoining", id);
+        return;
+    }
+    // 再等一个选举超时，确认重新加入的节点没有发起选举
+    sleep(3);
+    if (leader() != id || nodes[id]->getState().first != term || nodes[3]->getState().first != term) {
+        SPDLOG_ERROR("pre vote: leader Node[{}] term {} changed to Node[{}] term {}", id, term, leader(),
+                     leader() == -1 ? -1 : nodes[leader()]->getState().first);
+        return;
+    }
+    SPDLOG_INFO("pre vote: Node[3] rejoined at term {}, Node[{}] is still leader", term, id);
+}
+
+// Leader 确认领导地位之后返回的读索引不小于已经提交的日志，Follower 不提供读索引
+void test_read_index() {
+    int64_t id = leader();
+    auto entry = id == -1 ? std::nullopt : nodes[id]->propose("read-index");
+    if (!entry) {
+        SPDLOG_ERROR("read index: no leader accepts proposals");
+        return;
+    }
+    auto confirmed = [id, index = entry->index] {
+        auto read = nodes[id]->readIndex();
+        return read && *read >= index;
+    };
+    if (!waitFor(confirmed)) {
+        SPDLOG_ERROR("read index: Node[{}] read index is behind entry {}", id, entry->index);
+        return;
+    }
+    int64_t follower = id % 3 + 1;
+    if (nodes[follower]->readIndex()) {
+        SPDLOG_ERROR("read index: follower Node[{}] returned a read index", follower);
+        return;
+    }
+    SPDLOG_INFO("read index: Node[{}] confirmed read index after entry {}", id, entry->index);
+}
+
+// 领导权转移到目标节点
+void test_transfer() {
+    if (!waitFor([] { return leader() != -1; })) {
+        SPDLOG_ERROR("transfer: no leader");
+        return;
+    }
+    int64_t from = leader();
+    int64_t term = nodes[from]->getState().first;
+    int64_t target = from % 3 + 1;
+    if (!nodes[from]->transferLeadership(target)) {
+        SPDLOG_ERROR("transfer: Node[{}] failed to transfer leadership to Node[{}]", from, target);
+        return;
+    }
+    if (!waitFor([target] { return leader() == target; })) {
+        SPDLOG_ERROR("transfer: leader is Node[{}], expect Node[{}]", leader(), target);
+        return;
+    }
+    SPDLOG_INFO("transfer: leadership moved from Node[{}] to Node[{}], term {} -> {}",
+                from, target, term, nodes[target]->getState().first);
+}
+
+// 开始转移领导权之后不再使用租约读，目标节点随时可能当选
+void test_lease_read_after_transfer() {
+    Config::Lookup<bool>("raft.read.lease")->setValue(true);
+    // 租约的有效期，超过之后即使没有转移领导权也不能使用租约读
+    uint64_t lease = Config::Lookup<size_t>("raft.timer.election.base")->getValue()
+            - Config::Lookup<size_t>("raft.read.lease_drift")->getValue();
+    int64_t id = leader();
+    if (id == -1 || !waitFor([id] { return nodes[id]->readIndex().has_value(); })) {
+        SPDLOG_ERROR("lease read after transfer: no leader can serve reads");
+        return;
+    }
+    // 其他节点宕机后只能靠租约读，确认领导地位一定失败
+    for (auto& [peer, _]: peers) {
+        if (peer != id) {
+            stopNode(peer);
+        }
+    }
+    uint64_t start = GetSteadyMS();
+    if (!nodes[id]->readIndex()) {
+        SPDLOG_ERROR("lease read after transfer: lease read refused before transfer");
+        return;
+    }
+    int64_t target = id % 3 + 1;
+    go [id, target] {
+        nodes[id]->transferLeadership(target);
+    };
+    co_sleep(10);
+    uint64_t elapsed = GetSteadyMS() - start;
+    if (elapsed >= lease) {
+        SPDLOG_ERROR("lease read after transfer: lease expired after {}ms before the check", elapsed);
+        return;
+    }
+    if (nodes[id]->readIndex()) {
+        SPDLOG_ERROR("lease read after transfer: read served by lease while transferring to Node[{}]", target);
+        return;
+    }
+    SPDLOG_INFO("lease read after transfer: read refused {}ms after the last lease read", elapsed);
+}
+
+// Leader 在一个选举超时内没有收到大多数节点的响应，主动退位
+void test_check_quorum() {
+    int64_t id = leader();
+    if (id == -1) {
+        SPDLOG_ERROR("check quorum: no leader");
+        return;
+    }
+    for (auto& [peer, _]: peers) {
+        if (peer != id && nodes.contains(peer)) {
+            stopNode(peer);
+        }
+    }
+    uint64_t start = GetSteadyMS();
+    if (!waitFor([id] { return !nodes[id]->isLeader(); })) {
+        SPDLOG_ERROR("check quorum: Node[{}] is still leader without quorum", id);
+        return;
+    }
+    SPDLOG_INFO("check quorum: Node[{}] stepped down after {}ms", id, GetSteadyMS() - start);
+}
+
+void Main() {
+    // 托管的 Raft 组空闲时会静默，关闭静默使用普通的心跳
+    Config::Lookup<bool>("raft.quiesce")->setValue(false);
+    test_pre_vote();
+    test_read_index();
+    test_transfer();
+    test_lease_read_after_transfer();
+    test_check_quorum();
+    // 调度器不会自己退出
+    exit(EXIT_SUCCESS);
+}
+
+int main() {
+    go Main;
+    co_sched.Start();
+}
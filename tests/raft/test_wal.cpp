@@ -0,0 +1,186 @@
+//
+// Created by zavier on 2023/2/21.
+//
+
+#include <filesystem>
+#include "acid/common/config.h"
+#include "acid/raft/wal.h"
+
+using namespace acid::raft;
+
+static const std::filesystem::path s_dir = "wal_test";
+
+Entry makeEntry(int64_t index, int64_t term, const std::string& data) {
+    Entry entry;
+    entry.index = index;
+    entry.term = term;
+    entry.data = data;
+    return entry;
+}
+
+size_t countSegments() {
+    size_t n = 0;
+    for (auto& file : std::filesystem::directory_iterator(s_dir)) {
+        if (file.path().extension() == ".wal") {
+            ++n;
+        }
+    }
+    return n;
+}
+
+std::filesystem::path lastSegment() {
+    std::filesystem::path last;
+    for (auto& file : std::filesystem::directory_iterator(s_dir)) {
+        if (file.path().extension() == ".wal" && file.path() > last) {
+            last = file.path();
+        }
+    }
+    return last;
+}
+
+// 重启后重放日志和状态
+void test_replay() {
+    std::filesystem::remove_all(s_dir);
+    {
+        WAL wal(s_dir, 300);
+        HardState hs{1, 2, 0};
+        // 逐条写入，让日志跨越多个段
+        for (int i = 1; i <= 10; ++i) {
+            wal.save(&hs, {makeEntry(i, 1, "data" + std::to_string(i))});
+        }
+        hs.commit = 5;
+        wal.save(&hs, {});
+    }
+    WAL wal(s_dir, 300);
+    HardState hs{};
+    std::vector<Entry> ents;
+    if (!wal.readAll(hs, ents)) {
+        SPDLOG_ERROR("replay: no log");
+        return;
+    }
+    // 第一条为快照位置的虚拟日志
+    if (ents.size() != 11 || ents.back().index != 10 || ents[3].data.str() != "data3" || hs.commit != 5) {
+        SPDLOG_ERROR("replay: entries {} last {} commit {}", ents.size(), ents.back().index, hs.commit);
+        return;
+    }
+    SPDLOG_INFO("replay: {} segments, {} entries, term {} vote {} commit {}",
+                countSegments(), ents.size() - 1, hs.term, hs.vote, hs.commit);
+}
+
+// 尾部写了一半的记录或 crc 不匹配的记录在打开时被截断
+void test_torn_tail() {
+    std::filesystem::remove_all(s_dir);
+    HardState hs{1, 1, 0};
+    {
+        WAL wal(s_dir, 1024 * 1024);
+        wal.save(&hs, {makeEntry(1, 1, "a"), makeEntry(2, 1, "b")});
+    }
+    auto last = lastSegment();
+    auto size = std::filesystem::file_size(last);
+    // 长度字段声明了 16 字节，实际只写入了 4 字节
+    FILE* fp = fopen(last.c_str(), "ab");
+    fwrite("\x10\x00\x00\x00garb", 1, 8, fp);
+    fclose(fp);
+    {
+        WAL wal(s_dir, 1024 * 1024);
+        std::vector<Entry> ents;
+        wal.readAll(hs, ents);
+        if (ents.back().index != 2 || std::filesystem::file_size(last) != size) {
+            SPDLOG_ERROR("torn tail: last {} size {} expect {}", ents.back().index, std::filesystem::file_size(last), size);
+            return;
+        }
+        // 截断后可以继续追加
+        wal.save(nullptr, {makeEntry(3, 1, "c")});
+    }
+    // 篡改最后一条记录的内容，crc 校验失败后被丢弃
+    size = std::filesystem::file_size(last);
+    fp = fopen(last.c_str(), "r+b");
+    fseek(fp, -1, SEEK_END);
+    fputc('x', fp);
+    fclose(fp);
+    WAL wal(s_dir, 1024 * 1024);
+    std::vector<Entry> ents;
+    wal.readAll(hs, ents);
+    if (ents.back().index != 2 || std::filesystem::file_size(last) >= size) {
+        SPDLOG_ERROR("crc: last {}", ents.back().index);
+        return;
+    }
+    SPDLOG_INFO("torn tail: truncated to index {}", ents.back().index);
+}
+
+// 与已写入的日志冲突时覆盖之后的日志，重放时也以新日志为准
+void test_conflict() {
+    std::filesystem::remove_all(s_dir);
+    HardState hs{1, 1, 0};
+    {
+        WAL wal(s_dir, 300);
+        std::vector<Entry> ents;
+        for (int i = 1; i <= 10; ++i) {
+            ents.push_back(makeEntry(i, 1, "data" + std::to_string(i)));
+        }
+        wal.save(&hs, ents);
+        hs.term = 2;
+        wal.save(&hs, {makeEntry(8, 2, "new8"), makeEntry(9, 2, "new9")});
+        std::vector<Entry> read;
+        if (!wal.read(8, 10, read) || read.size() != 2 || read[0].data.str() != "new8") {
+            SPDLOG_ERROR("conflict: read after overwrite failed");
+            return;
+        }
+        // 被覆盖的日志 10 不再存在
+        if (wal.read(10, 11, read)) {
+            SPDLOG_ERROR("conflict: stale entry 10 still readable");
+            return;
+        }
+    }
+    WAL wal(s_dir, 300);
+    std::vector<Entry> ents;
+    wal.readAll(hs, ents);
+    if (ents.back().index != 9 || ents.back().term != 2 || ents[8].data.str() != "new8" || ents[7].term != 1) {
+        SPDLOG_ERROR("conflict: last {} term {}", ents.back().index, ents.back().term);
+        return;
+    }
+    SPDLOG_INFO("conflict: overwritten from index 8, last index {} term {}", ents.back().index, ents.back().term);
+}
+
+// 快照之后删除只包含快照之前日志的旧段，包含快照之后日志的段保留
+void test_segment_gc() {
+    std::filesystem::remove_all(s_dir);
+    HardState hs{1, 1, 0};
+    {
+        WAL wal(s_dir, 300);
+        for (int i = 1; i <= 40; ++i) {
+            wal.save(&hs, {makeEntry(i, 1, "payload-payload")});
+        }
+        size_t before = countSegments();
+        SnapshotMetadata snap{30, 1};
+        wal.saveSnapshot(snap);
+        size_t after = countSegments();
+        if (after >= before) {
+            SPDLOG_ERROR("segment gc: {} segments before snapshot, {} after", before, after);
+            return;
+        }
+        // 快照之后的日志仍然可读
+        std::vector<Entry> read;
+        if (!wal.read(31, 41, read) || read.size() != 10) {
+            SPDLOG_ERROR("segment gc: entries after snapshot lost");
+            return;
+        }
+        SPDLOG_INFO("segment gc: {} segments before snapshot, {} after", before, after);
+    }
+    WAL wal(s_dir, 300);
+    std::vector<Entry> ents;
+    wal.readAll(hs, ents);
+    if (ents.front().index != 30 || ents.front().term != 1 || ents.back().index != 40) {
+        SPDLOG_ERROR("segment gc: replay first {} last {}", ents.front().index, ents.back().index);
+        return;
+    }
+    SPDLOG_INFO("segment gc: replay from snapshot {} to {}", ents.front().index, ents.back().index);
+}
+
+int main() {
+    test_replay();
+    test_torn_tail();
+    test_conflict();
+    test_segment_gc();
+    std::filesystem::remove_all(s_dir);
+}